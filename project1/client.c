@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,45 +8,66 @@
 #include <string.h>
 #include <mqueue.h>
 #include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include "comproto.h"
+#include "comshm.h"
+#include "comlz.h"
+#include "comqueue.h"
 #define BUFFER_SIZE 1024
 #define MAXARGS 10
-#define CONNECTION_REQ 1
-#define CONNECTION_REP 2
-#define SEND_COMMAND 3
-#define COMMAND_RES 4
-#define QUIT_REQ 5
-#define QUIT_REP 6
-#define QUIT_ALL_REQ 7
-/**
- * @brief Get the Substring From Second Space object
- * 
- * @param input 
- * @return char* 
- */
-char* getSubstringFromSecondSpace(char* input) {
-    int spaceCount = 0;
-    const char* current = input;
-    while (*current != '\0') {
-        if (*current == ' ') {
-            spaceCount++;
-            if (spaceCount == 2) {
-                break;
-            }
-        }
-        current++;
-    }
-    size_t substringLength = 0;
-    const char* substringStart = current + 1;
-    while (*current != '\0') {
-        substringLength++;
-        current++;
-    }
-    char* result = (char*)malloc(substringLength + 1);
-    strncpy(result, substringStart, substringLength);
-    size_t leadingSpaces = strspn(result, " ");
-    memmove(result, result + leadingSpaces, substringLength - leadingSpaces + 1);
-    return result;
-}
+#define MAX_WINDOW 32
+#define OUTPUT_BUFFER_SIZE (4 * COM_MAX_WSIZE)
+// commands in flight are at most MAX_WINDOW * BUFFER_SIZE bytes, which the
+// CS FIFO holds without blocking while the server is writing replies
+uint32_t next_seq = 0;
+// replies are parsed from here; bytes past the current reply stay for the next one
+struct com_parser sc_parser;
+// both FIFOs, or the Unix socket, stay open for the whole session; chan is
+// set to the shared memory rings once the server accepts them, or from the
+// start if they are all there is (a server that advertises them)
+struct com_link server_link = { .rfd = -1, .wfd = -1, .chan = NULL };
+struct com_chan shm_chan;
+// result frames received since credit was last returned to the server
+uint32_t frames_unacked = 0;
+uint32_t credit_batch = COM_DEFAULT_CREDITS / 2;
+// commands the server runs at once for us; above 1 results may interleave
+int concurrency = 1;
+// connection queue shards the server was started with (its -q)
+int queue_shards = 0;
+// share of the server's execution slots asked for, relative to other clients
+int weight = 1;
+// server's Unix socket, used instead of the message queue and FIFOs
+char* sock_path = NULL;
+// ask for one shell that runs all our commands, keeping cd and variables
+int session_mode = 0;
+// a COM_F_LZ frame is decoded here before it joins its reply, and output
+// read from a pipe the server handed over passes through here
+char lz_frame[COM_MAX_WSIZE];
+// one reply per message awaiting an answer, matched by sequence number.
+// The output of one command at a time goes straight to stdout as it
+// arrives (live); the others collect here until it is their turn, in
+// buffers that are reused and grow as needed. done marks a reply that is
+// complete but waits for the live one to finish. status is the exit
+// status of the command when the server reports it, else 0. not_run marks
+// a command the server refused to run; data then holds its explanation.
+struct reply_buffer {
+    char* data;
+    size_t len;
+    size_t cap;
+    uint32_t seq;
+    int busy;
+    int done;
+    int status;
+    int not_run;
+};
+struct reply_buffer replies[MAX_WINDOW];
+struct reply_buffer* live = NULL;
+// stdout buffer; it is flushed whenever the client waits for the server,
+// so output shows up as soon as it arrives
+char output_buffer[OUTPUT_BUFFER_SIZE];
 /**
  * @brief Create a named pipes object
  * 
@@ -66,98 +88,460 @@ void create_pipes(char* cs_pipe_name, char* sc_pipe_name, pid_t pid) {
     }
 }
 /**
- * @brief 
+ * @brief Open both FIFOs for the rest of the session. They are opened
+ * read-write, so neither open waits for the server and a reply written
+ * before we read it is never discarded with a closed FIFO.
+ *
+ * @param cs_pipe_name
+ * @param sc_pipe_name
+ */
+void open_pipes(const char* cs_pipe_name, const char* sc_pipe_name) {
+    server_link.wfd = open(cs_pipe_name, O_RDWR);
+    server_link.rfd = open(sc_pipe_name, O_RDWR);
+    if (server_link.wfd == -1 || server_link.rfd == -1) {
+        perror("Error when opening named pipes");
+        exit(EXIT_FAILURE);
+    }
+}
+/**
+ * @brief Connect to the server's Unix socket, which then carries all
+ * messages both ways. No FIFOs are created.
+ *
+ * @param path
+ */
+void connect_socket(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("Error when connecting to server socket");
+        exit(EXIT_FAILURE);
+    }
+    server_link.rfd = fd;
+    server_link.wfd = fd;
+    server_link.sock = 1;
+}
+/**
+ * @brief Send the connection request, over the message queue or, when
+ * connected to the Unix socket, as the first message on it. On the socket
+ * the server is offered to hand over large outputs as pipes.
  * 
  * @param mq_name 
  * @param cs_pipe_name 
  * @param sc_pipe_name 
  * @param wsize 
+ * @param shm_name shared memory rings to offer, or NULL
+ * @param max_running commands the server may run at once for us
+ * @param compress offer to take compressed result frames
  */
-void connect_server(const char* mq_name, const char* cs_pipe_name, const char* sc_pipe_name, int wsize) {
-// printf("%s\n", cs_pipe_name);
-    mqd_t mqd = mq_open(mq_name, O_RDWR);
+void connect_server(const char* mq_name, const char* cs_pipe_name, const char* sc_pipe_name, int wsize,
+                    const char* shm_name, int max_running, int compress) {
+    struct com_conn_info info;
+    memset(&info, 0, sizeof(info));
+    info.pid = getpid();
+    info.wsize = wsize;
+    info.credits = COM_DEFAULT_CREDITS;
+    info.concurrency = max_running;
+    info.weight = weight;
+    strncpy(info.cs_name, cs_pipe_name, COM_NAME_MAX - 1);
+    strncpy(info.sc_name, sc_pipe_name, COM_NAME_MAX - 1);
+    int flags = 0;
+    if (shm_name != NULL) {
+        strncpy(info.shm_name, shm_name, COM_NAME_MAX - 1);
+        flags |= COM_F_SHM;
+    }
+    if (compress) {
+        flags |= COM_F_LZ;
+    }
+    if (session_mode) {
+        flags |= COM_F_SESSION;
+    }
+    if (server_link.sock) {
+        flags |= COM_F_FD;
+        if (com_write_msg(server_link.wfd, CONNECTION_REQ, flags, next_seq++, &info, sizeof(info)) == -1) {
+            perror("Error when sending connection request to server");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    char queue_name[BUFFER_SIZE];
+    mqd_t mqd = com_queue_open(mq_name, queue_shards, getpid(), queue_name, sizeof(queue_name));
     if (mqd == -1) {
         perror("Error opening server message queue for connection request");
         exit(EXIT_FAILURE);
     }
-    char connection_info[BUFFER_SIZE];
-    sprintf(connection_info, "%s %s %d", cs_pipe_name, sc_pipe_name, wsize);
-    char connection_request[BUFFER_SIZE + 5 + 1000];
-    int connection_info_len = strlen(connection_info) + 1;
-    sprintf(connection_request, "%d %d %s %s", connection_info_len, CONNECTION_REQ, "", connection_info);
-    if (mq_send(mqd, connection_request, connection_info_len + 5, 0) == -1) {
+    char connection_request[COM_HDR_SIZE + sizeof(info)];
+    com_encode_hdr(connection_request, CONNECTION_REQ, flags, next_seq++, sizeof(info));
+    memcpy(connection_request + COM_HDR_SIZE, &info, sizeof(info));
+    if (com_queue_send(mqd, queue_name, connection_request, sizeof(connection_request)) == -1) {
         perror("Error when sending connection request to server");
         mq_close(mqd);
         exit(EXIT_FAILURE);
     }
-	//printf("%s\n", cs_pipe_name);
     mq_close(mqd);
 }
+/**
+ * @brief Block until the next complete message from the server is parsed.
+ *
+ * @param hdr
+ * @param payload points into sc_parser until the next read
+ * @return int 0 on success, -1 if the pipe failed or the stream is corrupt
+ */
+int read_server_message(struct com_hdr* hdr, const char** payload) {
+    int r;
+    while ((r = com_parser_next(&sc_parser, hdr, payload)) == 0) {
+        fflush(stdout);
+        if (com_link_fill(&server_link, &sc_parser) <= 0) {
+            return -1;
+        }
+    }
+    return r == 1 ? 0 : -1;
+}
 /**
  * @brief 
  * 
- * @param sc_pipe_name 
+ * @return int features the server accepted
  */
-void wait_con_confirmation(const char* sc_pipe_name) {
-    int sc_pipe = open(sc_pipe_name, O_RDWR);
-    // printf("%s\n", "checkkkk");
-    char confirmation[BUFFER_SIZE];
-    read(sc_pipe, confirmation, BUFFER_SIZE);
-    // printf("%s \n", confirmation);
-    char* abc = getSubstringFromSecondSpace(confirmation);
-    char* confirmation_done = getSubstringFromSecondSpace(abc);
-    if (strcmp(confirmation_done, "Connection established") != 0) {
+int wait_con_confirmation() {
+    struct com_hdr hdr;
+    const char* payload;
+    struct com_conn_reply conn_reply;
+    if (read_server_message(&hdr, &payload) == -1 || hdr.type != CONNECTION_REP
+        || hdr.len <= sizeof(conn_reply)
+        || strncmp(payload + sizeof(conn_reply), "Connection established", hdr.len - sizeof(conn_reply)) != 0) {
         fprintf(stderr, "Error: Connection is not established by the server\n");
-        close(sc_pipe);
         exit(EXIT_FAILURE);
     }
-    printf("Connection is stablished with the server\n");
-    close(sc_pipe);
+    memcpy(&conn_reply, payload, sizeof(conn_reply));
+    credit_batch = conn_reply.credits > 1 ? conn_reply.credits / 2 : 1;
+    concurrency = conn_reply.concurrency;
+    // a server that dies is only noticed on the rings through its pid
+    shm_chan.peer = conn_reply.pid;
+    return hdr.flags;
 }
 /**
- * @brief 
+ * @brief Connect over the shared memory rings alone, without FIFOs, to a
+ * server that advertised them. The reply is waited for as long as that
+ * server exists, like a reply on the FIFOs.
+ *
+ * @param mq_name
+ * @param shm_name
+ * @param server pid the server advertised
+ * @param wsize
+ * @param max_running
+ * @param compress
+ * @return int features the server accepted, or -1 if the client has to
+ * connect through FIFOs after all
+ */
+int connect_rings(const char* mq_name, const char* shm_name, pid_t server, int wsize, int max_running, int compress) {
+    if (com_chan_create(&shm_chan, shm_name, COM_SHM_RING_SIZE) == -1) {
+        return -1;
+    }
+    server_link.chan = &shm_chan;
+    // until the reply names the server child that serves us
+    shm_chan.peer = server;
+    connect_server(mq_name, "", "", wsize, shm_name, max_running, compress);
+    int ready;
+    while ((ready = com_chan_wait(&shm_chan, COM_SHM_CONNECT_CHECK_MS)) == 0) {
+    }
+    int features = ready == 1 ? wait_con_confirmation() : 0;
+    shm_unlink(shm_name);
+    if (features & COM_F_SHM) {
+        return features;
+    }
+    com_chan_close(&shm_chan);
+    server_link.chan = NULL;
+    return -1;
+}
+/**
+ * @brief Append to a reply, growing it as needed. The data is always kept
+ * NUL terminated.
+ *
+ * @param reply
+ * @param data
+ * @param len
+ */
+void reply_append(struct reply_buffer* reply, const char* data, size_t len) {
+    if (reply->len + len + 1 > reply->cap) {
+        size_t cap = reply->cap > 0 ? reply->cap : BUFFER_SIZE;
+        while (reply->len + len + 1 > cap) {
+            cap *= 2;
+        }
+        char* grown = realloc(reply->data, cap);
+        if (grown == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        reply->data = grown;
+        reply->cap = cap;
+    }
+    memcpy(reply->data + reply->len, data, len);
+    reply->len += len;
+    reply->data[reply->len] = '\0';
+}
+/**
+ * @brief Send a message that the server answers, and set aside a reply
+ * buffer for the answer.
  * 
- * @param cs_pipe_name 
  * @param type 
  * @param data 
+ * @return uint32_t sequence number the message was sent with
  */
-void send_message(const char* cs_pipe_name, int type, const char* data) {
-    int cs_pipe = open(cs_pipe_name, O_RDWR);
-    int data_len = strlen(data) + 1;
-    int message_len = 7 + data_len;
-    char message[BUFFER_SIZE];
-    sprintf(message, "%3d %1d%3s%s", message_len, type, "", data);
-    write(cs_pipe, message, message_len);
-    close(cs_pipe);
+uint32_t send_message(int type, const char* data) {
+    uint32_t seq = next_seq++;
+    int slot = 0;
+    while (slot < MAX_WINDOW && replies[slot].busy) {
+        slot++;
+    }
+    if (slot == MAX_WINDOW) {
+        fprintf(stderr, "Error: too many messages awaiting a reply\n");
+        exit(EXIT_FAILURE);
+    }
+    replies[slot].busy = 1;
+    replies[slot].done = 0;
+    replies[slot].status = 0;
+    replies[slot].not_run = 0;
+    replies[slot].seq = seq;
+    replies[slot].len = 0;
+    reply_append(&replies[slot], "", 0);
+    if (com_link_send(&server_link, type, 0, seq, data, strlen(data) + 1) == -1) {
+        perror("Error when sending message to server");
+    }
+    return seq;
 }
 /**
- * @brief 
- * 
- * @param sc_pipe_name 
- * @param data 
+ * @brief Give the server credit for the result frames consumed so far,
+ * once half of its window has been used.
  */
-void receive_message_from_server(const char* sc_pipe_name, char* data) {
-    char *cmdBufferFull = (char *)malloc(256 * sizeof(char));
-    int sc_pipe = open(sc_pipe_name, O_RDWR);
-    int bytesRead = read(sc_pipe, cmdBufferFull, 256 - 1);
-    if (bytesRead < 256 - 1) {
-        cmdBufferFull[bytesRead] = '\0';
+void return_credit() {
+    if (++frames_unacked < credit_batch) {
+        return;
+    }
+    uint32_t granted = frames_unacked;
+    frames_unacked = 0;
+    com_link_send(&server_link, CREDIT, 0, next_seq++, &granted, sizeof(granted));
+}
+/**
+ * @brief Add output to its reply: written out if the reply is live,
+ * kept in its buffer otherwise. The first output to arrive while no
+ * reply is live makes its reply live.
+ *
+ * @param reply
+ * @param data
+ * @param len
+ */
+void reply_output(struct reply_buffer* reply, const char* data, size_t len) {
+    if (live == NULL && !reply->done) {
+        live = reply;
+        fwrite(reply->data, 1, reply->len, stdout);
+        reply->len = 0;
+    }
+    if (reply == live) {
+        fwrite(data, 1, len, stdout);
     } else {
-        cmdBufferFull[256 - 1] = '\0';
+        reply_append(reply, data, len);
+    }
+}
+/**
+ * @brief Read a command's output from the pipe the server handed over with
+ * a COM_F_FD frame, up to its end. For the live reply the pipe is spliced
+ * to stdout, so the output is never copied through the client.
+ *
+ * @param reply where the output goes, or NULL to drop it
+ * @param seq
+ * @return int 0 on success, -1 if the pipe did not come with the frame
+ */
+int read_passed_output(struct reply_buffer* reply, uint32_t seq) {
+    int fd = com_link_take_fd(&server_link);
+    if (fd == -1) {
+        fprintf(stderr, "Error: output pipe for message %u did not arrive\n", seq);
+        return -1;
+    }
+    if (reply != NULL && (live == NULL || live == reply)) {
+        reply_output(reply, "", 0);
+        fflush(stdout);
+        ssize_t moved;
+        while ((moved = splice(fd, NULL, STDOUT_FILENO, NULL, OUTPUT_BUFFER_SIZE, SPLICE_F_MOVE)) > 0
+               || (moved == -1 && errno == EINTR)) {
+        }
+        // stdout may be something splice() cannot write to; the rest is copied
+    }
+    ssize_t n;
+    while ((n = read(fd, lz_frame, sizeof(lz_frame))) != 0) {
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            perror("Error when reading command output");
+            break;
+        }
+        if (reply != NULL) {
+            reply_output(reply, lz_frame, n);
+        }
     }
-    char* cmdBuffer = getSubstringFromSecondSpace(cmdBufferFull);
-    snprintf(data, 255, "%s", cmdBuffer);
-    // printf(" The full buffer %s\n", data);
-    // fflush(stdout);
-    close(sc_pipe);
+    close(fd);
+    return 0;
+}
+/**
+ * @brief Read from the server until some reply is complete: all
+ * COMMAND_RES frames of a command up to its COM_F_LAST one, or a single
+ * other message such as QUIT_REP. Frames of different commands may
+ * arrive interleaved and are sorted into their replies by sequence number.
+ * Output of the live reply is written out as it arrives; a reply that
+ * completes while another one is live is only returned after it.
+ *
+ * @return struct reply_buffer* the completed reply, to be given back with
+ * print_reply() or release_reply(), or NULL if the server went away
+ */
+struct reply_buffer* receive_message_from_server() {
+    while (1) {
+        if (live == NULL) {
+            struct reply_buffer* waiting = NULL;
+            for (int i = 0; i < MAX_WINDOW; i++) {
+                if (replies[i].busy && replies[i].done && (waiting == NULL || replies[i].seq < waiting->seq)) {
+                    waiting = &replies[i];
+                }
+            }
+            if (waiting != NULL) {
+                return waiting;
+            }
+        }
+        struct com_hdr hdr;
+        const char* payload;
+        if (read_server_message(&hdr, &payload) == -1) {
+            fprintf(stderr, "Error when reading reply from server\n");
+            return NULL;
+        }
+        struct reply_buffer* reply = NULL;
+        for (int i = 0; i < MAX_WINDOW && reply == NULL; i++) {
+            if (replies[i].busy && replies[i].seq == hdr.seq) {
+                reply = &replies[i];
+            }
+        }
+        int last = hdr.type != COMMAND_RES || (hdr.flags & COM_F_LAST);
+        if (!last) {
+            return_credit();
+        }
+        if (hdr.type == COMMAND_RES && (hdr.flags & COM_F_FD)) {
+            if (read_passed_output(reply, hdr.seq) == -1) {
+                return NULL;
+            }
+            continue;
+        }
+        if (reply == NULL) {
+            fprintf(stderr, "Error: unexpected reply for message %u\n", hdr.seq);
+            continue;
+        }
+        if (hdr.type == COMMAND_RES && (hdr.flags & COM_F_STATUS)) {
+            int32_t status;
+            if (hdr.len == sizeof(status)) {
+                memcpy(&status, payload, sizeof(status));
+                reply->status = status;
+            }
+        } else if (hdr.type == COMMAND_RES && (hdr.flags & (COM_F_BUSY | COM_F_ERROR))) {
+            // a reply that has no output is never live, so this is kept
+            reply->not_run = 1;
+            reply_append(reply, payload, hdr.len);
+        } else if (hdr.type != COMMAND_RES) {
+            // text replies such as QUIT_REP carry their terminating NUL
+            reply_append(reply, payload, hdr.len > 0 && payload[hdr.len - 1] == '\0' ? hdr.len - 1 : hdr.len);
+        } else if (hdr.flags & COM_F_LZ) {
+            ssize_t n = com_lz_unpack(payload, hdr.len, lz_frame, sizeof(lz_frame));
+            if (n == -1) {
+                fprintf(stderr, "Error: corrupt compressed frame for message %u\n", hdr.seq);
+                return NULL;
+            }
+            reply_output(reply, lz_frame, n);
+        } else {
+            reply_output(reply, payload, hdr.len);
+        }
+        if (!last) {
+            continue;
+        }
+        reply->done = 1;
+        if (reply == live) {
+            live = NULL;
+        }
+        if (live == NULL) {
+            return reply;
+        }
+    }
+}
+/**
+ * @brief
+ *
+ * @param reply
+ */
+void release_reply(struct reply_buffer* reply) {
+    reply->busy = 0;
+}
+/**
+ * @brief Print what is left of a reply, followed by a newline, and give
+ * its buffer back. Output of a reply that was live is already out. A
+ * failed exit status reported by a session shell, and the reason the
+ * server gave for not running a command, go to stderr.
+ *
+ * @param reply
+ */
+void print_reply(struct reply_buffer* reply) {
+    if (reply->not_run) {
+        fflush(stdout);
+        fprintf(stderr, "%s\n", reply->data);
+        release_reply(reply);
+        return;
+    }
+    fwrite(reply->data, 1, reply->len, stdout);
+    printf("\n");
+    if (reply->status != 0) {
+        fflush(stdout);
+        fprintf(stderr, "command exited with status %d\n", reply->status);
+    }
+    release_reply(reply);
 }
 /**
  * @brief 
- * 
- * @param cs_pipe_name 
  */
-void send_quit_request(const char* cs_pipe_name) {
-    send_message(cs_pipe_name, QUIT_REQ, "");
+void send_quit_request() {
+    send_message(QUIT_REQ, "quit");
+}
+/**
+ * @brief Run every line of COMFILE, keeping up to window commands in flight.
+ * Output is printed as it arrives. When the server runs several of our
+ * commands at once, one command's output streams at a time and the others
+ * follow as they complete, so results may come out of order but are
+ * never mixed.
+ *
+ * @param file
+ * @param window
+ */
+void run_batch(FILE* file, int window) {
+    int count = 0;
+    int eof = 0;
+    char command[BUFFER_SIZE];
+    while (!eof || count > 0) {
+        while (!eof && count < window) {
+            if (fgets(command, BUFFER_SIZE, file) == NULL) {
+                eof = 1;
+                break;
+            }
+            command[strcspn(command, "\n")] = '\0';
+            send_message(SEND_COMMAND, command);
+            count++;
+        }
+        if (count == 0) {
+            break;
+        }
+        struct reply_buffer* reply = receive_message_from_server();
+        if (reply == NULL) {
+            break;
+        }
+        print_reply(reply);
+        count--;
+    }
 }
 /**
  * @brief 
@@ -177,15 +561,21 @@ void handle_termination_request(int signum) {
 int main(int argc, char *argv[]) {
     signal(SIGTERM, handle_termination_request);
     signal(SIGINT, handle_termination_request);
+    setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s MQNAME [-b COMFILE] [-s WSIZE]\n", argv[0]);
+        fprintf(stderr, "Usage: %s MQNAME [-b COMFILE] [-s WSIZE] [-w WINDOW] [-k CONCURRENCY] [-q SHARDS] [-W WEIGHT] [-u SOCKPATH] [-p] [-r] [-z] [-S]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
     char* mq_name = argv[1];
     char* comfile = NULL;
     int wsize = BUFFER_SIZE;
+    int window = 1;
+    int max_running = 1;
+    int use_shm = 0;
+    int compress = 0;
+    int print_stats = 0;
     int opt;
-    while ((opt = getopt(argc, argv, "b:s:")) != -1) {
+    while ((opt = getopt(argc, argv, "b:s:w:k:q:W:u:przS")) != -1) {
         switch (opt) {
             case 'b':
                 comfile = optarg;
@@ -193,58 +583,157 @@ int main(int argc, char *argv[]) {
             case 's':
                 wsize = atoi(optarg);
                 break;
+            case 'w':
+                window = atoi(optarg);
+                break;
+            case 'k':
+                max_running = atoi(optarg);
+                break;
+            case 'q':
+                queue_shards = atoi(optarg);
+                break;
+            case 'W':
+                weight = atoi(optarg);
+                break;
+            case 'u':
+                sock_path = optarg;
+                break;
+            case 'p':
+                session_mode = 1;
+                break;
+            case 'r':
+                use_shm = 1;
+                break;
+            case 'z':
+                compress = 1;
+                break;
+            case 'S':
+                print_stats = 1;
+                break;
             default:
-                fprintf(stderr, "Usage: %s MQNAME [-b COMFILE] [-s WSIZE]\n", argv[0]);
+                fprintf(stderr, "Usage: %s MQNAME [-b COMFILE] [-s WSIZE] [-w WINDOW] [-k CONCURRENCY] [-q SHARDS] [-W WEIGHT] [-u SOCKPATH] [-p] [-r] [-z] [-S]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
-    char cs_pipe_name[BUFFER_SIZE];
-    char sc_pipe_name[BUFFER_SIZE];
-    create_pipes(cs_pipe_name, sc_pipe_name, getpid());
+    if (max_running < 1 || max_running > COM_MAX_CONCURRENCY) {
+        fprintf(stderr, "CONCURRENCY must be between 1 and %d\n", COM_MAX_CONCURRENCY);
+        exit(EXIT_FAILURE);
+    }
+    if (queue_shards < 0 || queue_shards > COM_QUEUE_MAX_SHARDS) {
+        fprintf(stderr, "SHARDS must be between 0 and %d\n", COM_QUEUE_MAX_SHARDS);
+        exit(EXIT_FAILURE);
+    }
+    // commands only run at once if they are in flight at once
+    if (window < max_running) {
+        window = max_running;
+    }
+    if (window < 1 || window > MAX_WINDOW) {
+        fprintf(stderr, "WINDOW must be between 1 and %d\n", MAX_WINDOW);
+        exit(EXIT_FAILURE);
+    }
+    char cs_pipe_name[BUFFER_SIZE] = "";
+    char sc_pipe_name[BUFFER_SIZE] = "";
+    com_parser_init(&sc_parser, BUFFER_SIZE);
+    char shm_name[COM_NAME_MAX];
+    sprintf(shm_name, "/comshm_%d", getpid());
+    // the server picks the transport when it starts: without -u or -r the
+    // rings are used alone if it advertises them, and FIFOs otherwise
+    int features = -1;
+    pid_t rings_server = sock_path == NULL && !use_shm ? com_rings_server(mq_name) : 0;
+    if (rings_server > 0) {
+        features = connect_rings(mq_name, shm_name, rings_server, wsize, max_running, compress);
+    }
+    if (features == -1) {
+        if (use_shm && com_chan_create(&shm_chan, shm_name, COM_SHM_RING_SIZE) == -1) {
+            perror("Shared memory transport unavailable, using the FIFOs");
+            use_shm = 0;
+        }
+        if (sock_path == NULL) {
+            create_pipes(cs_pipe_name, sc_pipe_name, getpid());
+        }
 // printf("Client - cs_pipe_name: %s\n", cs_pipe_name);
 //         fflush(stdout);
-    connect_server(mq_name, cs_pipe_name, sc_pipe_name, wsize);
-    wait_con_confirmation(sc_pipe_name);
-    if (comfile != NULL) {
+        if (sock_path != NULL) {
+            connect_socket(sock_path);
+        } else {
+            open_pipes(cs_pipe_name, sc_pipe_name);
+        }
+        connect_server(mq_name, cs_pipe_name, sc_pipe_name, wsize, use_shm ? shm_name : NULL, max_running, compress);
+        features = wait_con_confirmation();
+    }
+    printf("Connection is stablished with the server\n");
+    if (session_mode && !(features & COM_F_SESSION)) {
+        fprintf(stderr, "The server does not offer shell sessions, running each command on its own\n");
+    }
+    if (use_shm) {
+        shm_unlink(shm_name);
+        if (features & COM_F_SHM) {
+            server_link.chan = &shm_chan;
+        } else {
+            com_chan_close(&shm_chan);
+        }
+    }
+    if (print_stats) {
+        send_message(STATS_REQ, "");
+        struct reply_buffer* reply = receive_message_from_server();
+        if (reply != NULL) {
+            printf("%s", reply->data);
+            release_reply(reply);
+            send_quit_request();
+            receive_message_from_server();
+        }
+    } else if (comfile != NULL) {
         FILE* file = fopen(comfile, "r");
         if (file == NULL) {
             perror("Error opening command file");
             exit(EXIT_FAILURE);
         }
-        char command[BUFFER_SIZE];
-        while (fgets(command, BUFFER_SIZE, file) != NULL) {
-            command[strcspn(command, "\n")] = '\0';
-            send_message(cs_pipe_name, SEND_COMMAND, command);
-            char result[BUFFER_SIZE];
-            receive_message_from_server(sc_pipe_name, result);
-            printf("%s\n", result);
-        }
+        run_batch(file, window);
+        send_quit_request();
+        receive_message_from_server();
 
         fclose(file);
     } else {
         char command[BUFFER_SIZE];
         while (1) {
             printf("type command: ");
+            fflush(stdout);
             fgets(command, BUFFER_SIZE, stdin);
             command[strcspn(command, "\n")] = '\0';
             if (strcmp(command, "quit") == 0 || strcmp(command, "quitall") == 0) {
                 if (strcmp(command, "quitall") == 0) {
-                    send_quit_request(cs_pipe_name);
+                    send_message(QUIT_ALL_REQ, command);
+                } else {
+                    send_quit_request();
+                }
+                struct reply_buffer* reply = receive_message_from_server();
+                if (reply != NULL) {
+                    print_reply(reply);
                 }
-                send_message(cs_pipe_name, QUIT_REQ, command);
-                char result[BUFFER_SIZE];
-                receive_message_from_server(sc_pipe_name, result);
-                printf("%s\n", result);
 
                 break;
             }
-            send_message(cs_pipe_name, SEND_COMMAND, command);
-            char result[BUFFER_SIZE];
-            receive_message_from_server(sc_pipe_name, result);
-            printf("%s\n", result);
+            send_message(SEND_COMMAND, command);
+            struct reply_buffer* reply = receive_message_from_server();
+            if (reply == NULL) {
+                break;
+            }
+            print_reply(reply);
         }
     }
-    unlink(cs_pipe_name);
-    unlink(sc_pipe_name);
+    if (server_link.wfd != server_link.rfd) {
+        close(server_link.wfd);
+    }
+    if (server_link.rfd != -1) {
+        close(server_link.rfd);
+    }
+    com_parser_free(&sc_parser);
+    for (int i = 0; i < MAX_WINDOW; i++) {
+        free(replies[i].data);
+    }
+    if (cs_pipe_name[0] != '\0') {
+        unlink(cs_pipe_name);
+        unlink(sc_pipe_name);
+    }
     return 0;
 }
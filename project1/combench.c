@@ -0,0 +1,843 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <mqueue.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include "comproto.h"
+#include "comshm.h"
+#include "comqueue.h"
+#include "comcapture.h"
+/*
+ * Load generator for comserver. It forks one process per simulated client;
+ * each one connects through the message queue and its own FIFO pair the
+ * way client does, runs its share of commands one at a time and quits.
+ *
+ * With a target rate, every client sends on a fixed schedule and latency
+ * is measured from the time a command was due, so a server that falls
+ * behind shows up as queueing delay instead of a lower send rate.
+ * Without one, each client sends its next command as soon as the previous
+ * result is complete. The clients use the shared memory rings alone when
+ * the server advertises them (comserver -r), and FIFOs otherwise, like
+ * client does.
+ *
+ * With -R it replays a capture written by comserver -C instead: one client
+ * per captured session, connecting and sending each command at the time
+ * it did in the capture, divided by SPEED (-X, 0 for as fast as possible),
+ * with the session's frame size, concurrency and session mode. Latency is
+ * again measured from when a command was due, and the capture's own
+ * latencies are shown next to it.
+ */
+#define BUFFER_SIZE 1024
+#define BENCH_MAX_CLIENTS 1024
+#define BENCH_MAX_MIX 256
+#define REPLAY_LEAD_NS 100000000ull
+// time given to fork the replay clients before the first one is due
+#define BENCH_USAGE "Usage: %s MQNAME [-c CLIENTS] [-n COMMANDS] [-r RATE] [-f MIXFILE] [-s WSIZE] [-q SHARDS] [-o CSVFILE]" \
+                    " [-R CAPTUREFILE [-X SPEED]]\n"
+/*
+ * What one simulated client reports back, in a shared mapping. Its command
+ * latencies follow all the client records.
+ */
+struct bench_client {
+    uint64_t connectNs;
+    uint64_t firstNs;
+    uint64_t lastNs;
+    uint64_t bytes;
+    int completed;
+    int errors;
+    int differed;
+    int rings;
+};
+struct bench_results {
+    int clients;
+    int commands;
+    struct bench_client client[BENCH_MAX_CLIENTS];
+    uint64_t latency[];
+};
+char *mix[BENCH_MAX_MIX];
+int mixCount = 0;
+/*
+ * A session read from a capture: when it opened, from the start of the
+ * capture, its settings and its commands in order. latencyNs and bytes
+ * are as captured; latencyNs is 0 if no result was recorded.
+ */
+struct replay_command {
+    uint64_t offsetNs;
+    uint64_t latencyNs;
+    uint64_t bytes;
+    uint32_t seq;
+    char *text;
+};
+struct replay_session {
+    int32_t server;
+    int32_t client;
+    uint64_t openNs;
+    int wSize;
+    int concurrency;
+    int features;
+    int open;
+    int count;
+    int cap;
+    struct replay_command *commands;
+};
+struct replay_session *sessions = NULL;
+int sessionCount = 0;
+// connection queue shards of the server under test
+int queueShards = 0;
+// the server under test if it advertises the shared memory rings, else 0
+pid_t ringsServer = 0;
+/**
+ * @brief
+ *
+ * @return uint64_t monotonic clock in nanoseconds
+ */
+uint64_t bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+/**
+ * @brief
+ *
+ * @param ns monotonic time to sleep until
+ */
+void bench_sleep_until(uint64_t ns) {
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+/**
+ * @brief Load the command mix: one command per line. A command listed
+ * several times is picked that much more often.
+ *
+ * @param path
+ */
+void load_mix(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Error opening command mix");
+        exit(EXIT_FAILURE);
+    }
+    char line[BUFFER_SIZE];
+    while (mixCount < BENCH_MAX_MIX && fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] != '\0') {
+            mix[mixCount++] = strdup(line);
+        }
+    }
+    fclose(file);
+    if (mixCount == 0) {
+        fprintf(stderr, "Command mix %s is empty\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+/**
+ * @brief Block until the next complete message arrives.
+ *
+ * @param link
+ * @param in
+ * @param hdr
+ * @param payload
+ * @return int 0 on success, -1 if the server went away or sent garbage
+ */
+int bench_read(struct com_link *link, struct com_parser *in, struct com_hdr *hdr, const char **payload) {
+    int r;
+    while ((r = com_parser_next(in, hdr, payload)) == 0) {
+        if (com_link_fill(link, in) <= 0) {
+            return -1;
+        }
+    }
+    return r == 1 ? 0 : -1;
+}
+/*
+ * One simulated client's connection: its FIFOs, or its rings, and
+ * what the server agreed to.
+ */
+struct bench_conn {
+    char csName[COM_NAME_MAX];
+    char scName[COM_NAME_MAX];
+    char shmName[COM_NAME_MAX];
+    struct com_chan chan;
+    struct com_link link;
+    struct com_parser in;
+    uint32_t seq;
+    uint32_t creditBatch;
+    int features;
+};
+/**
+ * @brief Send the CONNECTION_REQ for conn's FIFOs or rings and read the
+ * reply.
+ *
+ * @param conn
+ * @param mqName
+ * @param wSize
+ * @param concurrency commands to run at once
+ * @param features COM_F_ flags to ask for
+ * @return int 0 if the server replied, -1 if it did not
+ */
+int bench_request(struct bench_conn *conn, const char *mqName, int wSize, int concurrency, int features) {
+    char queueName[BUFFER_SIZE];
+    mqd_t mq = com_queue_open(mqName, queueShards, getpid(), queueName, sizeof(queueName));
+    if (mq == (mqd_t)-1) {
+        perror("Error when connecting to the server");
+        unlink(conn->csName);
+        unlink(conn->scName);
+        shm_unlink(conn->shmName);
+        exit(EXIT_FAILURE);
+    }
+    struct com_conn_info info;
+    memset(&info, 0, sizeof(info));
+    info.pid = getpid();
+    info.wsize = wSize;
+    info.credits = COM_DEFAULT_CREDITS;
+    info.concurrency = concurrency;
+    info.weight = 1;
+    strcpy(info.cs_name, conn->csName);
+    strcpy(info.sc_name, conn->scName);
+    strcpy(info.shm_name, conn->shmName);
+    char request[COM_HDR_SIZE + sizeof(info)];
+    com_encode_hdr(request, CONNECTION_REQ, features, conn->seq++, sizeof(info));
+    memcpy(request + COM_HDR_SIZE, &info, sizeof(info));
+    struct com_hdr hdr;
+    const char *payload;
+    int failed = com_queue_send(mq, queueName, request, sizeof(request)) == -1;
+    mq_close(mq);
+    if (!failed && conn->link.chan != NULL) {
+        int ready;
+        while ((ready = com_chan_wait(&conn->chan, COM_SHM_CONNECT_CHECK_MS)) == 0) {
+        }
+        failed = ready == -1;
+    }
+    if (failed || bench_read(&conn->link, &conn->in, &hdr, &payload) == -1 || hdr.type != CONNECTION_REP) {
+        return -1;
+    }
+    conn->features = hdr.flags;
+    if (hdr.len >= sizeof(struct com_conn_reply)) {
+        struct com_conn_reply reply;
+        memcpy(&reply, payload, sizeof(reply));
+        conn->creditBatch = reply.credits > 1 ? reply.credits / 2 : 1;
+        conn->chan.peer = reply.pid;
+    }
+    return 0;
+}
+/**
+ * @brief Connect through the message queue the way client does: over
+ * this process's rings alone if the server advertises them, else over a
+ * FIFO pair.
+ *
+ * @param conn
+ * @param mqName
+ * @param wSize
+ * @param concurrency commands to run at once
+ * @param features COM_F_ flags to ask for
+ * @return int 0 on success, -1 if the server did not accept the connection
+ */
+int bench_connect(struct bench_conn *conn, const char *mqName, int wSize, int concurrency, int features) {
+    conn->csName[0] = '\0';
+    conn->scName[0] = '\0';
+    com_parser_init(&conn->in, BUFFER_SIZE);
+    conn->seq = 0;
+    conn->creditBatch = COM_DEFAULT_CREDITS / 2;
+    conn->features = 0;
+    sprintf(conn->shmName, "/comshm_%d", getpid());
+    if (ringsServer > 0 && com_chan_create(&conn->chan, conn->shmName, COM_SHM_RING_SIZE) == 0) {
+        conn->link = (struct com_link){ .rfd = -1, .wfd = -1, .chan = &conn->chan };
+        // until the reply names the server child, watch the server itself
+        conn->chan.peer = ringsServer;
+        int replied = bench_request(conn, mqName, wSize, concurrency, features | COM_F_SHM);
+        shm_unlink(conn->shmName);
+        if (replied == 0 && (conn->features & COM_F_SHM)) {
+            return 0;
+        }
+        com_chan_close(&conn->chan);
+        conn->features = 0;
+    }
+    conn->shmName[0] = '\0';
+    sprintf(conn->csName, "cs_pipe_%d", getpid());
+    sprintf(conn->scName, "sc_pipe_%d", getpid());
+    if (mkfifo(conn->csName, 0666) == -1 || mkfifo(conn->scName, 0666) == -1) {
+        perror("Error when creating named pipes");
+        exit(EXIT_FAILURE);
+    }
+    conn->link = (struct com_link){ .rfd = open(conn->scName, O_RDWR), .wfd = open(conn->csName, O_RDWR), .chan = NULL };
+    if (conn->link.rfd == -1 || conn->link.wfd == -1) {
+        perror("Error when connecting to the server");
+        unlink(conn->csName);
+        unlink(conn->scName);
+        exit(EXIT_FAILURE);
+    }
+    return bench_request(conn, mqName, wSize, concurrency, features);
+}
+/**
+ * @brief Quit if all went well, then close and remove the FIFOs, or
+ * close the rings.
+ *
+ * @param conn
+ * @param quit
+ */
+void bench_disconnect(struct bench_conn *conn, int quit) {
+    if (quit) {
+        struct com_hdr hdr;
+        const char *payload;
+        com_link_send(&conn->link, QUIT_REQ, 0, conn->seq++, "quit", strlen("quit") + 1);
+        while (bench_read(&conn->link, &conn->in, &hdr, &payload) == 0 && hdr.type != QUIT_REP) {
+        }
+    }
+    com_parser_free(&conn->in);
+    if (conn->link.chan != NULL) {
+        com_chan_close(&conn->chan);
+        return;
+    }
+    close(conn->link.rfd);
+    close(conn->link.wfd);
+    unlink(conn->csName);
+    unlink(conn->scName);
+}
+/**
+ * @brief Run one simulated client and record its results.
+ *
+ * @param mqName
+ * @param id
+ * @param commands
+ * @param intervalNs time between this client's commands, 0 to send back to back
+ * @param wSize
+ * @param results
+ */
+void bench_client(const char *mqName, int id, int commands, uint64_t intervalNs, int wSize,
+                  struct bench_results *results) {
+    struct bench_client *me = &results->client[id];
+    uint64_t *latency = results->latency + (size_t)id * commands;
+    struct bench_conn conn;
+    uint64_t start = bench_now();
+    if (bench_connect(&conn, mqName, wSize, 1, 0) == -1) {
+        fprintf(stderr, "bench client %d: connection failed\n", id);
+        me->errors++;
+        commands = 0;
+    }
+    me->connectNs = bench_now() - start;
+    me->rings = (conn.features & COM_F_SHM) != 0;
+    struct com_link *link = &conn.link;
+    struct com_hdr hdr;
+    const char *payload;
+
+    unsigned int rng = getpid();
+    uint32_t unacked = 0;
+    // stagger paced clients over one interval so they do not send in bursts
+    uint64_t due = bench_now() + (intervalNs > 0 ? (uint64_t)rand_r(&rng) % intervalNs : 0);
+    me->firstNs = due;
+    for (int i = 0; i < commands; i++) {
+        if (intervalNs > 0) {
+            bench_sleep_until(due);
+        } else {
+            due = bench_now();
+        }
+        const char *cmd = mix[rand_r(&rng) % mixCount];
+        uint32_t cmdSeq = conn.seq++;
+        if (com_link_send(link, SEND_COMMAND, 0, cmdSeq, cmd, strlen(cmd) + 1) == -1) {
+            me->errors++;
+            break;
+        }
+        int failed = 0;
+        while (1) {
+            if (bench_read(link, &conn.in, &hdr, &payload) == -1 || hdr.type != COMMAND_RES || hdr.seq != cmdSeq) {
+                failed = 1;
+                break;
+            }
+            if (hdr.flags & COM_F_LAST) {
+                break;
+            }
+            me->bytes += hdr.len;
+            if (++unacked >= conn.creditBatch) {
+                com_link_send(link, CREDIT, 0, conn.seq++, &unacked, sizeof(unacked));
+                unacked = 0;
+            }
+        }
+        if (failed) {
+            fprintf(stderr, "bench client %d: bad reply to command %d\n", id, i);
+            me->errors++;
+            break;
+        }
+        uint64_t done = bench_now();
+        latency[me->completed++] = done - due;
+        me->lastNs = done;
+        due += intervalNs;
+    }
+    bench_disconnect(&conn, me->errors == 0);
+    exit(me->errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+/**
+ * @brief The session a record belongs to: the last one opened by the
+ * same server process for the same client that has not closed.
+ *
+ * @param record
+ * @return struct replay_session* NULL if the capture has no such session
+ */
+struct replay_session* replay_find(const struct capture_record *record) {
+    for (int i = sessionCount - 1; i >= 0; i--) {
+        if (sessions[i].open && sessions[i].server == record->server && sessions[i].client == record->client) {
+            return &sessions[i];
+        }
+    }
+    return NULL;
+}
+/**
+ * @brief Read a capture file into sessions, with times made relative to
+ * the first session.
+ *
+ * @param path
+ */
+void load_capture(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("Error opening capture file");
+        exit(EXIT_FAILURE);
+    }
+    struct capture_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != CAPTURE_VERSION || header.recordSize != sizeof(struct capture_record)) {
+        fprintf(stderr, "%s is not a capture file of this version\n", path);
+        exit(EXIT_FAILURE);
+    }
+    int cap = 0;
+    struct capture_record record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        char *text = NULL;
+        if (record.len > 0) {
+            text = malloc(record.len + 1);
+            if (text == NULL || fread(text, 1, record.len, file) != record.len) {
+                fprintf(stderr, "%s is truncated\n", path);
+                exit(EXIT_FAILURE);
+            }
+            text[record.len] = '\0';
+        }
+        if (record.kind == CAPTURE_OPEN) {
+            if (sessionCount == cap) {
+                cap = cap ? cap * 2 : 64;
+                sessions = realloc(sessions, cap * sizeof(struct replay_session));
+            }
+            sessions[sessionCount++] = (struct replay_session){
+                .server = record.server, .client = record.client, .openNs = record.timeNs,
+                .wSize = record.bytes, .concurrency = record.concurrency, .features = record.flags, .open = 1,
+            };
+            continue;
+        }
+        struct replay_session *session = replay_find(&record);
+        if (session == NULL) {
+            free(text);
+            continue;
+        }
+        if (record.kind == CAPTURE_COMMAND && text != NULL) {
+            if (session->count == session->cap) {
+                session->cap = session->cap ? session->cap * 2 : 64;
+                session->commands = realloc(session->commands, session->cap * sizeof(struct replay_command));
+            }
+            session->commands[session->count++] = (struct replay_command){
+                .offsetNs = record.timeNs, .seq = record.seq, .text = text,
+            };
+            continue;
+        }
+        free(text);
+        if (record.kind == CAPTURE_RESULT) {
+            for (int i = session->count - 1; i >= 0; i--) {
+                struct replay_command *command = &session->commands[i];
+                if (command->seq == record.seq) {
+                    command->latencyNs = record.timeNs - command->offsetNs;
+                    command->bytes = record.bytes;
+                    break;
+                }
+            }
+        } else if (record.kind == CAPTURE_CLOSE) {
+            session->open = 0;
+        }
+    }
+    fclose(file);
+    if (sessionCount == 0) {
+        fprintf(stderr, "Capture %s has no sessions\n", path);
+        exit(EXIT_FAILURE);
+    }
+    // processes append whole buffers, so records are only ordered per process
+    uint64_t firstNs = UINT64_MAX;
+    for (int i = 0; i < sessionCount; i++) {
+        if (sessions[i].openNs < firstNs) {
+            firstNs = sessions[i].openNs;
+        }
+    }
+    for (int i = 0; i < sessionCount; i++) {
+        struct replay_session *session = &sessions[i];
+        for (int j = 0; j < session->count; j++) {
+            session->commands[j].offsetNs -= firstNs;
+        }
+        session->openNs -= firstNs;
+    }
+}
+/**
+ * @brief Replay one captured session and record its results. Up to the
+ * session's concurrency commands are in flight; each is sent once it is
+ * due and there is room.
+ *
+ * @param mqName
+ * @param id
+ * @param speed 1 for the captured pace, 0 for as fast as possible
+ * @param start when the capture's first session is replayed
+ * @param stride latency slots per client in results
+ * @param results
+ */
+void replay_client(const char *mqName, int id, double speed, uint64_t start, int stride,
+                   struct bench_results *results) {
+    struct replay_session *session = &sessions[id];
+    struct bench_client *me = &results->client[id];
+    uint64_t *latency = results->latency + (size_t)id * stride;
+    if (speed > 0) {
+        bench_sleep_until(start + (uint64_t)(session->openNs / speed));
+    }
+    struct bench_conn conn;
+    uint64_t connectStart = bench_now();
+    int features = session->features & (COM_F_LZ | COM_F_SESSION);
+    if (bench_connect(&conn, mqName, session->wSize, session->concurrency, features) == -1) {
+        fprintf(stderr, "replay client %d: connection failed\n", id);
+        me->errors++;
+        bench_disconnect(&conn, 0);
+        exit(EXIT_FAILURE);
+    }
+    me->connectNs = bench_now() - connectStart;
+    me->rings = (conn.features & COM_F_SHM) != 0;
+    // what is in flight: index of the command and when it was due, by slot
+    int concurrency = session->concurrency < 1 ? 1 : session->concurrency;
+    if (concurrency > COM_MAX_CONCURRENCY) {
+        concurrency = COM_MAX_CONCURRENCY;
+    }
+    int inFlight[COM_MAX_CONCURRENCY];
+    uint32_t flightSeq[COM_MAX_CONCURRENCY];
+    uint64_t flightDue[COM_MAX_CONCURRENCY];
+    uint64_t flightBytes[COM_MAX_CONCURRENCY];
+    int running = 0;
+    int next = 0;
+    uint32_t unacked = 0;
+    me->firstNs = UINT64_MAX;
+    while (next < session->count || running > 0) {
+        uint64_t now = bench_now();
+        if (next < session->count && running < concurrency) {
+            struct replay_command *command = &session->commands[next];
+            uint64_t due = speed > 0 ? start + (uint64_t)(command->offsetNs / speed) : now;
+            if (due <= now) {
+                inFlight[running] = next;
+                flightSeq[running] = conn.seq++;
+                flightDue[running] = due;
+                flightBytes[running] = 0;
+                if (com_link_send(&conn.link, SEND_COMMAND, 0, flightSeq[running], command->text,
+                                  strlen(command->text) + 1) == -1) {
+                    me->errors++;
+                    break;
+                }
+                if (due < me->firstNs) {
+                    me->firstNs = due;
+                }
+                running++;
+                next++;
+                continue;
+            }
+        }
+        struct com_hdr hdr;
+        const char *payload;
+        int r = com_parser_next(&conn.in, &hdr, &payload);
+        if (r == 0) {
+            // wait for the server, or until the next command is due
+            int timeout = -1;
+            if (speed > 0 && next < session->count && running < concurrency) {
+                uint64_t due = start + (uint64_t)(session->commands[next].offsetNs / speed);
+                timeout = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+            }
+            // the rings cannot be polled; waiting on them a second at a time
+            // is the same as waiting for good
+            struct pollfd pfd = { .fd = conn.link.rfd, .events = POLLIN };
+            int ready = conn.link.chan != NULL ? com_chan_wait(conn.link.chan, timeout == -1 ? 1000 : timeout) != 0
+                                               : poll(&pfd, 1, timeout) > 0;
+            if (ready && com_link_fill(&conn.link, &conn.in) <= 0) {
+                me->errors++;
+                break;
+            }
+            continue;
+        }
+        int slot = 0;
+        while (r == 1 && slot < running && flightSeq[slot] != hdr.seq) {
+            slot++;
+        }
+        if (r < 0 || hdr.type != COMMAND_RES || slot == running) {
+            fprintf(stderr, "replay client %d: bad reply\n", id);
+            me->errors++;
+            break;
+        }
+        if (!(hdr.flags & COM_F_LAST)) {
+            // a compressed frame starts with the length of its output
+            uint32_t len = hdr.len;
+            if ((hdr.flags & COM_F_LZ) && hdr.len >= sizeof(len)) {
+                memcpy(&len, payload, sizeof(len));
+            }
+            flightBytes[slot] += len;
+            if (++unacked >= conn.creditBatch) {
+                com_link_send(&conn.link, CREDIT, 0, conn.seq++, &unacked, sizeof(unacked));
+                unacked = 0;
+            }
+            continue;
+        }
+        struct replay_command *command = &session->commands[inFlight[slot]];
+        uint64_t done = bench_now();
+        latency[me->completed++] = done - flightDue[slot];
+        me->lastNs = done;
+        me->bytes += flightBytes[slot];
+        if (command->latencyNs > 0 && !(hdr.flags & (COM_F_BUSY | COM_F_ERROR)) && flightBytes[slot] != command->bytes) {
+            me->differed++;
+        }
+        running--;
+        inFlight[slot] = inFlight[running];
+        flightSeq[slot] = flightSeq[running];
+        flightDue[slot] = flightDue[running];
+        flightBytes[slot] = flightBytes[running];
+    }
+    bench_disconnect(&conn, me->errors == 0);
+    exit(me->errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+/**
+ * @brief
+ *
+ * @param a
+ * @param b
+ * @return int
+ */
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+/**
+ * @brief
+ *
+ * @param sorted
+ * @param n
+ * @param p fraction between 0 and 1
+ * @return double the p-th quantile in microseconds
+ */
+double percentile_us(const uint64_t *sorted, size_t n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(p * n);
+    if (i >= n) {
+        i = n - 1;
+    }
+    return sorted[i] / 1000.0;
+}
+/**
+ * @brief
+ *
+ * @param argc
+ * @param argv
+ * @return int
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, BENCH_USAGE, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    char *mqName = argv[1];
+    int clients = 1;
+    int commands = 100;
+    double rate = 0;
+    int wSize = BUFFER_SIZE;
+    char *csvFile = NULL;
+    char *captureFile = NULL;
+    double speed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:r:f:s:q:o:R:X:")) != -1) {
+        switch (opt) {
+            case 'c':
+                clients = atoi(optarg);
+                break;
+            case 'n':
+                commands = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'f':
+                load_mix(optarg);
+                break;
+            case 's':
+                wSize = atoi(optarg);
+                break;
+            case 'q':
+                queueShards = atoi(optarg);
+                break;
+            case 'o':
+                csvFile = optarg;
+                break;
+            case 'R':
+                captureFile = optarg;
+                break;
+            case 'X':
+                speed = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, BENCH_USAGE, argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (clients < 1 || clients > BENCH_MAX_CLIENTS || commands < 1 || rate < 0
+        || queueShards < 0 || queueShards > COM_QUEUE_MAX_SHARDS) {
+        fprintf(stderr, "CLIENTS must be between 1 and %d, COMMANDS positive, RATE not negative"
+                " and SHARDS between 0 and %d\n", BENCH_MAX_CLIENTS, COM_QUEUE_MAX_SHARDS);
+        exit(EXIT_FAILURE);
+    }
+    if (speed < 0) {
+        fprintf(stderr, "SPEED must not be negative\n");
+        exit(EXIT_FAILURE);
+    }
+    if (mixCount == 0) {
+        mix[mixCount++] = "echo hello";
+    }
+    ringsServer = com_rings_server(mqName);
+    // RATE is for all clients together
+    uint64_t intervalNs = rate > 0 ? (uint64_t)(clients * 1e9 / rate) : 0;
+    // in a replay there is one client per session, and commands is the
+    // most any session has
+    int total = clients * commands;
+    if (captureFile != NULL) {
+        load_capture(captureFile);
+        if (sessionCount > BENCH_MAX_CLIENTS) {
+            fprintf(stderr, "The capture has %d sessions, more than the %d clients allowed\n",
+                    sessionCount, BENCH_MAX_CLIENTS);
+            exit(EXIT_FAILURE);
+        }
+        clients = sessionCount;
+        commands = 1;
+        total = 0;
+        for (int i = 0; i < sessionCount; i++) {
+            if (sessions[i].count > commands) {
+                commands = sessions[i].count;
+            }
+            total += sessions[i].count;
+        }
+        rate = 0;
+    }
+
+    size_t size = sizeof(struct bench_results) + (size_t)clients * commands * sizeof(uint64_t);
+    struct bench_results *results = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    results->clients = clients;
+    results->commands = commands;
+    fflush(stdout);
+    uint64_t replayStart = bench_now() + REPLAY_LEAD_NS;
+    for (int i = 0; i < clients; i++) {
+        pid_t pid = fork();
+        if (pid == 0 && captureFile != NULL) {
+            replay_client(mqName, i, speed, replayStart, commands, results);
+        }
+        if (pid == 0) {
+            bench_client(mqName, i, commands, intervalNs, wSize, results);
+        }
+        if (pid < 0) {
+            perror("fork error");
+            results->client[i].errors++;
+        }
+    }
+    while (wait(NULL) > 0) {
+    }
+
+    // gather and summarise
+    uint64_t *latency = malloc((size_t)clients * commands * sizeof(uint64_t));
+    uint64_t *connect = malloc(clients * sizeof(uint64_t));
+    size_t completed = 0;
+    int errors = 0;
+    int differed = 0;
+    uint64_t bytes = 0;
+    uint64_t first = UINT64_MAX;
+    uint64_t last = 0;
+    int rings = 0;
+    for (int i = 0; i < clients; i++) {
+        struct bench_client *c = &results->client[i];
+        rings += c->rings;
+        memcpy(latency + completed, results->latency + (size_t)i * commands, c->completed * sizeof(uint64_t));
+        completed += c->completed;
+        connect[i] = c->connectNs;
+        errors += c->errors;
+        differed += c->differed;
+        bytes += c->bytes;
+        if (c->completed > 0 && c->firstNs < first) {
+            first = c->firstNs;
+        }
+        if (c->lastNs > last) {
+            last = c->lastNs;
+        }
+    }
+    qsort(latency, completed, sizeof(uint64_t), compare_u64);
+    qsort(connect, clients, sizeof(uint64_t), compare_u64);
+    double elapsed = completed > 0 ? (last - first) / 1e9 : 0;
+    double throughput = elapsed > 0 ? completed / elapsed : 0;
+    double lat[4] = {
+        percentile_us(latency, completed, 0.5), percentile_us(latency, completed, 0.99),
+        percentile_us(latency, completed, 0.999), completed > 0 ? latency[completed - 1] / 1000.0 : 0,
+    };
+    double con[3] = {
+        percentile_us(connect, clients, 0.5), percentile_us(connect, clients, 0.99), connect[clients - 1] / 1000.0,
+    };
+    printf("clients          %d\n", clients);
+    printf("transport        %s\n", rings == clients ? "shared memory rings" : rings == 0 ? "FIFOs" : "mixed");
+    printf("commands         %zu of %d, %d errors\n", completed, total, errors);
+    if (captureFile == NULL) {
+        printf("target rate      %.1f/s\n", rate);
+    } else if (speed > 0) {
+        printf("replay speed     %gx\n", speed);
+    } else {
+        printf("replay speed     max\n");
+    }
+    printf("elapsed          %.3f s\n", elapsed);
+    printf("throughput       %.1f commands/s, %.1f KB/s\n", throughput, elapsed > 0 ? bytes / 1024.0 / elapsed : 0);
+    printf("connect us       p50 %.1f  p99 %.1f  max %.1f\n", con[0], con[1], con[2]);
+    printf("latency us       p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n", lat[0], lat[1], lat[2], lat[3]);
+    if (captureFile != NULL) {
+        size_t captured = 0;
+        for (int i = 0; i < sessionCount; i++) {
+            for (int j = 0; j < sessions[i].count; j++) {
+                if (sessions[i].commands[j].latencyNs > 0) {
+                    latency[captured++] = sessions[i].commands[j].latencyNs;
+                }
+            }
+        }
+        qsort(latency, captured, sizeof(uint64_t), compare_u64);
+        printf("captured us      p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+               percentile_us(latency, captured, 0.5), percentile_us(latency, captured, 0.99),
+               percentile_us(latency, captured, 0.999), captured > 0 ? latency[captured - 1] / 1000.0 : 0);
+        printf("output differs   %d commands\n", differed);
+    }
+    if (csvFile != NULL) {
+        FILE *csv = fopen(csvFile, "a");
+        if (csv == NULL) {
+            perror("Error opening CSV file");
+            exit(EXIT_FAILURE);
+        }
+        if (ftell(csv) == 0) {
+            fprintf(csv, "clients,commands,errors,target_rate,elapsed_s,throughput,bytes,"
+                         "connect_p50_us,connect_p99_us,connect_max_us,"
+                         "latency_p50_us,latency_p99_us,latency_p999_us,latency_max_us\n");
+        }
+        fprintf(csv, "%d,%zu,%d,%.1f,%.3f,%.1f,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                clients, completed, errors, rate, elapsed, throughput, (unsigned long long)bytes,
+                con[0], con[1], con[2], lat[0], lat[1], lat[2], lat[3]);
+        fclose(csv);
+    }
+    free(latency);
+    free(connect);
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "combuiltin.h"
+#include "comspawn.h"
+
+struct builtin {
+    const char *name;
+    int (*run)(int argc, char **argv, struct builtin_sink *out);
+};
+
+/**
+ * @brief
+ *
+ * @param out
+ * @param text NUL terminated
+ * @return int -1 once the client is gone
+ */
+static int emit(struct builtin_sink *out, const char *text) {
+    return out->write(out->ctx, text, strlen(text));
+}
+
+/**
+ * @brief
+ *
+ * @param argc
+ * @param argv
+ * @return int 1 if any argument looks like an option
+ */
+static int has_options(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Open a file for cat or head, which only take regular files.
+ *
+ * @param path
+ * @return int descriptor, -1 if the file cannot be used
+ */
+static int open_regular(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd != -1 && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief echo WORD...
+ */
+static int builtin_echo(int argc, char **argv, struct builtin_sink *out) {
+    if (has_options(argc, argv)) {
+        return -1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if ((i > 1 && emit(out, " ") == -1) || emit(out, argv[i]) == -1) {
+            return 1;
+        }
+    }
+    return emit(out, "\n") == -1;
+}
+
+/**
+ * @brief pwd
+ */
+static int builtin_pwd(int argc, char **argv, struct builtin_sink *out) {
+    char cwd[PATH_MAX];
+    if (argc != 1 || getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -1;
+    }
+    return emit(out, cwd) == -1 || emit(out, "\n") == -1;
+}
+
+/**
+ * @brief cat FILE...
+ */
+static int builtin_cat(int argc, char **argv, struct builtin_sink *out) {
+    if (argc < 2 || has_options(argc, argv)) {
+        return -1;
+    }
+    int fds[SPAWN_MAX_ARGS];
+    int count = 0;
+    for (int i = 1; i < argc; i++) {
+        if ((fds[count] = open_regular(argv[i])) == -1) {
+            while (count > 0) {
+                close(fds[--count]);
+            }
+            return -1;
+        }
+        count++;
+    }
+    char buf[BUILTIN_IO_SIZE];
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        ssize_t n;
+        while (status == 0 && (n = read(fds[i], buf, sizeof(buf))) > 0) {
+            status = out->write(out->ctx, buf, n) == -1;
+        }
+        close(fds[i]);
+    }
+    return status;
+}
+
+/**
+ * @brief head [-n LINES] FILE
+ */
+static int builtin_head(int argc, char **argv, struct builtin_sink *out) {
+    long lines = 10;
+    const char *path = argv[1];
+    if (argc == 4 && strcmp(argv[1], "-n") == 0 && argv[2][0] != '\0'
+        && strspn(argv[2], "0123456789") == strlen(argv[2])) {
+        lines = strtol(argv[2], NULL, 10);
+        path = argv[3];
+    } else if (argc != 2 || argv[1][0] == '-') {
+        return -1;
+    }
+    int fd = open_regular(path);
+    if (fd == -1) {
+        return -1;
+    }
+    char buf[BUILTIN_IO_SIZE];
+    int status = 0;
+    ssize_t n;
+    while (status == 0 && lines > 0 && (n = read(fd, buf, sizeof(buf))) > 0) {
+        char *end = buf;
+        while (lines > 0 && (end = memchr(end, '\n', buf + n - end)) != NULL) {
+            end++;
+            lines--;
+        }
+        status = out->write(out->ctx, buf, end != NULL ? end - buf : n) == -1;
+    }
+    close(fd);
+    return status;
+}
+
+/**
+ * @brief
+ *
+ * @return int 1 if names sort in plain byte order, as they do in the C locale
+ */
+static int c_collation() {
+    const char *vars[] = { "LC_ALL", "LC_COLLATE", "LANG" };
+    for (int i = 0; i < 3; i++) {
+        const char *value = getenv(vars[i]);
+        if (value != NULL && value[0] != '\0') {
+            return strcmp(value, "C") == 0 || strcmp(value, "POSIX") == 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief
+ *
+ * @param a
+ * @param b
+ * @return int
+ */
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// ls collects entry names here, one after another, and sorts pointers to
+// them; both are kept for the next ls and only grow
+static char *lsText = NULL;
+static size_t lsTextCap = 0;
+static char **lsNames = NULL;
+static size_t lsNamesCap = 0;
+
+/**
+ * @brief Make room for at least need bytes in a buffer that is kept.
+ *
+ * @param buf
+ * @param cap
+ * @param need
+ */
+static void reserve(void *buf, size_t *cap, size_t need) {
+    if (need <= *cap) {
+        return;
+    }
+    size_t grown = *cap ? *cap : 1024;
+    while (grown < need) {
+        grown *= 2;
+    }
+    void *moved = realloc(*(void **)buf, grown);
+    if (moved == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    *(void **)buf = moved;
+    *cap = grown;
+}
+
+/**
+ * @brief ls [PATH], one name per line as ls prints when not on a terminal
+ */
+static int builtin_ls(int argc, char **argv, struct builtin_sink *out) {
+    if (argc > 2 || has_options(argc, argv) || !c_collation()) {
+        return -1;
+    }
+    const char *path = argc == 2 ? argv[1] : ".";
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return emit(out, path) == -1 || emit(out, "\n") == -1;
+    }
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    size_t count = 0;
+    size_t len = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        size_t nameLen = strlen(entry->d_name) + 1;
+        reserve(&lsText, &lsTextCap, len + nameLen);
+        memcpy(lsText + len, entry->d_name, nameLen);
+        len += nameLen;
+        count++;
+    }
+    closedir(dir);
+    // the text no longer moves, so the pointers into it can be taken now
+    reserve(&lsNames, &lsNamesCap, count * sizeof(char *));
+    for (size_t i = 0, pos = 0; i < count; i++) {
+        lsNames[i] = lsText + pos;
+        pos += strlen(lsText + pos) + 1;
+    }
+    qsort(lsNames, count, sizeof(char *), compare_names);
+    for (size_t i = 0; i < count; i++) {
+        if (emit(out, lsNames[i]) == -1 || emit(out, "\n") == -1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const struct builtin builtins[] = {
+    { "echo", builtin_echo },
+    { "pwd", builtin_pwd },
+    { "cat", builtin_cat },
+    { "head", builtin_head },
+    { "ls", builtin_ls },
+};
+
+/**
+ * @brief Run cmd in the server if it is a builtin it can handle.
+ *
+ * @param cmd
+ * @param out
+ * @return int -1 if cmd is not handled (nothing was written), otherwise
+ * 0 on success and 1 if the output could not be completed
+ */
+int builtin_run(const char *cmd, struct builtin_sink *out) {
+    char words[PATH_MAX];
+    char *argv[SPAWN_MAX_ARGS + 1];
+    int argc = split_command(cmd, words, sizeof(words), argv);
+    if (argc == 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(argv[0], builtins[i].name) == 0) {
+            return builtins[i].run(argc, argv, out);
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,25 @@
+#ifndef _COMBUILTIN_H_
+#define _COMBUILTIN_H_
+
+#include <stddef.h>
+
+// Commands the server runs itself instead of starting a process: echo,
+// cat, ls, pwd and head. A builtin only takes a command line that
+// it reproduces exactly, i.e. plain words and the arguments it supports,
+// and only once it knows it can succeed (files exist, are regular files,
+// and so on). Anything else is left to spawn_command(), so errors and
+// unusual cases still get the real program's behaviour.
+
+#define BUILTIN_IO_SIZE (64 * 1024)
+// read size for cat and head
+
+// Where a builtin's output goes: write is called with each piece of
+// output and returns -1 once the client is gone.
+struct builtin_sink {
+    int (*write)(void *ctx, const char *data, size_t len);
+    void *ctx;
+};
+
+int builtin_run(const char *cmd, struct builtin_sink *out);
+
+#endif
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "comcache.h"
+#include "comstats.h"
+
+struct cache_rule cacheRules[CACHE_MAX_RULES];
+int cacheRuleCount = 0;
+struct cache_entry *cacheEntries = NULL;
+
+/**
+ * @brief Take the entry's lock, also from a server process that died
+ * holding it. The entry is then dropped.
+ *
+ * @param entry
+ */
+static void entry_lock(struct cache_entry *entry) {
+    if (pthread_mutex_lock(&entry->lock) == EOWNERDEAD) {
+        entry->valid = 0;
+        pthread_mutex_consistent(&entry->lock);
+    }
+}
+
+/**
+ * @brief
+ *
+ * @param entry
+ */
+static void entry_unlock(struct cache_entry *entry) {
+    pthread_mutex_unlock(&entry->lock);
+}
+
+/**
+ * @brief Parse one line of the cache file into the next free rule.
+ *
+ * @param line without its newline
+ * @param lineNo for error messages
+ * @return int 0 on success, -1 on a malformed line
+ */
+static int parse_rule(char *line, int lineNo) {
+    if (cacheRuleCount == CACHE_MAX_RULES) {
+        fprintf(stderr, "cache file line %d: more than %d rules\n", lineNo, CACHE_MAX_RULES);
+        return -1;
+    }
+    struct cache_rule *rule = &cacheRules[cacheRuleCount];
+    memset(rule, 0, sizeof(*rule));
+    char *end;
+    long ttl = strtol(line, &end, 10);
+    if (end == line || ttl < 0 || (*end != ' ' && *end != '\t')) {
+        fprintf(stderr, "cache file line %d: expected a TTL in seconds\n", lineNo);
+        return -1;
+    }
+    rule->ttlNs = (uint64_t)ttl * 1000000000ull;
+    char *p = end + strspn(end, " \t");
+    while (*p == '@') {
+        size_t len = strcspn(p + 1, " \t");
+        if (rule->fileCount == CACHE_MAX_FILES || len == 0 || len >= CACHE_MAX_PATH) {
+            fprintf(stderr, "cache file line %d: bad file list\n", lineNo);
+            return -1;
+        }
+        memcpy(rule->files[rule->fileCount++], p + 1, len);
+        p += 1 + len;
+        p += strspn(p, " \t");
+    }
+    if (*p == '\0' || strlen(p) >= CACHE_MAX_COMMAND) {
+        fprintf(stderr, "cache file line %d: missing or overlong command\n", lineNo);
+        return -1;
+    }
+    strcpy(rule->command, p);
+    cacheRuleCount++;
+    return 0;
+}
+
+/**
+ * @brief Read the cache rules and map their entries. Must run before any
+ * server process is forked.
+ *
+ * @param path
+ * @return int 0 on success, -1 on error
+ */
+int cache_load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Error opening cache file");
+        return -1;
+    }
+    char line[CACHE_MAX_COMMAND + CACHE_MAX_FILES * CACHE_MAX_PATH];
+    int lineNo = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineNo++;
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (parse_rule(line, lineNo) == -1) {
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    if (cacheRuleCount == 0) {
+        return 0;
+    }
+    cacheEntries = mmap(NULL, cacheRuleCount * sizeof(struct cache_entry), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cacheEntries == MAP_FAILED) {
+        perror("mmap");
+        cacheEntries = NULL;
+        return -1;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (int i = 0; i < cacheRuleCount; i++) {
+        pthread_mutex_init(&cacheEntries[i].lock, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return 0;
+}
+
+/**
+ * @brief
+ *
+ * @param command
+ * @return int the rule that allows caching this command, -1 if none does
+ */
+int cache_rule_for(const char *command) {
+    if (cacheEntries == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < cacheRuleCount; i++) {
+        if (strcmp(cacheRules[i].command, command) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Record the current modification times of a rule's files. A file
+ * that cannot be stat'ed gets a zero time, which never matches a real one.
+ *
+ * @param rule
+ * @param stamp
+ */
+void cache_begin(int rule, struct cache_stamp *stamp) {
+    memset(stamp, 0, sizeof(*stamp));
+    for (int i = 0; i < cacheRules[rule].fileCount; i++) {
+        struct stat st;
+        if (stat(cacheRules[rule].files[i], &st) == 0) {
+            stamp->mtimes[i] = st.st_mtim;
+        }
+    }
+}
+
+/**
+ * @brief Copy out the cached result of a rule if it is still fresh, and
+ * count the hit or miss.
+ *
+ * @param rule
+ * @param buf at least CACHE_MAX_RESULT bytes
+ * @return ssize_t length of the result, -1 on a miss
+ */
+ssize_t cache_get(int rule, char *buf) {
+    struct cache_rule *r = &cacheRules[rule];
+    struct cache_entry *entry = &cacheEntries[rule];
+    struct cache_stamp now;
+    cache_begin(rule, &now);
+    ssize_t len = -1;
+    entry_lock(entry);
+    int fresh = entry->valid && (r->ttlNs == 0 || now_ns() - entry->storedNs < r->ttlNs);
+    for (int i = 0; fresh && i < r->fileCount; i++) {
+        fresh = now.mtimes[i].tv_sec != 0
+                && now.mtimes[i].tv_sec == entry->stamp.mtimes[i].tv_sec
+                && now.mtimes[i].tv_nsec == entry->stamp.mtimes[i].tv_nsec;
+    }
+    if (fresh) {
+        memcpy(buf, entry->data, entry->len);
+        len = entry->len;
+    }
+    entry_unlock(entry);
+    __atomic_add_fetch(len >= 0 ? &stats->cacheHits : &stats->cacheMisses, 1, __ATOMIC_RELAXED);
+    return len;
+}
+
+/**
+ * @brief Keep the result of a successful run. The stamp is the one taken
+ * before the command started, so a file changed while it ran makes the
+ * next lookup miss.
+ *
+ * @param rule
+ * @param stamp
+ * @param data
+ * @param len at most CACHE_MAX_RESULT
+ */
+void cache_store(int rule, const struct cache_stamp *stamp, const char *data, size_t len) {
+    struct cache_entry *entry = &cacheEntries[rule];
+    entry_lock(entry);
+    memcpy(entry->data, data, len);
+    entry->len = len;
+    entry->stamp = *stamp;
+    entry->storedNs = now_ns();
+    entry->valid = 1;
+    entry_unlock(entry);
+}
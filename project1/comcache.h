@@ -0,0 +1,60 @@
+#ifndef _COMCACHE_H_
+#define _COMCACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Result cache for read-only commands. Only commands listed in the cache
+// file are cached, each with its own expiry: a TTL, the modification
+// times of some files, or both. The rules are loaded by the main process
+// before it forks; the cached results sit in one shared anonymous mapping
+// so that every server process serves and fills the same entries. Each
+// entry has a robust process-shared mutex: an entry whose lock holder
+// died is dropped, as it may have been half written.
+//
+// Cache file format, one rule per line:
+//
+//     TTL [@FILE ...] COMMAND
+//
+// TTL is in seconds, 0 for no time limit. A result is dropped as soon as
+// one of the @FILEs changes. COMMAND must match the command line exactly.
+// Empty lines and lines starting with # are ignored.
+
+#define CACHE_MAX_RULES 64
+#define CACHE_MAX_FILES 4
+#define CACHE_MAX_COMMAND 1024
+#define CACHE_MAX_PATH 256
+#define CACHE_MAX_RESULT (64 * 1024)
+// larger results are sent as usual but not cached
+
+struct cache_rule {
+    char command[CACHE_MAX_COMMAND];
+    uint64_t ttlNs;
+    int fileCount;
+    char files[CACHE_MAX_FILES][CACHE_MAX_PATH];
+};
+
+// modification times of a rule's files when its command was started
+struct cache_stamp {
+    struct timespec mtimes[CACHE_MAX_FILES];
+};
+
+struct cache_entry {
+    pthread_mutex_t lock;
+    int valid;
+    uint64_t storedNs;
+    struct cache_stamp stamp;
+    size_t len;
+    char data[CACHE_MAX_RESULT];
+};
+
+int cache_load(const char *path);
+int cache_rule_for(const char *command);
+ssize_t cache_get(int rule, char *buf);
+void cache_begin(int rule, struct cache_stamp *stamp);
+void cache_store(int rule, const struct cache_stamp *stamp, const char *data, size_t len);
+
+#endif
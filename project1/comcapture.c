@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "comcapture.h"
+
+int captureOn = 0;
+int captureFd = -1;
+char captureBuf[CAPTURE_BUFFER];
+size_t captureFill = 0;
+uint64_t captureFlushedNs = 0;
+pid_t capturePid = 0;
+
+/**
+ * @brief Create CAPTUREFILE and turn capture on. Must run before any
+ * server process is forked; they all append to the same file.
+ *
+ * @param path
+ */
+void capture_init(const char *path) {
+    captureFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (captureFd == -1) {
+        perror("Error when opening capture file");
+        exit(EXIT_FAILURE);
+    }
+    struct capture_header header = { .version = CAPTURE_VERSION, .recordSize = sizeof(struct capture_record) };
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    if (write(captureFd, &header, sizeof(header)) != sizeof(header)) {
+        perror("Error when writing capture file");
+        exit(EXIT_FAILURE);
+    }
+    captureOn = 1;
+    capturePid = getpid();
+    captureFlushedNs = now_ns();
+    atexit(capture_flush);
+}
+
+/**
+ * @brief Drop the records a child inherited from its parent, which the
+ * parent still writes out itself.
+ */
+void capture_forked() {
+    captureFill = 0;
+    capturePid = getpid();
+    captureFlushedNs = now_ns();
+}
+
+/**
+ * @brief
+ *
+ * @param iov
+ * @param count
+ * @param len total bytes in iov
+ */
+static void capture_write(const struct iovec *iov, int count, size_t len) {
+    ssize_t n;
+    do {
+        n = writev(captureFd, iov, count);
+    } while (n == -1 && errno == EINTR);
+    if (n != (ssize_t)len) {
+        perror("Error when writing capture file");
+    }
+}
+
+/**
+ * @brief Add a record, and the text that goes with it, to the buffer. A
+ * record too large for the buffer is written on its own.
+ *
+ * @param record
+ * @param text
+ */
+static void capture_append(struct capture_record *record, const char *text) {
+    record->server = capturePid;
+    size_t len = sizeof(*record) + record->len;
+    if (captureFill + len > sizeof(captureBuf)) {
+        capture_flush();
+    }
+    if (len > sizeof(captureBuf)) {
+        struct iovec iov[2] = { { record, sizeof(*record) }, { (void *)text, record->len } };
+        capture_write(iov, 2, len);
+        return;
+    }
+    memcpy(captureBuf + captureFill, record, sizeof(*record));
+    if (record->len > 0) {
+        memcpy(captureBuf + captureFill + sizeof(*record), text, record->len);
+    }
+    captureFill += len;
+    if (now_ns() - captureFlushedNs >= CAPTURE_FLUSH_INTERVAL_NS) {
+        capture_flush();
+    }
+}
+
+/**
+ * @brief Record a session that has just been set up.
+ *
+ * @param client pid of the client
+ * @param features COM_F_ flags the server accepted
+ * @param wSize frame size
+ * @param concurrency commands the client may run at once
+ */
+void capture_open(pid_t client, int features, int wSize, int concurrency) {
+    struct capture_record record = {
+        .timeNs = now_ns(), .bytes = wSize, .client = client, .flags = features,
+        .kind = CAPTURE_OPEN, .concurrency = concurrency,
+    };
+    capture_append(&record, NULL);
+}
+
+/**
+ * @brief Record a command that has arrived.
+ *
+ * @param client
+ * @param seq
+ * @param receivedNs when it arrived
+ * @param cmd
+ */
+void capture_command(pid_t client, uint32_t seq, uint64_t receivedNs, const char *cmd) {
+    struct capture_record record = {
+        .timeNs = receivedNs, .client = client, .seq = seq, .kind = CAPTURE_COMMAND, .len = strlen(cmd),
+    };
+    capture_append(&record, cmd);
+}
+
+/**
+ * @brief Record a command whose result is complete.
+ *
+ * @param client
+ * @param seq
+ * @param bytes output sent for it
+ * @param flags COM_F_BUSY or COM_F_ERROR if it was refused
+ */
+void capture_result(pid_t client, uint32_t seq, uint64_t bytes, int flags) {
+    struct capture_record record = {
+        .timeNs = now_ns(), .bytes = bytes, .client = client, .seq = seq, .flags = flags, .kind = CAPTURE_RESULT,
+    };
+    capture_append(&record, NULL);
+}
+
+/**
+ * @brief Record the end of a session.
+ *
+ * @param client
+ */
+void capture_close(pid_t client) {
+    struct capture_record record = { .timeNs = now_ns(), .client = client, .kind = CAPTURE_CLOSE };
+    capture_append(&record, NULL);
+}
+
+/**
+ * @brief Write out records that have waited for a second or more. For
+ * loops that may sit idle with records in the buffer.
+ */
+void capture_tick() {
+    if (captureOn && captureFill > 0 && now_ns() - captureFlushedNs >= CAPTURE_FLUSH_INTERVAL_NS) {
+        capture_flush();
+    }
+}
+
+/**
+ * @brief Append the buffer to the capture file. O_APPEND keeps the writes
+ * of different processes from overlapping.
+ */
+void capture_flush() {
+    if (!captureOn || captureFill == 0) {
+        return;
+    }
+    struct iovec iov = { captureBuf, captureFill };
+    capture_write(&iov, 1, captureFill);
+    captureFill = 0;
+    captureFlushedNs = now_ns();
+}
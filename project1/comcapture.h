@@ -0,0 +1,73 @@
+#ifndef _COMCAPTURE_H_
+#define _COMCAPTURE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "comstats.h"
+
+// Workload capture. Started with -C CAPTUREFILE the server records every
+// client session: when it opened and with what settings, each command's
+// text and arrival time, the size of its result and when the result was
+// complete, and when the session ended. comserver-bench -R replays a
+// capture against a server. Like the trace, each process collects its
+// records in a buffer of its own and appends it to CAPTUREFILE with one
+// write() when it is full, at least once a second while records are
+// coming in, when a client session ends and when the process exits. The
+// records of one session all come from the process that served it, in
+// order.
+//
+// A record is a struct capture_record, followed by len bytes of command
+// text for CAPTURE_COMMAND. Times are on the monotonic clock.
+//
+// With capture off a capture point is one test of captureOn.
+
+#define CAPTURE_MAGIC "COMCAPTR"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUFFER (64 * 1024)
+#define CAPTURE_FLUSH_INTERVAL_NS 1000000000ull
+
+// kinds
+#define CAPTURE_OPEN 0    // the server accepted the connection
+#define CAPTURE_COMMAND 1 // a command arrived
+#define CAPTURE_RESULT 2  // the last frame of its result went out
+#define CAPTURE_CLOSE 3   // the session ended
+
+struct capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+};
+
+struct capture_record {
+    uint64_t timeNs;
+    uint64_t bytes;       // CAPTURE_OPEN: frame size; CAPTURE_RESULT: output bytes
+    int32_t server;       // pid of the server process
+    int32_t client;       // pid of the client
+    uint32_t seq;         // CAPTURE_COMMAND, CAPTURE_RESULT: the command's
+    uint32_t flags;       // CAPTURE_OPEN: features accepted; CAPTURE_RESULT: COM_F_BUSY or COM_F_ERROR if refused
+    uint16_t kind;
+    uint16_t concurrency; // CAPTURE_OPEN: commands the client may run at once
+    uint32_t len;         // CAPTURE_COMMAND: bytes of command text that follow
+};
+
+extern int captureOn;
+
+#define CAPTURE_SESSION_OPEN(client, features, wSize, concurrency) \
+    do { if (captureOn) capture_open((client), (features), (wSize), (concurrency)); } while (0)
+#define CAPTURE_COMMAND_IN(client, seq, receivedNs, cmd) \
+    do { if (captureOn) capture_command((client), (seq), (receivedNs), (cmd)); } while (0)
+#define CAPTURE_RESULT_OUT(client, seq, bytes, flags) \
+    do { if (captureOn) capture_result((client), (seq), (bytes), (flags)); } while (0)
+#define CAPTURE_SESSION_CLOSE(client) \
+    do { if (captureOn) capture_close((client)); } while (0)
+
+void capture_init(const char *path);
+void capture_forked();
+void capture_open(pid_t client, int features, int wSize, int concurrency);
+void capture_command(pid_t client, uint32_t seq, uint64_t receivedNs, const char *cmd);
+void capture_result(pid_t client, uint32_t seq, uint64_t bytes, int flags);
+void capture_close(pid_t client);
+void capture_tick();
+void capture_flush();
+
+#endif
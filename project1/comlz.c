@@ -0,0 +1,235 @@
+#include <stdint.h>
+#include <string.h>
+#include "comlz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+/**
+ * @brief
+ *
+ * @param p
+ * @return uint32_t
+ */
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * @brief
+ *
+ * @param v four input bytes
+ * @return uint32_t slot in the match table
+ */
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * @brief Write a length that did not fit in its nibble.
+ *
+ * @param op
+ * @param extra length minus 15
+ * @return unsigned char* past the bytes written
+ */
+static unsigned char* put_length(unsigned char *op, size_t extra) {
+    while (extra >= 255) {
+        *op++ = 255;
+        extra -= 255;
+    }
+    *op++ = (unsigned char)extra;
+    return op;
+}
+
+/**
+ * @brief Emit one sequence: literals, then a match unless matchLen is 0.
+ *
+ * @param op
+ * @param opEnd
+ * @param literals
+ * @param litLen
+ * @param offset
+ * @param matchLen
+ * @return unsigned char* past the sequence, NULL if it does not fit
+ */
+static unsigned char* put_sequence(unsigned char *op, unsigned char *opEnd, const unsigned char *literals,
+                                   size_t litLen, size_t offset, size_t matchLen) {
+    if ((size_t)(opEnd - op) < 1 + litLen / 255 + 1 + litLen + 2 + matchLen / 255 + 1) {
+        return NULL;
+    }
+    unsigned char *token = op++;
+    *token = (litLen >= 15 ? 15 : litLen) << 4;
+    if (litLen >= 15) {
+        op = put_length(op, litLen - 15);
+    }
+    memcpy(op, literals, litLen);
+    op += litLen;
+    if (matchLen == 0) {
+        return op;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    size_t code = matchLen - LZ_MIN_MATCH;
+    *token |= code >= 15 ? 15 : code;
+    if (code >= 15) {
+        op = put_length(op, code - 15);
+    }
+    return op;
+}
+
+/**
+ * @brief Compress a buffer into one block.
+ *
+ * @param src
+ * @param len
+ * @param dst
+ * @param cap
+ * @return size_t block size, 0 if it does not fit in cap
+ */
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;
+    const unsigned char *end = base + len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *opEnd = op + cap;
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    while (len >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+        uint32_t h = lz_hash(read32(ip));
+        const unsigned char *ref = base + table[h];
+        table[h] = ip - base;
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)) {
+            ip++;
+            continue;
+        }
+        size_t matchLen = LZ_MIN_MATCH;
+        while (ip + matchLen < end && ref[matchLen] == ip[matchLen]) {
+            matchLen++;
+        }
+        op = put_sequence(op, opEnd, anchor, ip - anchor, ip - ref, matchLen);
+        if (op == NULL) {
+            return 0;
+        }
+        ip += matchLen;
+        anchor = ip;
+    }
+    op = put_sequence(op, opEnd, anchor, end - anchor, 0, 0);
+    return op == NULL ? 0 : op - (unsigned char *)dst;
+}
+
+/**
+ * @brief Read a length continued past its nibble.
+ *
+ * @param ip
+ * @param iend
+ * @param len in: the nibble value, out: the full length
+ * @return int -1 if the input ends first
+ */
+static int get_length(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/**
+ * @brief Decode one block.
+ *
+ * @param src
+ * @param len
+ * @param dst
+ * @param cap
+ * @return ssize_t decoded size, -1 if the block is corrupt or does not fit
+ */
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + cap;
+    while (ip < iend) {
+        unsigned char token = *ip++;
+        size_t litLen = token >> 4;
+        if (litLen == 15 && get_length(&ip, iend, &litLen) == -1) {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < litLen || (size_t)(oend - op) < litLen) {
+            return -1;
+        }
+        memcpy(op, ip, litLen);
+        ip += litLen;
+        op += litLen;
+        if (ip == iend) {
+            break;
+        }
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && get_length(&ip, iend, &matchLen) == -1) {
+            return -1;
+        }
+        matchLen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst) || (size_t)(oend - op) < matchLen) {
+            return -1;
+        }
+        // byte by byte, since a match may overlap the bytes it produces
+        const unsigned char *match = op - offset;
+        while (matchLen-- > 0) {
+            *op++ = *match++;
+        }
+    }
+    return op - (unsigned char *)dst;
+}
+
+/**
+ * @brief Replace a frame payload by its COM_F_LZ form if that is smaller.
+ *
+ * @param payload
+ * @param len in: output bytes in the payload, out: payload length to send
+ * @param scratch COM_LZ_SCRATCH bytes
+ * @return int 1 if the payload was compressed
+ */
+int com_lz_pack(char *payload, size_t *len, char *scratch) {
+    if (*len < COM_LZ_THRESHOLD || *len > COM_MAX_WSIZE) {
+        return 0;
+    }
+    uint32_t raw = *len;
+    size_t packed = lz_compress(payload, *len, scratch + sizeof(raw), *len - sizeof(raw) - 1);
+    if (packed == 0) {
+        return 0;
+    }
+    memcpy(scratch, &raw, sizeof(raw));
+    *len = sizeof(raw) + packed;
+    memcpy(payload, scratch, *len);
+    return 1;
+}
+
+/**
+ * @brief Decode a COM_F_LZ frame payload.
+ *
+ * @param payload
+ * @param len
+ * @param out
+ * @param cap
+ * @return ssize_t output length, -1 if the payload is corrupt
+ */
+ssize_t com_lz_unpack(const char *payload, size_t len, char *out, size_t cap) {
+    uint32_t raw;
+    if (len < sizeof(raw)) {
+        return -1;
+    }
+    memcpy(&raw, payload, sizeof(raw));
+    ssize_t n = lz_decompress(payload + sizeof(raw), len - sizeof(raw), out, cap);
+    return n == (ssize_t)raw ? n : -1;
+}
@@ -0,0 +1,32 @@
+#ifndef _COMLZ_H_
+#define _COMLZ_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "comproto.h"
+
+// Small LZ77 codec for result frames, in the style of LZ4's block format.
+// A block is a run of sequences; each starts with a token byte whose high
+// nibble is the literal count and low nibble the match length minus 4,
+// 15 meaning more length bytes follow (each 255 means keep adding). Then
+// come the literals, a 2 byte little-endian offset back into the output
+// and the extra match length bytes. The last sequence has literals only.
+//
+// A COMMAND_RES frame with COM_F_LZ carries a uint32_t with the original
+// length followed by one block. Every frame is compressed on its own, so
+// the client decodes each one as it arrives.
+
+#define COM_LZ_THRESHOLD 256
+// frames with less output than this are sent as they are
+
+#define COM_LZ_BOUND(len) ((len) + (len) / 255 + 16)
+#define COM_LZ_SCRATCH (sizeof(uint32_t) + COM_LZ_BOUND(COM_MAX_WSIZE))
+// scratch space com_lz_pack needs for frames of up to COM_MAX_WSIZE
+
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap);
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t cap);
+
+int com_lz_pack(char *payload, size_t *len, char *scratch);
+ssize_t com_lz_unpack(const char *payload, size_t len, char *out, size_t cap);
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "compool.h"
+
+// the header in front of every buffer; data is what com_pool_get returns
+struct com_pool_buf {
+    struct com_pool_buf *next;
+    struct com_pool_buf *all;
+    max_align_t data[];
+};
+
+/**
+ * @brief
+ *
+ * @param pool
+ * @param size bytes in every buffer of the pool
+ */
+void com_pool_init(struct com_pool *pool, size_t size) {
+    pool->size = size;
+    pool->free = NULL;
+    pool->all = NULL;
+    pool->count = 0;
+}
+
+/**
+ * @brief Take a buffer of pool->size bytes, allocating one only if all
+ * the pool's buffers are in use.
+ *
+ * @param pool
+ * @return void*
+ */
+void *com_pool_get(struct com_pool *pool) {
+    struct com_pool_buf *buf = pool->free;
+    if (buf != NULL) {
+        pool->free = buf->next;
+        return buf->data;
+    }
+    buf = malloc(sizeof(struct com_pool_buf) + pool->size);
+    if (buf == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    buf->all = pool->all;
+    pool->all = buf;
+    pool->count++;
+    return buf->data;
+}
+
+/**
+ * @brief Give a buffer back to the pool it came from.
+ *
+ * @param pool
+ * @param data from com_pool_get, or NULL
+ */
+void com_pool_put(struct com_pool *pool, void *data) {
+    if (data == NULL) {
+        return;
+    }
+    struct com_pool_buf *buf = (struct com_pool_buf *)((char *)data - offsetof(struct com_pool_buf, data));
+    buf->next = pool->free;
+    pool->free = buf;
+}
+
+/**
+ * @brief Release every buffer of the pool, in use or not.
+ *
+ * @param pool
+ */
+void com_pool_free(struct com_pool *pool) {
+    while (pool->all != NULL) {
+        struct com_pool_buf *buf = pool->all;
+        pool->all = buf->all;
+        free(buf);
+    }
+    pool->free = NULL;
+    pool->count = 0;
+}
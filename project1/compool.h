@@ -0,0 +1,26 @@
+#ifndef _COMPOOL_H_
+#define _COMPOOL_H_
+
+#include <stddef.h>
+
+// Fixed-size buffers recycled through a free list. A connection takes its
+// frame, scratch and result buffers from its own pool and gives them back
+// when it is done with them, so once the first few messages have been
+// handled no message needs a heap allocation. A pool grows to the most
+// buffers that were in use at once, and com_pool_free() releases them all.
+
+struct com_pool_buf;
+
+struct com_pool {
+    size_t size;
+    struct com_pool_buf *free;
+    struct com_pool_buf *all;
+    int count;
+};
+
+void com_pool_init(struct com_pool *pool, size_t size);
+void *com_pool_get(struct com_pool *pool);
+void com_pool_put(struct com_pool *pool, void *data);
+void com_pool_free(struct com_pool *pool);
+
+#endif
@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include "comproto.h"
+#include "comshm.h"
+
+/**
+ * @brief Write a message header into out, which must hold COM_HDR_SIZE bytes.
+ *
+ * @param out
+ * @param type
+ * @param flags
+ * @param seq
+ * @param len payload length
+ */
+void com_encode_hdr(char *out, int type, int flags, uint32_t seq, uint32_t len) {
+    uint8_t version = COM_PROTO_VERSION;
+    uint8_t type8 = type;
+    uint16_t flags16 = flags;
+    memcpy(out, &len, 4);
+    memcpy(out + 4, &version, 1);
+    memcpy(out + 5, &type8, 1);
+    memcpy(out + 6, &flags16, 2);
+    memcpy(out + 8, &seq, 4);
+}
+
+/**
+ * @brief Read a message header from in, which must hold COM_HDR_SIZE bytes.
+ *
+ * @param in
+ * @param hdr
+ * @return int 0 on success, -1 for an unknown version or oversized payload
+ */
+int com_decode_hdr(const char *in, struct com_hdr *hdr) {
+    memcpy(&hdr->len, in, 4);
+    memcpy(&hdr->version, in + 4, 1);
+    memcpy(&hdr->type, in + 5, 1);
+    memcpy(&hdr->flags, in + 6, 2);
+    memcpy(&hdr->seq, in + 8, 4);
+    if (hdr->version != COM_PROTO_VERSION || hdr->len > COM_MAX_PAYLOAD) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send one message. Header and payload go out in a single writev()
+ * so the payload is never copied into a staging buffer.
+ *
+ * @param fd
+ * @param type
+ * @param flags
+ * @param seq
+ * @param data payload, may be NULL when len is 0
+ * @param len
+ * @return ssize_t bytes written, or -1 on error
+ */
+ssize_t com_write_msg(int fd, int type, int flags, uint32_t seq, const void *data, size_t len) {
+    char hdr[COM_HDR_SIZE];
+    com_encode_hdr(hdr, type, flags, seq, len);
+    struct iovec iov[2] = {
+        { .iov_base = hdr, .iov_len = COM_HDR_SIZE },
+        { .iov_base = (void *)data, .iov_len = len },
+    };
+    int iovcnt = len > 0 ? 2 : 1;
+    size_t total = COM_HDR_SIZE + len;
+    size_t written = 0;
+    struct iovec *cur = iov;
+    while (written < total) {
+        ssize_t n = writev(fd, cur, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        written += n;
+        while (iovcnt > 0 && (size_t)n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            cur->iov_base = (char *)cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+    return written;
+}
+
+/**
+ * @brief Send len bytes over a Unix socket with a descriptor attached to
+ * the first of them (SCM_RIGHTS). The receiver gets its own copy of fd.
+ *
+ * @param sock
+ * @param data
+ * @param len
+ * @param fd
+ * @return ssize_t bytes sent, or -1 on error
+ */
+ssize_t com_send_fd(int sock, const void *data, size_t len, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return -1;
+    }
+    // the descriptor went with the first byte, the rest goes plainly
+    size_t sent = n;
+    while (sent < len) {
+        n = send(sock, (const char *)data + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+/**
+ * @brief Receive from a Unix socket, taking a descriptor that came with
+ * the bytes. Descriptors beyond the first are closed.
+ *
+ * @param sock
+ * @param data
+ * @param len
+ * @param fd set to the descriptor received, close-on-exec, or -1
+ * @return ssize_t bytes received, 0 when the peer is gone, -1 on error
+ */
+ssize_t com_recv_fd(int sock, void *data, size_t len, int *fd) {
+    char control[CMSG_SPACE(sizeof(int) * COM_MAX_FDS)];
+    struct iovec iov = { .iov_base = data, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    *fd = -1;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); n >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int received;
+            memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (*fd == -1) {
+                *fd = received;
+            } else {
+                close(received);
+            }
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief
+ *
+ * @param p
+ * @param cap initial buffer size, grown when a larger message arrives
+ */
+void com_parser_init(struct com_parser *p, size_t cap) {
+    p->buf = malloc(cap);
+    p->cap = cap;
+    p->start = 0;
+    p->end = 0;
+    p->need = 0;
+}
+
+/**
+ * @brief
+ *
+ * @param p
+ */
+void com_parser_free(struct com_parser *p) {
+    free(p->buf);
+    p->buf = NULL;
+    p->cap = 0;
+    p->start = 0;
+    p->end = 0;
+}
+
+/**
+ * @brief Drop whatever the parser holds, keeping its buffer for the next
+ * stream.
+ *
+ * @param p
+ */
+void com_parser_reset(struct com_parser *p) {
+    p->start = 0;
+    p->end = 0;
+    p->need = 0;
+}
+
+/**
+ * @brief Free space to receive into. Unconsumed bytes are moved to the
+ * front first, and the buffer grows if the message being waited for does
+ * not fit.
+ *
+ * @param p
+ * @param avail set to the number of bytes that may be written
+ * @return char* where received bytes go, followed by com_parser_commit
+ */
+char* com_parser_space(struct com_parser *p, size_t *avail) {
+    if (p->start == p->end) {
+        p->start = 0;
+        p->end = 0;
+    }
+    if (p->start > 0 && (p->end == p->cap || p->start + p->need > p->cap)) {
+        memmove(p->buf, p->buf + p->start, p->end - p->start);
+        p->end -= p->start;
+        p->start = 0;
+    }
+    if (p->need > p->cap) {
+        p->buf = realloc(p->buf, p->need);
+        p->cap = p->need;
+    }
+    *avail = p->cap - p->end;
+    return p->buf + p->end;
+}
+
+/**
+ * @brief Account for n bytes placed at com_parser_space.
+ *
+ * @param p
+ * @param n
+ */
+void com_parser_commit(struct com_parser *p, size_t n) {
+    p->end += n;
+}
+
+/**
+ * @brief Append whatever one read() returns.
+ *
+ * @param p
+ * @param fd
+ * @return ssize_t bytes read, 0 on end of file, -1 on error (errno set)
+ */
+ssize_t com_parser_fill(struct com_parser *p, int fd) {
+    size_t avail;
+    char *space = com_parser_space(p, &avail);
+    ssize_t n;
+    do {
+        n = read(fd, space, avail);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        com_parser_commit(p, n);
+    }
+    return n;
+}
+
+/**
+ * @brief Take the next complete message from the buffer.
+ *
+ * @param p
+ * @param hdr decoded header
+ * @param payload set to the payload inside the parser buffer
+ * @return int 1 if a message was returned, 0 if more bytes are needed,
+ * -1 if the stream is not a valid message stream
+ */
+int com_parser_next(struct com_parser *p, struct com_hdr *hdr, const char **payload) {
+    size_t avail = p->end - p->start;
+    if (avail < COM_HDR_SIZE) {
+        p->need = COM_HDR_SIZE;
+        return 0;
+    }
+    const char *h = p->buf + p->start;
+    if (com_decode_hdr(h, hdr) == -1) {
+        return -1;
+    }
+    if (avail < COM_HDR_SIZE + hdr->len) {
+        p->need = COM_HDR_SIZE + hdr->len;
+        return 0;
+    }
+    *payload = h + COM_HDR_SIZE;
+    p->start += COM_HDR_SIZE + hdr->len;
+    p->need = 0;
+    return 1;
+}
+
+/**
+ * @brief Remove every complete CREDIT message from the unconsumed part of
+ * the buffer, keeping the other messages in order. Used by a sender that
+ * has run out of credit while requests are still queued ahead of it.
+ *
+ * @param p
+ * @return uint32_t total credit granted by the removed messages
+ */
+uint32_t com_parser_take_credits(struct com_parser *p) {
+    uint32_t credits = 0;
+    size_t pos = p->start;
+    struct com_hdr hdr;
+    while (p->end - pos >= COM_HDR_SIZE && com_decode_hdr(p->buf + pos, &hdr) == 0
+           && p->end - pos >= COM_HDR_SIZE + hdr.len) {
+        size_t size = COM_HDR_SIZE + hdr.len;
+        if (hdr.type != CREDIT || hdr.len != sizeof(uint32_t)) {
+            pos += size;
+            continue;
+        }
+        uint32_t granted;
+        memcpy(&granted, p->buf + pos + COM_HDR_SIZE, sizeof(granted));
+        credits += granted;
+        memmove(p->buf + pos, p->buf + pos + size, p->end - pos - size);
+        p->end -= size;
+    }
+    return credits;
+}
+
+/**
+ * @brief Receive more bytes from the link into the parser.
+ *
+ * @param link
+ * @param p
+ * @return ssize_t bytes received, 0 when the peer is gone, -1 on error
+ */
+ssize_t com_link_fill(struct com_link *link, struct com_parser *p) {
+    if (link->chan == NULL && link->sock) {
+        size_t avail;
+        char *space = com_parser_space(p, &avail);
+        int fd;
+        ssize_t n = com_recv_fd(link->rfd, space, avail, &fd);
+        if (n > 0) {
+            com_parser_commit(p, n);
+        }
+        if (fd != -1 && link->nfds < COM_MAX_FDS) {
+            link->fds[link->nfds++] = fd;
+        } else if (fd != -1) {
+            close(fd);
+        }
+        return n;
+    }
+    if (link->chan == NULL) {
+        return com_parser_fill(p, link->rfd);
+    }
+    size_t avail;
+    char *space = com_parser_space(p, &avail);
+    ssize_t n = com_chan_read(link->chan, space, avail);
+    if (n > 0) {
+        com_parser_commit(p, n);
+    }
+    return n;
+}
+
+/**
+ * @brief Send one message over the link. On the rings, a message that fits
+ * is built in place so the payload is copied exactly once.
+ *
+ * @param link
+ * @param type
+ * @param flags
+ * @param seq
+ * @param data
+ * @param len
+ * @return ssize_t bytes sent, or -1 on error
+ */
+ssize_t com_link_send(struct com_link *link, int type, int flags, uint32_t seq, const void *data, size_t len) {
+    if (link->chan == NULL) {
+        return com_write_msg(link->wfd, type, flags, seq, data, len);
+    }
+    if (COM_HDR_SIZE + len <= link->chan->ring_size) {
+        char *space = com_chan_reserve(link->chan, COM_HDR_SIZE + len);
+        if (space == NULL) {
+            return -1;
+        }
+        com_encode_hdr(space, type, flags, seq, len);
+        if (len > 0) {
+            memcpy(space + COM_HDR_SIZE, data, len);
+        }
+        com_chan_commit(link->chan, COM_HDR_SIZE + len);
+        return COM_HDR_SIZE + len;
+    }
+    char hdr[COM_HDR_SIZE];
+    com_encode_hdr(hdr, type, flags, seq, len);
+    if (com_chan_write(link->chan, hdr, COM_HDR_SIZE) == -1 || com_chan_write(link->chan, data, len) == -1) {
+        return -1;
+    }
+    return COM_HDR_SIZE + len;
+}
+
+/**
+ * @brief Send a header-only message with a descriptor attached. Only on a
+ * socket link.
+ *
+ * @param link
+ * @param type
+ * @param flags
+ * @param seq
+ * @param fd
+ * @return ssize_t bytes sent, or -1 on error
+ */
+ssize_t com_link_send_fd(struct com_link *link, int type, int flags, uint32_t seq, int fd) {
+    char hdr[COM_HDR_SIZE];
+    com_encode_hdr(hdr, type, flags, seq, 0);
+    return com_send_fd(link->wfd, hdr, COM_HDR_SIZE, fd);
+}
+
+/**
+ * @brief Take the oldest descriptor received on the link.
+ *
+ * @param link
+ * @return int the descriptor, now owned by the caller, or -1 if none came
+ */
+int com_link_take_fd(struct com_link *link) {
+    if (link->nfds == 0) {
+        return -1;
+    }
+    int fd = link->fds[0];
+    link->nfds--;
+    memmove(link->fds, link->fds + 1, link->nfds * sizeof(int));
+    return fd;
+}
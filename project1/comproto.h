@@ -0,0 +1,162 @@
+#ifndef _COMPROTO_H_
+#define _COMPROTO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Wire protocol shared by the client and comserver.
+//
+// Every message is a fixed 12 byte header followed by len payload bytes.
+// Both ends run on the same host, so fields are in host byte order.
+//
+//   0      4        5     6       8      12
+//   | len  | version| type| flags | seq  | payload ...
+
+#define COM_PROTO_VERSION 1
+#define COM_HDR_SIZE 12
+#define COM_MAX_PAYLOAD (1 << 20)
+// largest payload a parser will accept
+
+#define COM_MIN_WSIZE 64
+#define COM_MAX_WSIZE (64 * 1024)
+// bounds for the negotiated frame size (client -s WSIZE)
+
+#define COM_DEFAULT_CREDITS 8
+// result frames the server may send before the client returns credit
+
+#define COM_MAX_CONCURRENCY 16
+// most commands the server runs at once for one client (client -k)
+
+#define COM_NAME_MAX 64
+// max FIFO or shared memory name carried in a connection request
+
+// message types
+#define CONNECTION_REQ 1
+#define CONNECTION_REP 2
+#define SEND_COMMAND 3
+#define COMMAND_RES 4
+#define QUIT_REQ 5
+#define QUIT_REP 6
+#define QUIT_ALL_REQ 7
+#define STATS_REQ 8
+#define STATS_REP 9
+#define CREDIT 10
+// payload is a uint32_t: more COMMAND_RES frames the server may send
+
+// header flags
+#define COM_F_LAST 0x0001
+// last COMMAND_RES frame of a result, carries no output
+#define COM_F_SHM 0x0002
+// CONNECTION_REQ: the client offers the shared memory rings in shm_name
+// CONNECTION_REP: the server attached, all further traffic uses the rings.
+// With empty FIFO names the rings are the only channel and carry the reply
+// too; a reply without COM_F_SHM then means the server cannot serve the
+// client that way
+#define COM_F_LZ 0x0004
+// CONNECTION_REQ: the client can take compressed results
+// CONNECTION_REP: the server may compress result frames (see comlz.h)
+// COMMAND_RES: this frame's payload is compressed
+#define COM_F_BUSY 0x0008
+// COMMAND_RES with COM_F_LAST: the server was too busy to run the command;
+// the payload is a message for the user instead of output
+#define COM_F_FD 0x0010
+// CONNECTION_REQ: the client is on the Unix socket and can take output as
+// a pipe; CONNECTION_REP: the server may hand it over
+// COMMAND_RES: the read end of the command's output pipe came with this
+// frame (SCM_RIGHTS); the rest of the output is read from it until end of
+// file, and the COM_F_LAST frame follows once the command has exited
+#define COM_F_SESSION 0x0020
+// CONNECTION_REQ: run the client's commands in one long-lived shell
+// CONNECTION_REP: the server does (see comshell.h); commands then run one
+// at a time, and every COM_F_LAST frame carries COM_F_STATUS
+#define COM_F_STATUS 0x0040
+// COMMAND_RES with COM_F_LAST: the payload is the command's exit status,
+// an int32_t
+#define COM_F_ERROR 0x0080
+// COMMAND_RES with COM_F_LAST: the server will not run the command, now
+// or on a retry; the payload is a message for the user instead of output
+
+#define COM_MAX_FDS COM_MAX_CONCURRENCY
+// descriptors a link holds until they are taken, one per running command
+
+struct com_hdr {
+    uint32_t len;
+    uint8_t version;
+    uint8_t type;
+    uint16_t flags;
+    uint32_t seq;
+};
+
+// payload of CONNECTION_REQ, sent over the server's message queue, or as
+// the first message on the server's Unix socket with no FIFO names
+struct com_conn_info {
+    int32_t pid;
+    int32_t wsize;
+    int32_t credits;
+    int32_t concurrency;
+    int32_t weight;
+    char cs_name[COM_NAME_MAX];
+    char sc_name[COM_NAME_MAX];
+    char shm_name[COM_NAME_MAX];
+};
+
+// Incremental receive buffer. Bytes from any number of read() calls are
+// appended at end; complete messages are taken from start. Payloads are
+// returned as pointers into buf and stay valid until the next fill.
+struct com_parser {
+    char *buf;
+    size_t cap;
+    size_t start;
+    size_t end;
+    size_t need;
+};
+
+// payload of CONNECTION_REP, followed by the text "Connection established".
+// With concurrency above 1, results of different commands may interleave;
+// every COMMAND_RES frame carries the seq of the command it belongs to.
+// pid is the server process serving the client, which a client on the
+// shared memory rings watches to notice a server that died.
+struct com_conn_reply {
+    int32_t wsize;
+    int32_t credits;
+    int32_t concurrency;
+    int32_t pid;
+};
+
+struct com_chan;
+
+// Where a peer's messages are read from and written to: the FIFO pair or
+// the Unix socket, or the shared memory rings when chan is set. With sock
+// set, rfd is a socket that may carry descriptors, which wait in fds until
+// taken in the order they arrived.
+struct com_link {
+    int rfd;
+    int wfd;
+    struct com_chan *chan;
+    int sock;
+    int fds[COM_MAX_FDS];
+    int nfds;
+};
+
+void com_encode_hdr(char *out, int type, int flags, uint32_t seq, uint32_t len);
+int com_decode_hdr(const char *in, struct com_hdr *hdr);
+ssize_t com_write_msg(int fd, int type, int flags, uint32_t seq, const void *data, size_t len);
+ssize_t com_send_fd(int sock, const void *data, size_t len, int fd);
+ssize_t com_recv_fd(int sock, void *data, size_t len, int *fd);
+
+void com_parser_init(struct com_parser *p, size_t cap);
+void com_parser_free(struct com_parser *p);
+void com_parser_reset(struct com_parser *p);
+char* com_parser_space(struct com_parser *p, size_t *avail);
+void com_parser_commit(struct com_parser *p, size_t n);
+ssize_t com_parser_fill(struct com_parser *p, int fd);
+int com_parser_next(struct com_parser *p, struct com_hdr *hdr, const char **payload);
+uint32_t com_parser_take_credits(struct com_parser *p);
+
+ssize_t com_link_fill(struct com_link *link, struct com_parser *p);
+ssize_t com_link_send(struct com_link *link, int type, int flags, uint32_t seq, const void *data, size_t len);
+ssize_t com_link_send_fd(struct com_link *link, int type, int flags, uint32_t seq, int fd);
+int com_link_take_fd(struct com_link *link);
+
+#endif
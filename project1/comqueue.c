@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "comqueue.h"
+
+/**
+ * @brief
+ *
+ * @param base MQNAME
+ * @param shard -1 for MQNAME itself
+ * @param out
+ * @param len
+ */
+void com_queue_name(const char *base, int shard, char *out, size_t len) {
+    if (shard < 0) {
+        snprintf(out, len, "%s", base);
+    } else {
+        snprintf(out, len, "%s.%d", base, shard);
+    }
+}
+
+/**
+ * @brief Pick the shard a client connects through. Pids are often handed
+ * out in sequence, so they are mixed before taking the remainder.
+ *
+ * @param pid
+ * @param shards
+ * @return int shard index, -1 without shards
+ */
+int com_queue_shard(pid_t pid, int shards) {
+    if (shards <= 0) {
+        return -1;
+    }
+    uint32_t h = (uint32_t)pid * 2654435761u;
+    return (h >> 16) % shards;
+}
+
+/**
+ * @brief Open the queue a client sends its connection request to: its
+ * shard if the server has one for it, MQNAME otherwise.
+ *
+ * @param base MQNAME
+ * @param shards number of shards the client expects, 0 for none
+ * @param pid
+ * @param name receives the name of the queue opened
+ * @param len
+ * @return mqd_t the queue, non-blocking, or (mqd_t)-1
+ */
+mqd_t com_queue_open(const char *base, int shards, pid_t pid, char *name, size_t len) {
+    mqd_t mqd = (mqd_t)-1;
+    int shard = com_queue_shard(pid, shards);
+    if (shard >= 0) {
+        com_queue_name(base, shard, name, len);
+        mqd = mq_open(name, O_WRONLY | O_NONBLOCK);
+    }
+    if (mqd == (mqd_t)-1) {
+        com_queue_name(base, -1, name, len);
+        mqd = mq_open(name, O_WRONLY | O_NONBLOCK);
+    }
+    return mqd;
+}
+
+/**
+ * @brief Send a connection request. If the queue is full the server is
+ * not keeping up with connections; that is reported, then the send waits
+ * for room as it always did.
+ *
+ * @param mqd opened by com_queue_open
+ * @param name queue name, for the report
+ * @param msg
+ * @param len
+ * @return int 0 on success, -1 with errno set
+ */
+int com_queue_send(mqd_t mqd, const char *name, const char *msg, size_t len) {
+    if (mq_send(mqd, msg, len, 0) == 0) {
+        return 0;
+    }
+    if (errno != EAGAIN) {
+        return -1;
+    }
+    fprintf(stderr, "Connection queue %s is full, waiting for the server\n", name);
+    struct mq_attr attr = { .mq_flags = 0 };
+    if (mq_setattr(mqd, &attr, NULL) == -1) {
+        return -1;
+    }
+    return mq_send(mqd, msg, len, 0);
+}
@@ -0,0 +1,27 @@
+#ifndef _COMQUEUE_H_
+#define _COMQUEUE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <mqueue.h>
+
+// Connection queues. The server always takes CONNECTION_REQ messages on
+// MQNAME. Started with -q N it also creates N shards MQNAME.0 to
+// MQNAME.N-1, and a client given the same N sends its request to the
+// shard its pid hashes to. Connection storms are then spread over several
+// queues, each drained by its own acceptor process, instead of all
+// waiting on one. A client whose shard does not exist falls back to
+// MQNAME, so the two sides do not have to agree exactly.
+
+#define COM_QUEUE_MAX_SHARDS 64
+
+#define COM_QUEUE_DEFAULT_DEPTH 10
+// messages a queue holds before senders block; going above
+// /proc/sys/fs/mqueue/msg_max needs privileges
+
+void com_queue_name(const char *base, int shard, char *out, size_t len);
+int com_queue_shard(pid_t pid, int shards);
+mqd_t com_queue_open(const char *base, int shards, pid_t pid, char *name, size_t len);
+int com_queue_send(mqd_t mqd, const char *name, const char *msg, size_t len);
+
+#endif
@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "comsched.h"
+
+struct sched_state *sched = NULL;
+
+/**
+ * @brief Take the lock, also from a server process that died holding it.
+ * Its clients are dropped by sched_reclaim() once it is reaped, which
+ * puts right the counts it held.
+ */
+static void sched_lock() {
+    if (pthread_mutex_lock(&sched->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&sched->lock);
+    }
+}
+
+/**
+ * @brief
+ */
+static void sched_unlock() {
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/**
+ * @brief Account for a command the client is starting: it moves one
+ * stride further through its share.
+ *
+ * @param c
+ */
+static void charge(struct sched_client *c) {
+    if (c->pass > sched->virtualTime) {
+        sched->virtualTime = c->pass;
+    }
+    c->pass += SCHED_STRIDE / c->weight;
+}
+
+/**
+ * @brief Hand free slots to waiting clients, lowest pass first, and wake
+ * them. Called with the lock held.
+ */
+static void dispatch() {
+    while (sched->inUse < sched->slots && sched->waiting > 0) {
+        struct sched_client *next = NULL;
+        for (int i = 0; i < SCHED_MAX_CLIENTS; i++) {
+            struct sched_client *c = &sched->clients[i];
+            if (c->owner != 0 && c->waiting > 0 && (next == NULL || c->pass < next->pass)) {
+                next = c;
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        next->waiting--;
+        sched->waiting--;
+        next->running++;
+        sched->inUse++;
+        charge(next);
+        __atomic_add_fetch(&next->grants, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &next->grants, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/**
+ * @brief Map the scheduler state. Must run before any server process is
+ * forked.
+ *
+ * @param slots commands that may run at once
+ * @param backlog commands that may wait for a slot
+ */
+void sched_init(int slots, int backlog) {
+    sched = mmap(NULL, sizeof(struct sched_state), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sched == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    memset(sched, 0, sizeof(struct sched_state));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sched->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    sched->slots = slots;
+    sched->backlog = backlog;
+}
+
+/**
+ * @brief
+ *
+ * @return int 1 if commands need a slot to run
+ */
+int sched_enabled() {
+    return sched != NULL;
+}
+
+/**
+ * @brief Register a client connection with the calling process as owner.
+ *
+ * @param weight share of the slots relative to other clients
+ * @return int client index, -1 if the table is full; such a client still
+ * needs a slot but is turned away instead of waiting for one
+ */
+int sched_join(int weight) {
+    sched_lock();
+    int index = -1;
+    for (int i = 0; i < SCHED_MAX_CLIENTS && index == -1; i++) {
+        struct sched_client *c = &sched->clients[i];
+        if (c->owner == 0) {
+            c->owner = getpid();
+            c->weight = weight < 1 ? 1 : weight > SCHED_MAX_WEIGHT ? SCHED_MAX_WEIGHT : weight;
+            c->running = 0;
+            c->waiting = 0;
+            c->pass = sched->virtualTime;
+            index = i;
+        }
+    }
+    sched_unlock();
+    return index;
+}
+
+/**
+ * @brief Drop a client's entry, giving back its slots and its place in line.
+ *
+ * @param client
+ */
+void sched_leave(int client) {
+    if (client < 0) {
+        return;
+    }
+    sched_lock();
+    struct sched_client *c = &sched->clients[client];
+    sched->inUse -= c->running;
+    sched->waiting -= c->waiting;
+    c->running = 0;
+    c->waiting = 0;
+    c->owner = 0;
+    dispatch();
+    sched_unlock();
+}
+
+/**
+ * @brief Ask for a slot. A client that has to wait must not ask again
+ * until sched_granted() says its slot has arrived.
+ *
+ * @param client
+ * @param ticket set when queued, for sched_granted() and sched_wait()
+ * @return int SCHED_GRANTED, SCHED_QUEUED or SCHED_BUSY
+ */
+int sched_acquire(int client, uint32_t *ticket) {
+    int result = SCHED_BUSY;
+    sched_lock();
+    if (client < 0) {
+        if (sched->inUse < sched->slots && sched->waiting == 0) {
+            sched->inUse++;
+            result = SCHED_GRANTED;
+        }
+        sched_unlock();
+        return result;
+    }
+    struct sched_client *c = &sched->clients[client];
+    // an idle client starts level with the others, with no saved up share
+    if (c->running == 0 && c->pass < sched->virtualTime) {
+        c->pass = sched->virtualTime;
+    }
+    if (sched->inUse < sched->slots && sched->waiting == 0) {
+        c->running++;
+        sched->inUse++;
+        charge(c);
+        result = SCHED_GRANTED;
+    } else if (sched->waiting < sched->backlog) {
+        *ticket = __atomic_load_n(&c->grants, __ATOMIC_ACQUIRE);
+        c->waiting++;
+        sched->waiting++;
+        result = SCHED_QUEUED;
+    }
+    sched_unlock();
+    return result;
+}
+
+/**
+ * @brief
+ *
+ * @param client
+ * @param ticket from sched_acquire()
+ * @return int 1 once the slot the client waited for is its own
+ */
+int sched_granted(int client, uint32_t ticket) {
+    return __atomic_load_n(&sched->clients[client].grants, __ATOMIC_ACQUIRE) != ticket;
+}
+
+/**
+ * @brief Sleep until the slot is granted or the timeout passes.
+ *
+ * @param client
+ * @param ticket from sched_acquire()
+ * @param timeoutMs
+ */
+void sched_wait(int client, uint32_t ticket, int timeoutMs) {
+    struct timespec timeout = { .tv_sec = timeoutMs / 1000, .tv_nsec = (timeoutMs % 1000) * 1000000L };
+    syscall(SYS_futex, &sched->clients[client].grants, FUTEX_WAIT, ticket, &timeout, NULL, 0);
+}
+
+/**
+ * @brief Give back the slot of a command that has finished.
+ *
+ * @param client
+ */
+void sched_release(int client) {
+    sched_lock();
+    if (client >= 0) {
+        sched->clients[client].running--;
+    }
+    sched->inUse--;
+    dispatch();
+    sched_unlock();
+}
+
+/**
+ * @brief Turn one of the client's slots into one held by no client, so
+ * that it outlives sched_leave() for a command still running when its
+ * connection closes. Give it back with sched_release(-1).
+ *
+ * @param client
+ */
+void sched_disown(int client) {
+    if (client < 0) {
+        return;
+    }
+    sched_lock();
+    sched->clients[client].running--;
+    sched_unlock();
+}
+
+/**
+ * @brief Give back everything held by clients of a server process that
+ * has exited.
+ *
+ * @param owner
+ */
+void sched_reclaim(pid_t owner) {
+    sched_lock();
+    for (int i = 0; i < SCHED_MAX_CLIENTS; i++) {
+        struct sched_client *c = &sched->clients[i];
+        if (c->owner == owner) {
+            sched->inUse -= c->running;
+            sched->waiting -= c->waiting;
+            c->running = 0;
+            c->waiting = 0;
+            c->owner = 0;
+        }
+    }
+    dispatch();
+    sched_unlock();
+}
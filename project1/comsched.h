@@ -0,0 +1,65 @@
+#ifndef _COMSCHED_H_
+#define _COMSCHED_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Execution slots shared by all server processes. With -x SLOTS at most
+// SLOTS spawned commands run at once across the whole server; builtins
+// and cache hits run in the server process and need no slot. A command
+// that finds every slot taken waits in line, and a freed slot goes
+// straight to the waiting client that is furthest behind its fair share:
+// each client has a pass value that grows by SCHED_STRIDE / weight per
+// command started (stride scheduling), so a client with weight 2 gets
+// twice the slots of one with weight 1 while both have commands waiting.
+// A client only holds one place in line at a time, so a heavy COMFILE
+// cannot crowd out the others. Once more than BACKLOG commands are
+// waiting, new ones are refused right away with a BUSY reply.
+//
+// The state sits in one shared anonymous mapping created by the main
+// process before it forks, under a robust process-shared mutex. Slots held
+// by a server process that dies are given back when it is reaped, and a
+// lock it held is taken over by the next process that asks for it.
+
+#define SCHED_MAX_CLIENTS 256
+#define SCHED_MAX_WEIGHT 16
+#define SCHED_STRIDE 65536
+#define SCHED_DEFAULT_BACKLOG 64
+
+// how sched_acquire answered
+#define SCHED_GRANTED 0
+#define SCHED_QUEUED 1
+#define SCHED_BUSY 2
+
+struct sched_client {
+    pid_t owner;
+    int weight;
+    int running;
+    int waiting;
+    uint64_t pass;
+    uint32_t grants;
+};
+
+struct sched_state {
+    pthread_mutex_t lock;
+    int slots;
+    int backlog;
+    int inUse;
+    int waiting;
+    uint64_t virtualTime;
+    struct sched_client clients[SCHED_MAX_CLIENTS];
+};
+
+void sched_init(int slots, int backlog);
+int sched_enabled();
+int sched_join(int weight);
+void sched_leave(int client);
+int sched_acquire(int client, uint32_t *ticket);
+int sched_granted(int client, uint32_t ticket);
+void sched_wait(int client, uint32_t ticket, int timeoutMs);
+void sched_release(int client);
+void sched_disown(int client);
+void sched_reclaim(pid_t owner);
+
+#endif
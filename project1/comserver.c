@@ -1,294 +1,2508 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <mqueue.h>
 #include <string.h>
-#include <ctype.h>
+#include <errno.h>
+#include "comproto.h"
+#include "comshm.h"
+#include "comstats.h"
+#include "comcache.h"
+#include "comspawn.h"
+#include "combuiltin.h"
+#include "comlz.h"
+#include "comqueue.h"
+#include "comsched.h"
+#include "comtrace.h"
+#include "comcapture.h"
+#include "comshell.h"
+#include "compool.h"
 #define MAX_MSG_SIZE 256
 #define QUEUE_PERMISSIONS 0660
 #define BUFFER_SIZE 1024
-#define CONNECTION_REQ 1
-#define CONNECTION_REP 2
-#define SEND_COMMAND 3
-#define COMMAND_RES 4
-#define QUIT_REQ 5
-#define QUIT_REP 6
-#define QUIT_ALL_REQ 7
+#define POOL_MAX_WORKERS 256
+#define MAX_ACCEPTORS 64
+#define QUEUE_REPORT_INTERVAL_NS 1000000000ull
+#define SPLICE_MIN_BYTES 1024
+#define PASS_MIN_BYTES 4096
+#define SOCKET_REQUEST_TIMEOUT_MS 100
+#define SCHED_POLL_MS 2
+#define EXIT_POLL_MS 100
+#define STOP_GRACE_MS 1000
+#define BUSY_TEXT "Server busy, command not run"
+#define TOO_LONG_TEXT "Command too long to wait for an execution slot, not run"
+#define POOL_BUFFER_SIZE COM_LZ_SCRATCH
+// the largest of a frame, a cached result and the LZ scratch space
+#define POOL_IDLE_TIMEOUT_MS 30000
+#define SLOT_FREE 0
+#define SLOT_IDLE 1
+#define SLOT_BUSY 2
+/*
+ * A connection request as handed from the main loop to whoever serves it.
+ * It is small enough to cross the dispatch socket in one message. A
+ * client that connected over the Unix socket has sockFd set, and no FIFO
+ * names. A client on the shared memory rings alone has neither.
+ */
+struct conn_request {
+    int sockFd;
+    char csPipeName[COM_NAME_MAX];
+    char scPipeName[COM_NAME_MAX];
+    int wSize;
+    int credits;
+    int concurrency;
+    int weight;
+    pid_t pid;
+    int features;
+    char shmName[COM_NAME_MAX];
+};
+/*
+ * A command a server child is running for its client. keep receives the
+ * output of a cacheable command, up to CACHE_MAX_RESULT bytes, in a pool
+ * buffer held while the command runs. Once the
+ * output pipe has been passed to the client, outFd is a pidfd for the
+ * command instead. In session mode pid and outFd are the shell's, and
+ * status is set once the marker after the command's output has been read.
+ */
+struct running_cmd {
+    pid_t pid;
+    int outFd;
+    int passed;
+    int status;
+    uint32_t seq;
+    uint64_t received;
+    uint64_t bytes;
+    int cacheRule;
+    struct cache_stamp cacheStamp;
+    char *keep;
+};
+/*
+ * State of one client connection served by a server child: where messages
+ * come from and go to, frame size and remaining flow-control credit, and
+ * the up to maxRunning commands in progress. Buffers come from pool:
+ * frame, cacheBuf, which holds a cached result being sent and is only
+ * taken once a cacheable command arrives, and lzBuf, the compression
+ * scratch space, set if the client takes compressed frames. With execution
+ * slots, a command waiting for one is held in queued, a pool buffer too,
+ * and no further messages are taken until it starts.
+ * passFds is set if output pipes may be passed to the client. shell is
+ * the client's shell in session mode. exiting holds commands whose output
+ * has ended but which have not exited yet, each with a pidfd in outFd
+ * (-1 if the kernel has none); they keep their execution slot and the
+ * output to cache until they are reaped.
+ */
+struct client_session {
+    pid_t clientPid;
+    struct com_link link;
+    struct com_parser in;
+    int wSize;
+    uint32_t credits;
+    struct com_pool pool;
+    char *frame;
+    char *cacheBuf;
+    char *lzBuf;
+    int maxRunning;
+    int running;
+    struct running_cmd cmds[COM_MAX_CONCURRENCY];
+    int passFds;
+    struct shell_session *shell;
+    int schedClient;
+    char *queued;
+    uint32_t queuedSeq;
+    uint32_t queuedTicket;
+    uint64_t queuedReceived;
+    int queuedRule;
+    struct running_cmd *exiting;
+    int exitingCount;
+    int exitingCap;
+};
+/*
+ * Pre-forked worker pool, kept in a shared anonymous mapping so that the
+ * main loop and the workers see the same slot states.
+ */
+struct pool_slot {
+    pid_t pid;
+    int state;
+};
+struct worker_pool {
+    int minWorkers;
+    int maxWorkers;
+    int live;
+    int queued;
+    struct pool_slot slots[POOL_MAX_WORKERS];
+};
+struct worker_pool *pool = NULL;
+// a SOCK_SEQPACKET pair, so a request and its socket go to one worker
+int dispatchSock[2] = {-1, -1};
+/*
+ * Connection queues: MQNAME first, then its shards. Every acceptor process
+ * has all of them open but only watches MQNAME and its share of the
+ * shards, listed in watched.
+ */
+struct accept_queue {
+    mqd_t mq;
+    long depth;
+    uint64_t lastReportNs;
+    char name[BUFFER_SIZE];
+};
+struct accept_queue queues[COM_QUEUE_MAX_SHARDS + 1];
+int queueCount = 0;
+int watched[COM_QUEUE_MAX_SHARDS + 1];
+int watchedCount = 0;
+// acceptor processes the main process started, restarted if they die
+pid_t acceptorPids[MAX_ACCEPTORS];
+int acceptorCount = 1;
+int eventLoop = 0;
+// set by -r: clients that offer the rings alone are served over them
+int ringsTransport = 0;
+// the Unix socket clients may connect to instead of the message queue
+int listenFd = -1;
+/**
+ * @brief 
+ * 
+ * @param request 
+ */
+void handle_client_request(struct conn_request *request);
+/**
+ * @brief Decode a CONNECTION_REQ taken from the message queue.
+ *
+ * @param buffer message as received
+ * @param size size returned by mq_receive
+ * @param request
+ * @return int 0 on success, -1 if the message is not a connection request
+ */
+int parse_connection_request(const char *buffer, ssize_t size, struct conn_request *request) {
+    struct com_hdr hdr;
+    struct com_conn_info info;
+    if (size < COM_HDR_SIZE || com_decode_hdr(buffer, &hdr) == -1 || hdr.type != CONNECTION_REQ
+        || hdr.len != sizeof(info) || size < COM_HDR_SIZE + hdr.len) {
+        fprintf(stderr, "server: malformed connection request\n");
+        return -1;
+    }
+    memcpy(&info, buffer + COM_HDR_SIZE, sizeof(info));
+    memcpy(request->csPipeName, info.cs_name, COM_NAME_MAX);
+    memcpy(request->scPipeName, info.sc_name, COM_NAME_MAX);
+    memcpy(request->shmName, info.shm_name, COM_NAME_MAX);
+    request->csPipeName[COM_NAME_MAX - 1] = '\0';
+    request->scPipeName[COM_NAME_MAX - 1] = '\0';
+    request->shmName[COM_NAME_MAX - 1] = '\0';
+    request->wSize = info.wsize < COM_MIN_WSIZE ? COM_MIN_WSIZE
+                   : info.wsize > COM_MAX_WSIZE ? COM_MAX_WSIZE : info.wsize;
+    request->credits = info.credits > 0 ? info.credits : COM_DEFAULT_CREDITS;
+    request->concurrency = info.concurrency < 1 ? 1
+                         : info.concurrency > COM_MAX_CONCURRENCY ? COM_MAX_CONCURRENCY : info.concurrency;
+    request->weight = info.weight;
+    request->pid = info.pid;
+    request->features = hdr.flags;
+    request->sockFd = -1;
+    return 0;
+}
+/**
+ * @brief Build the CONNECTION_REP payload: the frame size, credit and
+ * number of concurrent commands the server will use, the pid of the
+ * process serving the client, then the confirmation text.
+ *
+ * @param out at least sizeof(struct com_conn_reply) + 32 bytes
+ * @param request
+ * @return size_t payload length
+ */
+size_t build_connection_reply(char *out, struct conn_request *request) {
+    struct com_conn_reply reply = {
+        .wsize = request->wSize, .credits = request->credits, .concurrency = request->concurrency,
+        .pid = getpid()
+    };
+    const char *text = "Connection established";
+    memcpy(out, &reply, sizeof(reply));
+    strcpy(out + sizeof(reply), text);
+    return sizeof(reply) + strlen(text) + 1;
+}
+/**
+ * @brief
+ *
+ * @param link the client's FIFO or socket, or its rings if it has nothing else
+ * @param flags features accepted for this connection
+ * @param request
+ */
+void send_connection_reply(struct com_link *link, int flags, struct conn_request *request) {
+    char payload[BUFFER_SIZE];
+    size_t len = build_connection_reply(payload, request);
+    com_link_send(link, CONNECTION_REP, flags, 0, payload, len);
+}
+/**
+ * @brief
+ *
+ * @param request
+ * @return int 1 if the client has no FIFOs and no socket, only the rings
+ */
+int rings_only(struct conn_request *request) {
+    return request->sockFd == -1 && request->csPipeName[0] == '\0';
+}
+/**
+ * @brief Drop a request from a client on the shared memory rings alone
+ * when this server does not serve clients that way. Clients only send one
+ * to a server that advertised the rings; this is one that replaced it, and
+ * the client goes back to FIFOs once it sees the old server is gone.
+ *
+ * @param request
+ */
+void refuse_rings(struct conn_request *request) {
+    fprintf(stderr, "Client %d is on shared memory rings, which this server does not serve\n", (int)request->pid);
+}
+/**
+ * @brief Number of workers currently waiting for a connection.
+ *
+ * @return int
+ */
+int pool_idle_workers() {
+    int idle = 0;
+    for (int i = 0; i < pool->maxWorkers; i++) {
+        if (__atomic_load_n(&pool->slots[i].state, __ATOMIC_ACQUIRE) == SLOT_IDLE) {
+            idle++;
+        }
+    }
+    return idle;
+}
+/**
+ * @brief Let an idle worker leave the pool, but never below minWorkers.
+ *
+ * @return int 1 if the caller may exit
+ */
+int pool_try_retire() {
+    int live = __atomic_load_n(&pool->live, __ATOMIC_ACQUIRE);
+    while (live > pool->minWorkers) {
+        if (__atomic_compare_exchange_n(&pool->live, &live, live - 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+/**
+ * @brief Body of a pre-forked worker: take connection requests from the
+ * dispatch pipe, serve the client until it quits, then go back to waiting.
+ *
+ * @param slot index of this worker in the pool
+ */
+void pool_worker(int slot) {
+    struct conn_request request;
+    struct pollfd pfd = { .fd = dispatchSock[0], .events = POLLIN };
+    close(dispatchSock[1]);
+    while (1) {
+        __atomic_store_n(&pool->slots[slot].state, SLOT_IDLE, __ATOMIC_RELEASE);
+        int ready = poll(&pfd, 1, POOL_IDLE_TIMEOUT_MS);
+        if (ready == 0 && pool_try_retire()) {
+            __atomic_store_n(&pool->slots[slot].state, SLOT_FREE, __ATOMIC_RELEASE);
+            exit(EXIT_SUCCESS);
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        int fd;
+        ssize_t n = com_recv_fd(dispatchSock[0], &request, sizeof(request), &fd);
+        if (n == 0) {
+            // every acceptor is gone, so no more connections will come
+            exit(EXIT_SUCCESS);
+        }
+        if (n != sizeof(request)) {
+            if (n < 0 && errno != EINTR) {
+                perror("worker: dispatch read error");
+            }
+            if (fd != -1) {
+                close(fd);
+            }
+            continue;
+        }
+        if (request.sockFd != -1) {
+            request.sockFd = fd;
+        }
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&pool->slots[slot].state, SLOT_BUSY, __ATOMIC_RELEASE);
+        handle_client_request(&request);
+    }
+}
+/**
+ * @brief Fork one more worker into a free pool slot.
+ *
+ * @return int 0 on success, -1 if the pool is full or fork failed
+ */
+int pool_spawn_worker() {
+    for (int i = 0; i < pool->maxWorkers; i++) {
+        // several acceptors may be growing the pool at once
+        int state = SLOT_FREE;
+        if (!__atomic_compare_exchange_n(&pool->slots[i].state, &state, SLOT_IDLE, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            trace_forked();
+            capture_forked();
+            pool_worker(i);
+            exit(EXIT_SUCCESS);
+        }
+        if (pid < 0) {
+            perror("fork error");
+            __atomic_store_n(&pool->slots[i].state, SLOT_FREE, __ATOMIC_RELEASE);
+            return -1;
+        }
+        pool->slots[i].pid = pid;
+        __atomic_add_fetch(&pool->live, 1, __ATOMIC_ACQ_REL);
+        return 0;
+    }
+    return -1;
+}
+/**
+ * @brief Create the shared pool state and the dispatch pipe, then fork the
+ * minimum number of workers.
+ *
+ * @param minWorkers
+ * @param maxWorkers
+ */
+void pool_start(int minWorkers, int maxWorkers) {
+    pool = mmap(NULL, sizeof(struct worker_pool), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    memset(pool, 0, sizeof(struct worker_pool));
+    pool->minWorkers = minWorkers;
+    pool->maxWorkers = maxWorkers;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, dispatchSock) == -1) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < minWorkers; i++) {
+        pool_spawn_worker();
+    }
+    printf("Worker pool started: min = %d, max = %d\n", minWorkers, maxWorkers);
+    fflush(stdout);
+}
+void acceptor_start(int index);
+void ev_command_exited(pid_t pid, int status);
+/**
+ * @brief Collect exited children. A pool worker that died without retiring
+ * gives its slot back, and the pool is topped up to minWorkers again. An
+ * acceptor that died is started again. In event loop mode a command gives
+ * back its slot, and a cacheable result is stored once the command is
+ * known to have succeeded.
+ */
+void reap_children() {
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (sched_enabled()) {
+            sched_reclaim(pid);
+        }
+        if (eventLoop) {
+            ev_command_exited(pid, status);
+        }
+        for (int i = 1; i < acceptorCount; i++) {
+            if (acceptorPids[i] == pid) {
+                fprintf(stderr, "Acceptor %d exited, starting it again\n", i);
+                acceptor_start(i);
+            }
+        }
+        if (pool == NULL) {
+            continue;
+        }
+        for (int i = 0; i < pool->maxWorkers; i++) {
+            if (pool->slots[i].pid == pid && pool->slots[i].state != SLOT_FREE) {
+                pool->slots[i].state = SLOT_FREE;
+                __atomic_sub_fetch(&pool->live, 1, __ATOMIC_ACQ_REL);
+                break;
+            }
+        }
+    }
+    if (pool != NULL) {
+        while (__atomic_load_n(&pool->live, __ATOMIC_ACQUIRE) < pool->minWorkers) {
+            if (pool_spawn_worker() == -1) {
+                break;
+            }
+        }
+    }
+}
+/**
+ * @brief Hand a connection request to the pool, growing it when every
+ * worker is already busy. Without a pool, fork a child for the client.
+ *
+ * @param request
+ */
+void dispatch_connection(struct conn_request *request) {
+    uint64_t traceStart = TRACE_START();
+    if (rings_only(request) && !ringsTransport) {
+        refuse_rings(request);
+        return;
+    }
+    if (pool == NULL) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            trace_forked();
+            capture_forked();
+            handle_client_request(request);
+            exit(EXIT_SUCCESS);
+        }
+        else if (pid < 0) {
+            perror("fork error");
+        }
+        if (request->sockFd != -1) {
+            close(request->sockFd);
+        }
+        TRACE(TRACE_DISPATCH, request->pid, 0, traceStart, 0);
+        return;
+    }
+    int queued = __atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    ssize_t sent = request->sockFd != -1
+                 ? com_send_fd(dispatchSock[1], request, sizeof(*request), request->sockFd)
+                 : write(dispatchSock[1], request, sizeof(*request));
+    if (request->sockFd != -1) {
+        close(request->sockFd);
+    }
+    if (sent != sizeof(*request)) {
+        perror("dispatch write error");
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+        return;
+    }
+    TRACE(TRACE_DISPATCH, request->pid, 0, traceStart, 0);
+    if (queued > pool_idle_workers() &&
+        __atomic_load_n(&pool->live, __ATOMIC_ACQUIRE) < pool->maxWorkers) {
+        pool_spawn_worker();
+    }
+}
+/**
+ * @brief Create or open MQNAME and its shards, non-blocking so that an
+ * acceptor can watch several of them and drain each one.
+ *
+ * @param mqName
+ * @param shards
+ * @param depth messages each queue holds
+ */
+void queues_open(const char *mqName, int shards, long depth) {
+    struct mq_attr attr = {
+        .mq_flags = 0,
+        .mq_maxmsg = depth,
+        .mq_msgsize = MAX_MSG_SIZE,
+        .mq_curmsgs = 0
+    };
+    for (int i = -1; i < shards; i++) {
+        struct accept_queue *queue = &queues[queueCount];
+        com_queue_name(mqName, i, queue->name, sizeof(queue->name));
+        queue->mq = mq_open(queue->name, O_RDWR | O_CREAT | O_NONBLOCK, QUEUE_PERMISSIONS, &attr);
+        if (queue->mq == (mqd_t)-1) {
+            int error = errno;
+            perror("mq_open");
+            if (error == EINVAL) {
+                fprintf(stderr, "A queue depth of %ld may be above /proc/sys/fs/mqueue/msg_max\n", depth);
+            }
+            exit(EXIT_FAILURE);
+        }
+        // a queue left over from an earlier run keeps its old depth
+        struct mq_attr actual;
+        queue->depth = mq_getattr(queue->mq, &actual) == 0 ? actual.mq_maxmsg : depth;
+        if (queue->depth != depth) {
+            fprintf(stderr, "Queue %s already exists with depth %ld\n", queue->name, queue->depth);
+        }
+        queueCount++;
+    }
+}
+/**
+ * @brief Choose the queues acceptor index watches: MQNAME, which every
+ * acceptor shares, and every acceptors-th shard starting at its own. With
+ * fewer shards than acceptors, acceptors share shards instead.
+ *
+ * @param index
+ */
+void queues_select(int index) {
+    int shards = queueCount - 1;
+    watchedCount = 0;
+    watched[watchedCount++] = 0;
+    for (int i = 0; i < shards; i++) {
+        if (shards >= acceptorCount ? i % acceptorCount == index : i == index % shards) {
+            watched[watchedCount++] = 1 + i;
+        }
+    }
+}
+/**
+ * @brief Look at how many connection requests are waiting in a queue that
+ * became readable, and report it if the queue is full: clients connecting
+ * then block in mq_send until an acceptor catches up. Reported at most
+ * once a second per queue.
+ *
+ * @param queue
+ */
+void queue_check_overload(struct accept_queue *queue) {
+    struct mq_attr attr;
+    if (mq_getattr(queue->mq, &attr) == -1) {
+        return;
+    }
+    int full = attr.mq_curmsgs >= queue->depth;
+    stats_queue_depth(attr.mq_curmsgs, full);
+    uint64_t now = now_ns();
+    if (full && now - queue->lastReportNs >= QUEUE_REPORT_INTERVAL_NS) {
+        queue->lastReportNs = now;
+        fprintf(stderr, "Connection queue %s is full (%ld requests), clients are waiting\n",
+                queue->name, queue->depth);
+    }
+}
+/**
+ * @brief Take the next valid connection request from a queue.
+ *
+ * @param queue
+ * @param request
+ * @return int 1 if request was filled, 0 once the queue is empty
+ */
+int queue_receive(struct accept_queue *queue, struct conn_request *request) {
+    while (1) {
+        char buffer[MAX_MSG_SIZE];
+        memset(buffer, 0, MAX_MSG_SIZE);
+        uint64_t traceStart = TRACE_START();
+        ssize_t size = mq_receive(queue->mq, buffer, MAX_MSG_SIZE, NULL);
+        if (size == -1) {
+            break;
+        }
+        if (parse_connection_request(buffer, size, request) == 0) {
+            TRACE(TRACE_ACCEPT, request->pid, 0, traceStart, size);
+            return 1;
+        }
+    }
+    if (errno != EAGAIN) {
+        perror("mq_receive error");
+    }
+    return 0;
+}
+/**
+ * @brief Listen on a Unix socket as well as the message queues. Every
+ * acceptor watches it; the socket is non-blocking, so the ones that lose
+ * the race for a connection just move on.
+ *
+ * @param path
+ */
+void listen_open(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    // a socket file left over from an earlier run
+    unlink(path);
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listenFd, SOMAXCONN) == -1) {
+        perror("Error when listening on socket");
+        exit(EXIT_FAILURE);
+    }
+    // a client that goes away must not take the process serving it along
+    signal(SIGPIPE, SIG_IGN);
+}
+/**
+ * @brief Take the next connection from the Unix socket and read its
+ * CONNECTION_REQ, which the client sends as soon as it has connected. A
+ * client that does not send one within SOCKET_REQUEST_TIMEOUT_MS is
+ * dropped.
+ *
+ * @param request filled with sockFd set to the connection
+ * @return int 1 if request was filled, 0 once no connection is waiting
+ */
+int socket_receive(struct conn_request *request) {
+    while (1) {
+        uint64_t traceStart = TRACE_START();
+        int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1 && errno == EINTR) {
+            continue;
+        }
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return 0;
+        }
+        struct timeval timeout = { 0, SOCKET_REQUEST_TIMEOUT_MS * 1000 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char buffer[MAX_MSG_SIZE];
+        ssize_t size = recv(fd, buffer, COM_HDR_SIZE + sizeof(struct com_conn_info), MSG_WAITALL);
+        struct timeval none = { 0, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+        if (size > 0 && parse_connection_request(buffer, size, request) == 0) {
+            request->sockFd = fd;
+            TRACE(TRACE_ACCEPT, request->pid, 0, traceStart, size);
+            return 1;
+        }
+        close(fd);
+    }
+}
+/**
+ * @brief Accept loop of the fork per client and worker pool modes: wait
+ * until one of the watched queues, or the Unix socket, has requests, then
+ * hand all of them out.
+ */
+void run_acceptor() {
+    struct pollfd pfds[COM_QUEUE_MAX_SHARDS + 2];
+    for (int i = 0; i < watchedCount; i++) {
+        pfds[i] = (struct pollfd){ .fd = (int)queues[watched[i]].mq, .events = POLLIN };
+    }
+    // a negative descriptor is skipped by poll
+    pfds[watchedCount] = (struct pollfd){ .fd = listenFd, .events = POLLIN };
+    while (1) {
+        int ready = poll(pfds, watchedCount + 1, 1000);
+        if (ready == -1 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        reap_children();
+        trace_tick();
+        capture_tick();
+        for (int i = 0; i < watchedCount && ready > 0; i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            struct accept_queue *queue = &queues[watched[i]];
+            struct conn_request request;
+            queue_check_overload(queue);
+            while (queue_receive(queue, &request)) {
+                reap_children();
+                dispatch_connection(&request);
+            }
+        }
+        if (ready > 0 && (pfds[watchedCount].revents & POLLIN)) {
+            struct conn_request request;
+            while (socket_receive(&request)) {
+                reap_children();
+                dispatch_connection(&request);
+            }
+        }
+    }
+}
+/*
+ * Event loop mode (-e): one process watches the message queue and every
+ * client's FIFOs through epoll. Each connection is a small struct with its
+ * own input and output buffers; a process is only forked to run a command.
+ */
+#define EV_MAX_EVENTS 64
+#define EV_OUT_HIGH_WATER (64 * 1024)
+#define EV_MQ 0
+#define EV_CS 1
+#define EV_SC 2
+#define EV_OUT 3
+#define EV_LISTEN 4
+#define EV_SPARE_CONNS 64
+#define EV_EXIT_WAITS 64
+struct ev_conn;
+struct ev_handle {
+    int kind;
+    int fd;
+    struct ev_conn *conn;
+};
+struct ev_conn {
+    pid_t clientPid;
+    struct ev_handle cs;
+    struct ev_handle sc;
+    struct ev_handle out;
+    int wSize;
+    pid_t cmdPid;
+    int closing;
+    int dead;
+    int scWatched;
+    int outPaused;
+    uint32_t credits;
+    uint32_t cmdSeq;
+    uint64_t cmdStart;
+    uint64_t cmdBytes;
+    int cacheRule;
+    struct cache_stamp cacheStamp;
+    char *cacheBuf;
+    int replaying;
+    char *replayBuf;
+    size_t replayLen;
+    size_t replayOff;
+    size_t replayCap;
+    char *lzBuf;
+    int schedClient;
+    char *queued;
+    uint32_t queuedTicket;
+    struct ev_conn *nextQueued;
+    struct com_parser in;
+    char *outBuf;
+    size_t outLen;
+    size_t outCap;
+    struct ev_conn *nextDead;
+};
+int epollFd = -1;
+struct ev_conn *deadConns = NULL;
+// closed connections kept for reuse with their parser, output and replay
+// buffers; smaller buffers come from evPool
+struct ev_conn *spareConns = NULL;
+int spareCount = 0;
+struct com_pool evPool;
+// connections whose command waits for an execution slot
+struct ev_conn *queuedConns = NULL;
+/*
+ * A command the event loop started that holds an execution slot or has a
+ * cacheable result. The slot is given back when the command exits, not
+ * when it closes its output, so a command cannot run on outside the -x
+ * limit. A result is only stored if the command exits with status 0, and
+ * the loop never waits for that: the output, handed over in a pool buffer
+ * once the pipe is closed, and the exit status, from reap_children, may
+ * come in either order, and the result is stored once both are in.
+ */
+struct ev_exit_wait {
+    pid_t pid;
+    int schedClient;
+    int hasSlot;
+    int rule;
+    struct cache_stamp stamp;
+    char *data;
+    size_t len;
+    int exited;
+    int status;
+};
+struct ev_exit_wait *exitWaits = NULL;
+int exitWaitCount = 0;
+int exitWaitCap = 0;
+/**
+ * @brief
+ *
+ * @param pid
+ * @return struct ev_exit_wait* NULL if pid's exit is not waited for
+ */
+struct ev_exit_wait* ev_exit_find(pid_t pid) {
+    for (int i = 0; i < exitWaitCount; i++) {
+        if (exitWaits[i].pid == pid) {
+            return &exitWaits[i];
+        }
+    }
+    return NULL;
+}
+/**
+ * @brief Stop waiting for a command once it has exited and its output, if
+ * it is cached, is complete, storing the result if the command succeeded.
+ *
+ * @param wait
+ */
+void ev_exit_finish(struct ev_exit_wait *wait) {
+    if (!wait->exited || (wait->rule >= 0 && wait->data == NULL)) {
+        return;
+    }
+    if (wait->rule >= 0 && WIFEXITED(wait->status) && WEXITSTATUS(wait->status) == 0) {
+        cache_store(wait->rule, &wait->stamp, wait->data, wait->len);
+    }
+    com_pool_put(&evPool, wait->data);
+    *wait = exitWaits[--exitWaitCount];
+}
+/**
+ * @brief Start waiting for the exit of a command that was just started.
+ *
+ * @param conn
+ */
+void ev_exit_watch(struct ev_conn *conn) {
+    if (exitWaitCount == exitWaitCap) {
+        exitWaitCap = exitWaitCap == 0 ? EV_EXIT_WAITS : exitWaitCap * 2;
+        exitWaits = realloc(exitWaits, exitWaitCap * sizeof(*exitWaits));
+        if (exitWaits == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    exitWaits[exitWaitCount++] = (struct ev_exit_wait){
+        .pid = conn->cmdPid, .schedClient = conn->schedClient, .hasSlot = sched_enabled(),
+        .rule = conn->cacheRule, .stamp = conn->cacheStamp,
+    };
+}
+/**
+ * @brief A cacheable command's output is complete: take its buffer, or
+ * give up on a result too large to cache.
+ *
+ * @param conn
+ */
+void ev_cache_output(struct ev_conn *conn) {
+    struct ev_exit_wait *wait = ev_exit_find(conn->cmdPid);
+    if (wait == NULL) {
+        return;
+    }
+    if (conn->cmdBytes <= CACHE_MAX_RESULT) {
+        wait->data = conn->cacheBuf;
+        wait->len = conn->cmdBytes;
+        conn->cacheBuf = NULL;
+    } else {
+        wait->rule = -1;
+    }
+    ev_exit_finish(wait);
+}
+/**
+ * @brief Called from reap_children for every child that exited.
+ *
+ * @param pid
+ * @param status
+ */
+void ev_command_exited(pid_t pid, int status) {
+    struct ev_exit_wait *wait = ev_exit_find(pid);
+    if (wait == NULL) {
+        return;
+    }
+    wait->exited = 1;
+    wait->status = status;
+    if (wait->hasSlot) {
+        wait->hasSlot = 0;
+        sched_release(wait->schedClient);
+    }
+    ev_exit_finish(wait);
+}
+/**
+ * @brief A connection is closing: its commands that are still running
+ * keep their slots until they exit, but no longer as the client's, whose
+ * entry is about to go, and the result of the one it was reading is not
+ * stored.
+ *
+ * @param conn
+ */
+void ev_exit_disown(struct ev_conn *conn) {
+    for (int i = 0; i < exitWaitCount; i++) {
+        struct ev_exit_wait *wait = &exitWaits[i];
+        if (wait->pid == conn->cmdPid) {
+            com_pool_put(&evPool, wait->data);
+            wait->data = NULL;
+            wait->rule = -1;
+        }
+        if (wait->hasSlot && wait->schedClient == conn->schedClient && conn->schedClient >= 0) {
+            sched_disown(wait->schedClient);
+            wait->schedClient = -1;
+        }
+    }
+}
+/**
+ * @brief Change the epoll interest set of a handle.
+ *
+ * @param handle
+ * @param op EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+ * @param events
+ */
+void ev_watch(struct ev_handle *handle, int op, unsigned int events) {
+    struct epoll_event ev = { .events = events, .data.ptr = handle };
+    if (epoll_ctl(epollFd, op, handle->fd, &ev) == -1) {
+        perror("epoll_ctl");
+    }
+}
+/**
+ * @brief Make room for len more bytes of pending output.
+ *
+ * @param conn
+ * @param len
+ * @return char* where the bytes go; outLen is not advanced
+ */
+char* ev_reserve_output(struct ev_conn *conn, size_t len) {
+    if (conn->outLen + len > conn->outCap) {
+        size_t cap = conn->outCap ? conn->outCap : BUFFER_SIZE;
+        while (cap < conn->outLen + len) {
+            cap *= 2;
+        }
+        conn->outBuf = realloc(conn->outBuf, cap);
+        conn->outCap = cap;
+    }
+    return conn->outBuf + conn->outLen;
+}
+/**
+ * @brief Append a whole message to the connection's pending output.
+ *
+ * @param conn
+ * @param type
+ * @param flags
+ * @param seq
+ * @param data
+ * @param len
+ */
+void ev_queue_msg(struct ev_conn *conn, int type, int flags, uint32_t seq, const char *data, size_t len) {
+    char *out = ev_reserve_output(conn, COM_HDR_SIZE + len);
+    com_encode_hdr(out, type, flags, seq, len);
+    memcpy(out + COM_HDR_SIZE, data, len);
+    conn->outLen += COM_HDR_SIZE + len;
+}
+/**
+ * @brief Release a connection: stop watching its descriptors, close them
+ * and give the client slot back. The struct itself is freed after the
+ * current batch of events, which may still refer to it.
+ *
+ * @param conn
+ */
+void ev_close_conn(struct ev_conn *conn) {
+    if (conn->out.fd != -1) {
+        if (!conn->outPaused) {
+            ev_watch(&conn->out, EPOLL_CTL_DEL, 0);
+        }
+        close(conn->out.fd);
+    }
+    if (conn->cmdPid > 0) {
+        kill(conn->cmdPid, SIGTERM);
+    }
+    ev_exit_disown(conn);
+    if (conn->queued != NULL) {
+        struct ev_conn **link = &queuedConns;
+        while (*link != conn) {
+            link = &(*link)->nextQueued;
+        }
+        *link = conn->nextQueued;
+        com_pool_put(&evPool, conn->queued);
+        conn->queued = NULL;
+    }
+    if (sched_enabled()) {
+        sched_leave(conn->schedClient);
+    }
+    ev_watch(&conn->cs, EPOLL_CTL_DEL, 0);
+    if (conn->scWatched) {
+        ev_watch(&conn->sc, EPOLL_CTL_DEL, 0);
+    }
+    close(conn->cs.fd);
+    close(conn->sc.fd);
+    CAPTURE_SESSION_CLOSE(conn->clientPid);
+    printf("Server-client count: %d\n", stats_client_disconnected());
+    fflush(stdout);
+    conn->dead = 1;
+    conn->nextDead = deadConns;
+    deadConns = conn;
+}
+/**
+ * @brief Watch the command's output only while the client has credit and
+ * the pending output is below the high water mark. The pipe is removed
+ * from epoll while paused, since a hangup would be reported regardless
+ * of the requested events.
+ *
+ * @param conn
+ */
+void ev_update_out(struct ev_conn *conn) {
+    if (conn->out.fd == -1) {
+        return;
+    }
+    int wanted = conn->credits > 0 && conn->outLen < EV_OUT_HIGH_WATER;
+    if (wanted && conn->outPaused) {
+        ev_watch(&conn->out, EPOLL_CTL_ADD, EPOLLIN);
+        conn->outPaused = 0;
+    } else if (!wanted && !conn->outPaused) {
+        ev_watch(&conn->out, EPOLL_CTL_DEL, 0);
+        conn->outPaused = 1;
+    }
+}
+/**
+ * @brief Write as much pending output as the SC FIFO takes without
+ * blocking, and only ask for EPOLLOUT while something is left over.
+ *
+ * @param conn
+ * @return int -1 if the connection was closed
+ */
+int ev_flush(struct ev_conn *conn) {
+    uint64_t traceStart = TRACE_START();
+    size_t sent = 0;
+    while (sent < conn->outLen) {
+        ssize_t n = write(conn->sc.fd, conn->outBuf + sent, conn->outLen - sent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                break;
+            }
+            perror("Error when writing to client");
+            ev_close_conn(conn);
+            return -1;
+        }
+        sent += n;
+    }
+    if (sent > 0) {
+        TRACE(TRACE_WRITE, conn->clientPid, conn->cmdSeq, traceStart, sent);
+    }
+    memmove(conn->outBuf, conn->outBuf + sent, conn->outLen - sent);
+    conn->outLen -= sent;
+    if (conn->outLen > 0 && !conn->scWatched) {
+        ev_watch(&conn->sc, EPOLL_CTL_ADD, EPOLLOUT);
+        conn->scWatched = 1;
+    } else if (conn->outLen == 0 && conn->scWatched) {
+        ev_watch(&conn->sc, EPOLL_CTL_DEL, 0);
+        conn->scWatched = 0;
+    }
+    ev_update_out(conn);
+    if (conn->closing && conn->outLen == 0) {
+        ev_close_conn(conn);
+        return -1;
+    }
+    return 0;
+}
+/**
+ * @brief Start the command with its stdout on a non-blocking pipe that the
+ * event loop reads from.
+ *
+ * @param conn
+ * @param cmd
+ */
+void ev_start_command(struct ev_conn *conn, const char *cmd) {
+    int outPipe[2];
+    pid_t pid = -1;
+    if (pipe2(outPipe, O_CLOEXEC) == -1) {
+        perror("Error when creating output pipe");
+    } else {
+        uint64_t spawnStart = now_ns();
+        pid = spawn_command(cmd, outPipe[1]);
+        close(outPipe[1]);
+        if (pid < 0) {
+            perror("spawn error");
+            close(outPipe[0]);
+        } else {
+            stats_spawn(now_ns() - spawnStart);
+            TRACE(TRACE_SPAWN, conn->clientPid, conn->cmdSeq, spawnStart, 0);
+        }
+    }
+    if (pid < 0) {
+        if (sched_enabled()) {
+            sched_release(conn->schedClient);
+        }
+        ev_queue_msg(conn, COMMAND_RES, COM_F_LAST, conn->cmdSeq, NULL, 0);
+        return;
+    }
+    fcntl(outPipe[0], F_SETFL, O_NONBLOCK);
+    conn->cmdPid = pid;
+    if (sched_enabled() || conn->cacheRule >= 0) {
+        ev_exit_watch(conn);
+    }
+    conn->out.fd = outPipe[0];
+    conn->outPaused = 1;
+    ev_update_out(conn);
+}
+/**
+ * @brief Make room for len more bytes of a result held in memory.
+ *
+ * @param conn
+ * @param len
+ * @return char* where the bytes go; replayLen is not advanced
+ */
+char* ev_reserve_replay(struct ev_conn *conn, size_t len) {
+    if (conn->replayLen + len > conn->replayCap) {
+        size_t cap = conn->replayCap ? conn->replayCap : BUFFER_SIZE;
+        while (cap < conn->replayLen + len) {
+            cap *= 2;
+        }
+        conn->replayBuf = realloc(conn->replayBuf, cap);
+        conn->replayCap = cap;
+    }
+    return conn->replayBuf + conn->replayLen;
+}
+/**
+ * @brief Builtin output sink: collect the output for ev_pump_replay. A
+ * builtin runs inside the loop, so its output is only taken up to
+ * CACHE_MAX_RESULT bytes; beyond that the command is spawned instead.
+ *
+ * @param ctx the connection
+ * @param data
+ * @param len
+ * @return int -1 once the output would be over CACHE_MAX_RESULT bytes
+ */
+int ev_replay_write(void *ctx, const char *data, size_t len) {
+    struct ev_conn *conn = ctx;
+    if (conn->replayLen + len > CACHE_MAX_RESULT) {
+        return -1;
+    }
+    memcpy(ev_reserve_replay(conn, len), data, len);
+    conn->replayLen += len;
+    return 0;
+}
+/**
+ * @brief Queue frames of a result held in memory, a cache hit or builtin
+ * output, while the client has credit and the pending output is below the
+ * high water mark.
+ *
+ * @param conn
+ * @return int 1 once the whole result, with its COM_F_LAST frame, is queued
+ */
+int ev_pump_replay(struct ev_conn *conn) {
+    while (conn->replayOff < conn->replayLen && conn->credits > 0 && conn->outLen < EV_OUT_HIGH_WATER) {
+        size_t n = conn->replayLen - conn->replayOff;
+        if (n > (size_t)conn->wSize) {
+            n = conn->wSize;
+        }
+        char *frame = ev_reserve_output(conn, COM_HDR_SIZE + n);
+        memcpy(frame + COM_HDR_SIZE, conn->replayBuf + conn->replayOff, n);
+        conn->replayOff += n;
+        int flags = conn->lzBuf != NULL && com_lz_pack(frame + COM_HDR_SIZE, &n, conn->lzBuf) ? COM_F_LZ : 0;
+        com_encode_hdr(frame, COMMAND_RES, flags, conn->cmdSeq, n);
+        conn->outLen += COM_HDR_SIZE + n;
+        conn->credits--;
+    }
+    if (conn->replayOff < conn->replayLen) {
+        return 0;
+    }
+    ev_queue_msg(conn, COMMAND_RES, COM_F_LAST, conn->cmdSeq, NULL, 0);
+    conn->replaying = 0;
+    stats_command_done(now_ns() - conn->cmdStart, conn->replayLen);
+    TRACE(TRACE_REQUEST, conn->clientPid, conn->cmdSeq, conn->cmdStart, conn->replayLen);
+    CAPTURE_RESULT_OUT(conn->clientPid, conn->cmdSeq, conn->replayLen, 0);
+    return 1;
+}
+/**
+ * @brief Take complete messages off the connection's input buffer. Only
+ * one command runs per connection, so parsing stops while one is active.
+ *
+ * @param conn
+ * @return int -1 if the connection was closed
+ */
+int ev_process_input(struct ev_conn *conn) {
+    struct com_hdr hdr;
+    const char *payload;
+    while (conn->cmdPid == 0 && !conn->replaying && !conn->closing && conn->queued == NULL) {
+        int r = com_parser_next(&conn->in, &hdr, &payload);
+        if (r == 0) {
+            break;
+        }
+        if (r < 0) {
+            fprintf(stderr, "server: malformed message from client\n");
+            conn->closing = 1;
+            break;
+        }
+        if (hdr.type == QUIT_REQ || hdr.type == QUIT_ALL_REQ) {
+            printf("server child: QUIT_REQ message received: len = %u, type = %d \n", hdr.len, hdr.type);
+            fflush(stdout);
+            ev_queue_msg(conn, QUIT_REP, 0, hdr.seq, "quit-ack", strlen("quit-ack") + 1);
+            conn->closing = 1;
+            break;
+        }
+        if (hdr.type == STATS_REQ) {
+            char text[BUFFER_SIZE];
+            size_t len = stats_format(text, sizeof(text));
+            ev_queue_msg(conn, STATS_REP, 0, hdr.seq, text, len + 1);
+            continue;
+        }
+        if (hdr.type == CREDIT && hdr.len == sizeof(uint32_t)) {
+            uint32_t granted;
+            memcpy(&granted, payload, sizeof(granted));
+            conn->credits += granted;
+            continue;
+        }
+        if (hdr.type != SEND_COMMAND || hdr.len == 0 || payload[hdr.len - 1] != '\0') {
+            fprintf(stderr, "server: unexpected message type %d\n", hdr.type);
+            continue;
+        }
+        printf("server child: COMLINE message received: len = %u, type = %d, data = %s \n", hdr.len, hdr.type, payload);
+        fflush(stdout);
+        conn->cmdSeq = hdr.seq;
+        conn->cmdStart = now_ns();
+        CAPTURE_COMMAND_IN(conn->clientPid, conn->cmdSeq, conn->cmdStart, payload);
+        conn->cmdBytes = 0;
+        conn->replayLen = 0;
+        conn->replayOff = 0;
+        struct builtin_sink sink = { ev_replay_write, conn };
+        int builtin = builtin_run(payload, &sink);
+        if (builtin == 0) {
+            conn->replaying = 1;
+            ev_pump_replay(conn);
+            continue;
+        }
+        // a builtin has no side effects, so one with too much output for
+        // the loop is simply run again as a process
+        conn->replayLen = 0;
+        conn->cacheRule = cache_rule_for(payload);
+        if (conn->cacheRule >= 0) {
+            if (conn->cacheBuf == NULL) {
+                conn->cacheBuf = com_pool_get(&evPool);
+            }
+            ssize_t cached = cache_get(conn->cacheRule, ev_reserve_replay(conn, CACHE_MAX_RESULT));
+            if (cached >= 0) {
+                printf("server child: result served from cache \n");
+                fflush(stdout);
+                conn->replayLen = cached;
+                conn->replaying = 1;
+                ev_pump_replay(conn);
+                continue;
+            }
+            cache_begin(conn->cacheRule, &conn->cacheStamp);
+        }
+        // a command waiting for a slot is held in a pool buffer
+        if (sched_enabled() && strlen(payload) >= evPool.size) {
+            ev_queue_msg(conn, COMMAND_RES, COM_F_LAST | COM_F_ERROR, conn->cmdSeq, TOO_LONG_TEXT, strlen(TOO_LONG_TEXT));
+            CAPTURE_RESULT_OUT(conn->clientPid, conn->cmdSeq, 0, COM_F_ERROR);
+            continue;
+        }
+        int slot = sched_enabled() ? sched_acquire(conn->schedClient, &conn->queuedTicket) : SCHED_GRANTED;
+        if (slot == SCHED_BUSY) {
+            stats_command_busy();
+            ev_queue_msg(conn, COMMAND_RES, COM_F_LAST | COM_F_BUSY, conn->cmdSeq, BUSY_TEXT, strlen(BUSY_TEXT));
+            CAPTURE_RESULT_OUT(conn->clientPid, conn->cmdSeq, 0, COM_F_BUSY);
+        } else if (slot == SCHED_QUEUED) {
+            stats_command_queued();
+            conn->queued = strcpy(com_pool_get(&evPool), payload);
+            conn->nextQueued = queuedConns;
+            queuedConns = conn;
+        } else {
+            ev_start_command(conn, payload);
+        }
+    }
+    return ev_flush(conn);
+}
+/**
+ * @brief Take a connection struct: a spare one, which keeps the buffers
+ * it had, if there is one.
+ *
+ * @return struct ev_conn*
+ */
+struct ev_conn* ev_new_conn() {
+    struct ev_conn *conn = spareConns;
+    if (conn == NULL) {
+        conn = calloc(1, sizeof(struct ev_conn));
+        com_parser_init(&conn->in, BUFFER_SIZE);
+        return conn;
+    }
+    spareConns = conn->nextDead;
+    spareCount--;
+    struct ev_conn fresh = {
+        .in = conn->in,
+        .outBuf = conn->outBuf,
+        .outCap = conn->outCap,
+        .replayBuf = conn->replayBuf,
+        .replayCap = conn->replayCap,
+    };
+    com_parser_reset(&fresh.in);
+    *conn = fresh;
+    return conn;
+}
+/**
+ * @brief Give back a connection that is closed and no longer referred
+ * to, keeping it as a spare unless there are enough of those.
+ *
+ * @param conn
+ */
+void ev_free_conn(struct ev_conn *conn) {
+    com_pool_put(&evPool, conn->cacheBuf);
+    com_pool_put(&evPool, conn->lzBuf);
+    conn->cacheBuf = NULL;
+    conn->lzBuf = NULL;
+    if (spareCount < EV_SPARE_CONNS) {
+        conn->nextDead = spareConns;
+        spareConns = conn;
+        spareCount++;
+        return;
+    }
+    com_parser_free(&conn->in);
+    free(conn->outBuf);
+    free(conn->replayBuf);
+    free(conn);
+}
+/**
+ * @brief Set up a connection for a CONNECTION_REQ and queue the reply.
+ *
+ * @param request
+ */
+void ev_accept(struct conn_request *request) {
+    if (rings_only(request)) {
+        refuse_rings(request);
+        return;
+    }
+    struct ev_conn *conn = ev_new_conn();
+    if (request->sockFd != -1) {
+        // both directions on one socket: a second descriptor for it lets
+        // epoll watch them separately
+        fcntl(request->sockFd, F_SETFL, O_NONBLOCK);
+        conn->cs = (struct ev_handle){ EV_CS, request->sockFd, conn };
+        conn->sc = (struct ev_handle){ EV_SC, fcntl(request->sockFd, F_DUPFD_CLOEXEC, 0), conn };
+    } else {
+        conn->cs = (struct ev_handle){ EV_CS, open(request->csPipeName, O_RDWR | O_NONBLOCK | O_CLOEXEC), conn };
+        conn->sc = (struct ev_handle){ EV_SC, open(request->scPipeName, O_RDWR | O_NONBLOCK | O_CLOEXEC), conn };
+    }
+    conn->out = (struct ev_handle){ EV_OUT, -1, conn };
+    conn->wSize = request->wSize;
+    conn->credits = request->credits;
+    conn->clientPid = request->pid;
+    conn->schedClient = -1;
+    request->concurrency = 1;
+    uint64_t traceStart = TRACE_START();
+    if (request->features & COM_F_LZ) {
+        conn->lzBuf = com_pool_get(&evPool);
+    }
+    if (conn->cs.fd == -1 || conn->sc.fd == -1) {
+        perror("Error when opening pipes");
+        if (conn->cs.fd != -1) {
+            close(conn->cs.fd);
+        }
+        if (conn->sc.fd != -1) {
+            close(conn->sc.fd);
+        }
+        ev_free_conn(conn);
+        return;
+    }
+    printf("Server-client count: %d\n", stats_client_connected());
+    printf("server main: CONREQUEST message recieved pid = %d, cs= %s, sc= %s, wsize= %d \n",
+           (int)request->pid, request->csPipeName, request->scPipeName, request->wSize);
+    fflush(stdout);
+    if (sched_enabled()) {
+        conn->schedClient = sched_join(request->weight);
+    }
+    ev_watch(&conn->cs, EPOLL_CTL_ADD, EPOLLIN);
+    char reply[BUFFER_SIZE];
+    size_t len = build_connection_reply(reply, request);
+    ev_queue_msg(conn, CONNECTION_REP, conn->lzBuf != NULL ? COM_F_LZ : 0, 0, reply, len);
+    ev_flush(conn);
+    TRACE(TRACE_OPEN, conn->clientPid, 0, traceStart, 0);
+    CAPTURE_SESSION_OPEN(conn->clientPid, conn->lzBuf != NULL ? COM_F_LZ : 0, conn->wSize, 1);
+}
+/**
+ * @brief Handle readiness on one of a connection's descriptors.
+ *
+ * @param handle
+ * @param events
+ */
+void ev_handle_conn(struct ev_handle *handle, unsigned int events) {
+    struct ev_conn *conn = handle->conn;
+    if (conn->dead) {
+        return;
+    }
+    if (handle->kind == EV_CS) {
+        ssize_t n = com_parser_fill(&conn->in, conn->cs.fd);
+        if (n > 0) {
+            conn->credits += com_parser_take_credits(&conn->in);
+            ev_update_out(conn);
+            if (conn->replaying) {
+                ev_pump_replay(conn);
+            }
+            ev_process_input(conn);
+        } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            ev_close_conn(conn);
+        }
+    } else if (handle->kind == EV_SC) {
+        if (ev_flush(conn) == 0 && conn->replaying) {
+            ev_pump_replay(conn);
+            ev_process_input(conn);
+        }
+    } else if (handle->kind == EV_OUT) {
+        char *frame = ev_reserve_output(conn, COM_HDR_SIZE + conn->wSize);
+        uint64_t traceStart = TRACE_START();
+        ssize_t n = read(conn->out.fd, frame + COM_HDR_SIZE, conn->wSize);
+        if (n > 0) {
+            TRACE(TRACE_READ, conn->clientPid, conn->cmdSeq, traceStart, n);
+            if (conn->cacheRule >= 0 && conn->cmdBytes + n <= CACHE_MAX_RESULT) {
+                memcpy(conn->cacheBuf + conn->cmdBytes, frame + COM_HDR_SIZE, n);
+            }
+            conn->cmdBytes += n;
+            size_t len = n;
+            int flags = conn->lzBuf != NULL && com_lz_pack(frame + COM_HDR_SIZE, &len, conn->lzBuf) ? COM_F_LZ : 0;
+            com_encode_hdr(frame, COMMAND_RES, flags, conn->cmdSeq, len);
+            conn->outLen += COM_HDR_SIZE + len;
+            conn->credits--;
+            ev_update_out(conn);
+            ev_flush(conn);
+        } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            ev_watch(&conn->out, EPOLL_CTL_DEL, 0);
+            close(conn->out.fd);
+            conn->out.fd = -1;
+            // stored by reap_children if the command succeeds, which also
+            // gives back its slot
+            if (conn->cacheRule >= 0) {
+                ev_cache_output(conn);
+            }
+            conn->cmdPid = 0;
+            ev_queue_msg(conn, COMMAND_RES, COM_F_LAST, conn->cmdSeq, NULL, 0);
+            stats_command_done(now_ns() - conn->cmdStart, conn->cmdBytes);
+            TRACE(TRACE_REQUEST, conn->clientPid, conn->cmdSeq, conn->cmdStart, conn->cmdBytes);
+            CAPTURE_RESULT_OUT(conn->clientPid, conn->cmdSeq, conn->cmdBytes, 0);
+            printf("command execution finished \n");
+            fflush(stdout);
+            ev_process_input(conn);
+        }
+    }
+}
+/**
+ * @brief Run the server as a single-process epoll event loop, taking
+ * connections from the watched queues.
+ */
+void run_event_loop() {
+    com_pool_init(&evPool, POOL_BUFFER_SIZE);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    struct ev_handle mqHandles[COM_QUEUE_MAX_SHARDS + 1];
+    for (int i = 0; i < watchedCount; i++) {
+        mqHandles[i] = (struct ev_handle){ EV_MQ, (int)queues[watched[i]].mq, NULL };
+        ev_watch(&mqHandles[i], EPOLL_CTL_ADD, EPOLLIN);
+    }
+    struct ev_handle listenHandle = { EV_LISTEN, listenFd, NULL };
+    if (listenFd != -1) {
+        ev_watch(&listenHandle, EPOLL_CTL_ADD, EPOLLIN);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    struct epoll_event events[EV_MAX_EVENTS];
+    while (1) {
+        // a slot is granted through shared memory, which epoll cannot see
+        int n = epoll_wait(epollFd, events, EV_MAX_EVENTS, queuedConns != NULL ? SCHED_POLL_MS : 1000);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            struct ev_handle *handle = events[i].data.ptr;
+            if (handle->kind == EV_LISTEN) {
+                struct conn_request request;
+                while (socket_receive(&request)) {
+                    ev_accept(&request);
+                }
+                continue;
+            }
+            if (handle->kind != EV_MQ) {
+                ev_handle_conn(handle, events[i].events);
+                continue;
+            }
+            struct accept_queue *queue = &queues[watched[handle - mqHandles]];
+            struct conn_request request;
+            queue_check_overload(queue);
+            while (queue_receive(queue, &request)) {
+                ev_accept(&request);
+            }
+        }
+        struct ev_conn **link = &queuedConns;
+        while (*link != NULL) {
+            struct ev_conn *conn = *link;
+            if (!sched_granted(conn->schedClient, conn->queuedTicket)) {
+                link = &conn->nextQueued;
+                continue;
+            }
+            *link = conn->nextQueued;
+            TRACE(TRACE_SLOT, conn->clientPid, conn->cmdSeq, conn->cmdStart, 0);
+            ev_start_command(conn, conn->queued);
+            com_pool_put(&evPool, conn->queued);
+            conn->queued = NULL;
+            ev_flush(conn);
+        }
+        while (deadConns != NULL) {
+            struct ev_conn *conn = deadConns;
+            deadConns = conn->nextDead;
+            ev_free_conn(conn);
+        }
+        reap_children();
+        trace_tick();
+        capture_tick();
+    }
+}
+/**
+ * @brief Fork acceptor index. It serves its queues in the same mode as the
+ * main process, which is acceptor 0, and exits with it.
+ *
+ * @param index
+ */
+void acceptor_start(int index) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork error");
+        return;
+    }
+    if (pid > 0) {
+        acceptorPids[index] = pid;
+        return;
+    }
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent) {
+        exit(EXIT_SUCCESS);
+    }
+    trace_forked();
+    capture_forked();
+    queues_select(index);
+    // only the main process restarts acceptors
+    acceptorCount = 1;
+    memset(acceptorPids, 0, sizeof(acceptorPids));
+    if (eventLoop) {
+        if (epollFd != -1) {
+            close(epollFd);
+            epollFd = -1;
+        }
+        run_event_loop();
+    }
+    run_acceptor();
+    exit(EXIT_SUCCESS);
+}
+/**
+ * @brief 
+ * 
+ * @param argc 
+ * @param argv 
+ * @return int 
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage of the server: %s <MQNAME> [-e] [-m MINWORKERS] [-M MAXWORKERS] [-c CACHEFILE]"
+                " [-a ACCEPTORS] [-q SHARDS] [-d DEPTH] [-x SLOTS] [-X BACKLOG] [-t TRACEFILE] [-C CAPTUREFILE]"
+                " [-u SOCKPATH] [-r]\n", argv[0]);
+                fflush(stdout);
+
+        exit(EXIT_FAILURE);
+    }
+    char *mqName = argv[1];
+    int minWorkers = 0;
+    int maxWorkers = 0;
+    char *cacheFile = NULL;
+    int shards = 0;
+    long depth = COM_QUEUE_DEFAULT_DEPTH;
+    int slots = 0;
+    int backlog = SCHED_DEFAULT_BACKLOG;
+    char *traceFile = NULL;
+    char *captureFile = NULL;
+    char *sockPath = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "em:M:c:a:q:d:x:X:t:C:u:r")) != -1) {
+        switch (opt) {
+            case 'e':
+                eventLoop = 1;
+                break;
+            case 'm':
+                minWorkers = atoi(optarg);
+                break;
+            case 'M':
+                maxWorkers = atoi(optarg);
+                break;
+            case 'c':
+                cacheFile = optarg;
+                break;
+            case 'a':
+                acceptorCount = atoi(optarg);
+                break;
+            case 'q':
+                shards = atoi(optarg);
+                break;
+            case 'd':
+                depth = atol(optarg);
+                break;
+            case 'x':
+                slots = atoi(optarg);
+                break;
+            case 'X':
+                backlog = atoi(optarg);
+                break;
+            case 't':
+                traceFile = optarg;
+                break;
+            case 'C':
+                captureFile = optarg;
+                break;
+            case 'u':
+                sockPath = optarg;
+                break;
+            case 'r':
+                ringsTransport = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage of the server: %s <MQNAME> [-e] [-m MINWORKERS] [-M MAXWORKERS] [-c CACHEFILE]"
+                        " [-a ACCEPTORS] [-q SHARDS] [-d DEPTH] [-x SLOTS] [-X BACKLOG] [-t TRACEFILE] [-C CAPTUREFILE]"
+                " [-u SOCKPATH] [-r]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (maxWorkers > 0 && minWorkers == 0) {
+        minWorkers = 1;
+    }
+    if (minWorkers > 0 && maxWorkers < minWorkers) {
+        maxWorkers = minWorkers;
+    }
+    if (minWorkers < 0 || maxWorkers > POOL_MAX_WORKERS) {
+        fprintf(stderr, "Worker pool size must be between 1 and %d\n", POOL_MAX_WORKERS);
+        exit(EXIT_FAILURE);
+    }
+    if (eventLoop && minWorkers > 0) {
+        fprintf(stderr, "The event loop mode does not use a worker pool\n");
+        exit(EXIT_FAILURE);
+    }
+    if (eventLoop && ringsTransport) {
+        fprintf(stderr, "The event loop mode cannot serve clients over shared memory rings\n");
+        exit(EXIT_FAILURE);
+    }
+    if (acceptorCount < 1 || acceptorCount > MAX_ACCEPTORS) {
+        fprintf(stderr, "ACCEPTORS must be between 1 and %d\n", MAX_ACCEPTORS);
+        exit(EXIT_FAILURE);
+    }
+    if (slots < 0 || backlog < 0) {
+        fprintf(stderr, "SLOTS and BACKLOG must not be negative\n");
+        exit(EXIT_FAILURE);
+    }
+    if (shards < 0 || shards > COM_QUEUE_MAX_SHARDS || depth < 1) {
+        fprintf(stderr, "SHARDS must be between 0 and %d and DEPTH positive\n", COM_QUEUE_MAX_SHARDS);
+        exit(EXIT_FAILURE);
+    }
+    queues_open(mqName, shards, depth);
+    // also clears an advertisement left by an earlier server on MQNAME
+    if (com_rings_advertise(mqName, ringsTransport ? getpid() : 0) == -1) {
+        perror("Error when advertising shared memory rings");
+        exit(EXIT_FAILURE);
+    }
+    if (sockPath != NULL) {
+        listen_open(sockPath);
+    }
+    printf("Server is running and waiting for connections on message queue '%s'\n", mqName);
+    if (sockPath != NULL) {
+        printf("and on Unix socket '%s'\n", sockPath);
+    }
+    if (ringsTransport) {
+        printf("Serving clients over shared memory rings\n");
+    }
+    if (shards > 0) {
+        printf("Queue shards '%s.0' to '%s.%d'\n", mqName, mqName, shards - 1);
+    }
+    if (acceptorCount > 1) {
+        printf("%d acceptor processes\n", acceptorCount);
+    }
+    fflush(stdout);
+    stats_init();
+    if (slots > 0) {
+        sched_init(slots, backlog);
+        printf("%d execution slots, up to %d commands waiting\n", slots, backlog);
+        fflush(stdout);
+    }
+    if (traceFile != NULL) {
+        trace_init(traceFile);
+        printf("Tracing request stages to '%s'\n", traceFile);
+        fflush(stdout);
+    }
+    if (captureFile != NULL) {
+        capture_init(captureFile);
+        printf("Capturing client sessions to '%s'\n", captureFile);
+        fflush(stdout);
+    }
+    if (cacheFile != NULL && cache_load(cacheFile) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    if (minWorkers > 0) {
+        pool_start(minWorkers, maxWorkers);
+    }
+    for (int i = 1; i < acceptorCount; i++) {
+        acceptor_start(i);
+    }
+    queues_select(0);
+    if (eventLoop) {
+        run_event_loop();
+    }
+    run_acceptor();
+        // printf("%s \n", "done");
+        // fflush(stdout);
+    for (int i = 0; i < queueCount; i++) {
+        mq_close(queues[i].mq);
+        mq_unlink(queues[i].name);
+    }
+    if (ringsTransport) {
+        com_rings_advertise(mqName, 0);
+    }
+    if (sockPath != NULL) {
+        unlink(sockPath);
+    }
+
+    return 0;
+}
 /**
- * @brief 
- * 
- * @param input 
+ * @brief Block until the client has granted credit for another frame.
+ * Commands the client pipelined meanwhile stay queued in the parser.
+ *
+ * @param session
+ * @return int -1 if the client went away
  */
-char* extract_number(const char* input) {
-    char* output = (char *)malloc(strlen(input) * sizeof(char));
-    char* outputStart = output;
-
-    while (*input) {
-        if (isdigit(*input)) {
-            *output = *input;
-            ++output;
+int wait_for_credit(struct client_session *session) {
+    uint64_t traceStart = TRACE_START();
+    while (1) {
+        session->credits += com_parser_take_credits(&session->in);
+        if (session->credits > 0) {
+            TRACE(TRACE_CREDIT, session->clientPid, 0, traceStart, 0);
+            return 0;
+        }
+        if (com_link_fill(&session->link, &session->in) <= 0) {
+            return -1;
         }
-        ++input;
     }
-    *output = '\0';
-    return outputStart;
 }
+// cleared when the kernel cannot splice between these pipes
+int spliceWorks = 1;
 /**
- * @brief 
- * 
- * @param csPipeName 
- * @param scPipeName 
- * @param wSize 
+ * @brief Move output waiting in a command's pipe to the client FIFO with
+ * splice(), so it never passes through the server's memory. Only the
+ * frame header is written from user space. The frame length has to be
+ * known before the data, so it is the amount FIONREAD reports waiting,
+ * up to wSize; splicing exactly that much always completes.
+ *
+ * Not used on the shared memory rings, or when the server must look at
+ * the output: compressing it, or keeping it for the cache. Small frames
+ * are copied too, as the extra system calls cost more than the copy.
+ *
+ * @param session
+ * @param cmd
+ * @return int 1 if a frame was sent, 0 if it was not spliced and should
+ * be copied, -1 if the client went away
+ */
+int splice_output(struct client_session *session, struct running_cmd *cmd) {
+    struct com_link *link = &session->link;
+    int waiting;
+    if (!spliceWorks || link->chan != NULL || session->lzBuf != NULL || cmd->cacheRule >= 0
+        || ioctl(cmd->outFd, FIONREAD, &waiting) == -1 || waiting < SPLICE_MIN_BYTES) {
+        return 0;
+    }
+    uint64_t traceStart = TRACE_START();
+    size_t len = waiting < session->wSize ? waiting : session->wSize;
+    char header[COM_HDR_SIZE];
+    com_encode_hdr(header, COMMAND_RES, 0, cmd->seq, len);
+    if (write(link->wfd, header, COM_HDR_SIZE) != COM_HDR_SIZE) {
+        return -1;
+    }
+    cmd->bytes += len;
+    session->credits--;
+    uint64_t traceBytes = len;
+    while (len > 0) {
+        ssize_t moved = splice(cmd->outFd, NULL, link->wfd, NULL, len, SPLICE_F_MOVE);
+        if (moved > 0) {
+            len -= moved;
+            continue;
+        }
+        if (moved == -1 && errno == EINTR) {
+            continue;
+        }
+        if (moved == -1 && errno == EPIPE) {
+            return -1;
+        }
+        // the header is out, so the rest of the frame goes by copy
+        spliceWorks = 0;
+        while (len > 0) {
+            ssize_t n = read(cmd->outFd, session->frame, len);
+            if (n <= 0 || write(link->wfd, session->frame, n) != n) {
+                return -1;
+            }
+            len -= n;
+        }
+    }
+    TRACE(TRACE_WRITE, session->clientPid, cmd->seq, traceStart, traceBytes);
+    return 1;
+}
+/**
+ * @brief Hand the rest of a large output to a client on the Unix socket.
+ * The read end of the command's pipe goes over with SCM_RIGHTS and the
+ * client reads the output itself, so it no longer passes through the
+ * server. The server keeps a pidfd for the command in its place, which
+ * becomes readable once the command has exited and the COM_F_LAST frame
+ * is due. Output that is cached has to be seen by the server and is not
+ * handed over.
+ *
+ * @param session
+ * @param cmd
+ * @return int 1 if the pipe was handed over, 0 if the output should be
+ * forwarded as usual, -1 if the client went away
  */
-void handle_client_request(char *csPipeName, char *scPipeName, int wSize);
+int pass_output(struct client_session *session, struct running_cmd *cmd) {
+    int waiting;
+    if (!session->passFds || cmd->cacheRule >= 0
+        || ioctl(cmd->outFd, FIONREAD, &waiting) == -1 || waiting < PASS_MIN_BYTES) {
+        return 0;
+    }
+    int pidFd = syscall(SYS_pidfd_open, cmd->pid, 0);
+    if (pidFd == -1) {
+        // too old a kernel to tell when the command ends
+        session->passFds = 0;
+        return 0;
+    }
+    if (com_link_send_fd(&session->link, COMMAND_RES, COM_F_FD, cmd->seq, cmd->outFd) == -1) {
+        close(pidFd);
+        return -1;
+    }
+    session->credits--;
+    close(cmd->outFd);
+    cmd->outFd = pidFd;
+    cmd->passed = 1;
+    return 1;
+}
 /**
- * @brief 
- * 
- * @param value 
+ * @brief Forward the next piece of output of a command run by the
+ * session's shell, up to the marker that ends it.
+ *
+ * @param session
+ * @param cmd
+ * @return int 1 while the command runs, 0 once it has finished, -1 if
+ * the client went away
  */
-void save_value_to_file(int value) {
-    FILE *file = fopen(".client_num_storage.txt", "w");
-    if (file != NULL) {
-        fprintf(file, "%d", value);
-        fclose(file);
-    } else {
-        perror("Could not open file");
+int forward_shell_output(struct client_session *session, struct running_cmd *cmd) {
+    struct com_link *link = &session->link;
+    char *frame = session->frame;
+    if (link->chan != NULL && (frame = com_chan_reserve(link->chan, COM_HDR_SIZE + session->wSize)) == NULL) {
+        return -1;
+    }
+    uint64_t traceStart = TRACE_START();
+    size_t len = shell_read(session->shell, frame + COM_HDR_SIZE, session->wSize, &cmd->status);
+    if (len == 0) {
+        return cmd->status >= 0 ? 0 : 1;
+    }
+    TRACE(TRACE_READ, session->clientPid, cmd->seq, traceStart, len);
+    cmd->bytes += len;
+    int flags = session->lzBuf != NULL && com_lz_pack(frame + COM_HDR_SIZE, &len, session->lzBuf) ? COM_F_LZ : 0;
+    com_encode_hdr(frame, COMMAND_RES, flags, cmd->seq, len);
+    session->credits--;
+    if (link->chan != NULL) {
+        com_chan_commit(link->chan, COM_HDR_SIZE + len);
+    } else if (write(link->wfd, frame, COM_HDR_SIZE + len) == -1) {
+        return -1;
     }
+    return cmd->status >= 0 ? 0 : 1;
 }
 /**
- * @brief 
- * 
- * @return int 
+ * @brief Forward the next piece of a running command's output to the
+ * client. One read() on the output pipe, up to wSize bytes, becomes one
+ * COMMAND_RES frame, so the client sees output as soon as the command
+ * writes it. Output is read straight into the frame after its header,
+ * which on the shared memory rings is the ring itself, and compressed in
+ * place if the client takes compressed frames. Larger pieces going to
+ * the FIFO are spliced instead, and large output for a client on the Unix
+ * socket is handed over whole. The caller makes sure there is credit for
+ * the frame.
+ *
+ * @param session
+ * @param cmd
+ * @return int 1 if a frame was sent, 0 at the end of the output, -1 if
+ * the client went away
  */
-int read_value_from_file() {
-    int value = 0;
-    FILE *file = fopen(".client_num_storage.txt", "r");
-    if (file != NULL) {
-        fscanf(file, "%d", &value);
-        fclose(file);
-    } else {
-        perror("Could not open file");
+int forward_output(struct client_session *session, struct running_cmd *cmd) {
+    struct com_link *link = &session->link;
+    if (session->shell != NULL) {
+        return forward_shell_output(session, cmd);
     }
-    return value;
+    if (cmd->passed) {
+        // the pidfd is readable, the command has exited
+        return 0;
+    }
+    int passed = pass_output(session, cmd);
+    if (passed != 0) {
+        return passed;
+    }
+    int spliced = splice_output(session, cmd);
+    if (spliced != 0) {
+        return spliced;
+    }
+    char *frame = session->frame;
+    if (link->chan != NULL && (frame = com_chan_reserve(link->chan, COM_HDR_SIZE + session->wSize)) == NULL) {
+        return -1;
+    }
+    uint64_t traceStart = TRACE_START();
+    ssize_t bytesRead;
+    do {
+        bytesRead = read(cmd->outFd, frame + COM_HDR_SIZE, session->wSize);
+    } while (bytesRead < 0 && errno == EINTR);
+    if (bytesRead < 0) {
+        perror("Error when reading command output");
+    }
+    if (bytesRead <= 0) {
+        return 0;
+    }
+    TRACE(TRACE_READ, session->clientPid, cmd->seq, traceStart, bytesRead);
+    if (cmd->cacheRule >= 0 && cmd->bytes + bytesRead <= CACHE_MAX_RESULT) {
+        memcpy(cmd->keep + cmd->bytes, frame + COM_HDR_SIZE, bytesRead);
+    }
+    cmd->bytes += bytesRead;
+    size_t len = bytesRead;
+    int flags = session->lzBuf != NULL && com_lz_pack(frame + COM_HDR_SIZE, &len, session->lzBuf) ? COM_F_LZ : 0;
+    com_encode_hdr(frame, COMMAND_RES, flags, cmd->seq, len);
+    session->credits--;
+    traceStart = TRACE_START();
+    if (link->chan != NULL) {
+        com_chan_commit(link->chan, COM_HDR_SIZE + len);
+    } else if (write(link->wfd, frame, COM_HDR_SIZE + len) == -1) {
+        return -1;
+    }
+    TRACE(TRACE_WRITE, session->clientPid, cmd->seq, traceStart, COM_HDR_SIZE + len);
+    return 1;
 }
 /**
- * @brief Get the Substring From Second Space object
- * 
- * @param input 
- * @return char* 
- */
-char* getSubstringFromSecondSpace(char* input) {
-    int spaceCount = 0;
-    const char* current = input;
-    while (*current != '\0') {
-        if (*current == ' ') {
-            spaceCount++;
-            if (spaceCount == 2) {
-                break;
-            }
+ * @brief Account for a command that has exited: its output is cached if
+ * it succeeded, and its execution slot is given back.
+ *
+ * @param session
+ * @param cmd
+ * @param status from waitpid, or -1 if it is not known
+ */
+void command_exited(struct client_session *session, struct running_cmd *cmd, int status) {
+    if (cmd->cacheRule >= 0 && cmd->bytes <= CACHE_MAX_RESULT && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        cache_store(cmd->cacheRule, &cmd->cacheStamp, cmd->keep, cmd->bytes);
+    }
+    com_pool_put(&session->pool, cmd->keep);
+    cmd->keep = NULL;
+    if (sched_enabled()) {
+        sched_release(session->schedClient);
+    }
+}
+/**
+ * @brief Keep a command whose output has ended until it exits, so the
+ * session goes on meanwhile (it may have closed its stdout and still run).
+ *
+ * @param session
+ * @param cmd
+ */
+void command_exiting(struct client_session *session, struct running_cmd *cmd) {
+    if (session->exitingCount == session->exitingCap) {
+        session->exitingCap = session->exitingCap > 0 ? 2 * session->exitingCap : COM_MAX_CONCURRENCY;
+        session->exiting = realloc(session->exiting, session->exitingCap * sizeof(struct running_cmd));
+        if (session->exiting == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
         }
-        current++;
     }
-    size_t substringLength = 0;
-    const char* substringStart = current + 1;
-    while (*current != '\0') {
-        substringLength++;
-        current++;
+    struct running_cmd *exiting = &session->exiting[session->exitingCount++];
+    *exiting = *cmd;
+    exiting->outFd = syscall(SYS_pidfd_open, cmd->pid, 0);
+    cmd->keep = NULL;
+}
+/**
+ * @brief Reap the commands in session->exiting that have exited.
+ *
+ * @param session
+ */
+void reap_exiting(struct client_session *session) {
+    for (int i = session->exitingCount - 1; i >= 0; i--) {
+        struct running_cmd *cmd = &session->exiting[i];
+        int status = -1;
+        if (waitpid(cmd->pid, &status, WNOHANG) == 0) {
+            continue;
+        }
+        if (cmd->outFd != -1) {
+            close(cmd->outFd);
+        }
+        command_exited(session, cmd, status);
+        *cmd = session->exiting[--session->exitingCount];
     }
-    char* result = (char*)malloc(substringLength + 1);
-    strncpy(result, substringStart, substringLength);
-    size_t leadingSpaces = strspn(result, " ");
-    memmove(result, result + leadingSpaces, substringLength - leadingSpaces + 1);
-    return result;
 }
 /**
- * @brief 
- * 
- * @param argc 
- * @param argv 
- * @return int 
+ * @brief Stop a command whose client went away: SIGTERM, then SIGKILL if
+ * it is still there after STOP_GRACE_MS.
+ *
+ * @param pid
  */
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage of the server: %s <MQNAME>\n", argv[0]);
-                fflush(stdout);
-
-        exit(EXIT_FAILURE);
+void stop_command(pid_t pid) {
+    kill(pid, SIGTERM);
+    for (int waited = 0; waited < STOP_GRACE_MS; waited += SCHED_POLL_MS) {
+        if (waitpid(pid, NULL, WNOHANG) != 0) {
+            return;
+        }
+        usleep(SCHED_POLL_MS * 1000);
     }
-    char *mqName = argv[1];
-    mqd_t mq;
-    struct mq_attr attr = {
-        .mq_flags = 0,     
-        .mq_maxmsg = 10,    
-        .mq_msgsize = MAX_MSG_SIZE, 
-        .mq_curmsgs = 0    
-    };
-    mq = mq_open(mqName, O_RDWR | O_CREAT, QUEUE_PERMISSIONS, &attr);
-    if (mq == (mqd_t)-1) {
-        perror("mq_open");
-        exit(EXIT_FAILURE);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+/**
+ * @brief Close off a command whose output has ended: send the COM_F_LAST
+ * frame and record it. Its slot in cmds is reused. A command that has not
+ * exited yet moves to session->exiting, where it is reaped later.
+ *
+ * @param session
+ * @param cmd one of session->cmds
+ */
+void finish_command(struct client_session *session, struct running_cmd *cmd) {
+    if (session->shell != NULL) {
+        int32_t exitStatus = cmd->status;
+        com_link_send(&session->link, COMMAND_RES, COM_F_LAST | COM_F_STATUS, cmd->seq,
+                      &exitStatus, sizeof(exitStatus));
+        command_exited(session, cmd, -1);
+    } else {
+        close(cmd->outFd);
+        com_link_send(&session->link, COMMAND_RES, COM_F_LAST, cmd->seq, NULL, 0);
+        int status = -1;
+        if (waitpid(cmd->pid, &status, WNOHANG) == 0) {
+            command_exiting(session, cmd);
+        } else {
+            command_exited(session, cmd, status);
+        }
     }
-    printf("Server is running and waiting for connections on message queue '%s'\n", mqName);
+    stats_command_done(now_ns() - cmd->received, cmd->bytes);
+    TRACE(TRACE_REQUEST, session->clientPid, cmd->seq, cmd->received, cmd->bytes);
+    CAPTURE_RESULT_OUT(session->clientPid, cmd->seq, cmd->bytes, 0);
+    printf("command execution finished \n");
     fflush(stdout);
-    while (1) {
-        char buffer[MAX_MSG_SIZE];
-        memset(buffer, 0, MAX_MSG_SIZE);
-        if (mq_receive(mq, buffer, MAX_MSG_SIZE, NULL) == -1) {
-            perror("mq_receive error");
+    struct running_cmd done = *cmd;
+    *cmd = session->cmds[--session->running];
+    session->cmds[session->running] = done;
+}
+/**
+ * @brief Wait until a running command has output or the client has sent
+ * something, and deal with it. Output is only read while there is credit
+ * to send it, and commands in session->exiting are reaped once they exit.
+ * The shared memory rings cannot be polled, so while more commands could
+ * be started they are checked every millisecond; a command waiting for an
+ * execution slot is checked every SCHED_POLL_MS, and exiting commands
+ * without a pidfd every EXIT_POLL_MS.
+ *
+ * @param session
+ * @return int -1 if the client went away
+ */
+int pump_commands(struct client_session *session) {
+    struct com_link *link = &session->link;
+    if (session->credits == 0) {
+        return wait_for_credit(session);
+    }
+    if (link->chan != NULL && com_chan_pending(link->chan) > 0) {
+        return com_link_fill(link, &session->in) <= 0 ? -1 : 0;
+    }
+    struct pollfd fds[session->running + session->exitingCount + 1];
+    int n = session->running;
+    for (int i = 0; i < n; i++) {
+        fds[i] = (struct pollfd){ .fd = session->cmds[i].outFd, .events = POLLIN };
+    }
+    int timeout = -1;
+    for (int i = 0; i < session->exitingCount; i++) {
+        if (session->exiting[i].outFd != -1) {
+            fds[n++] = (struct pollfd){ .fd = session->exiting[i].outFd, .events = POLLIN };
+        } else {
+            timeout = EXIT_POLL_MS;
+        }
+    }
+    if (link->chan == NULL) {
+        fds[n++] = (struct pollfd){ .fd = link->rfd, .events = POLLIN };
+    } else if (session->maxRunning > 1 || session->running == 0) {
+        timeout = 1;
+    }
+    // a slot is granted through shared memory, which poll cannot see
+    if (session->queued != NULL && (timeout == -1 || timeout > SCHED_POLL_MS)) {
+        timeout = SCHED_POLL_MS;
+    }
+    if (poll(fds, n, timeout) == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (session->exitingCount > 0) {
+        reap_exiting(session);
+    }
+    if (link->chan == NULL && fds[n - 1].revents != 0) {
+        if (com_link_fill(link, &session->in) <= 0) {
+            return -1;
+        }
+        session->credits += com_parser_take_credits(&session->in);
+    }
+    // backwards, since finish_command moves the last command into the slot
+    for (int i = session->running - 1; i >= 0; i--) {
+        if (fds[i].revents == 0 || session->credits == 0) {
             continue;
         }
-        char csPipeName[100], scPipeName[100];
-        int wSize;
-        int connection_info_len = 0;
-        int connection_request = 0; //DELETE THIS. ONLY FOR DEVELOPMENT!!!!
-        sscanf(buffer, "%d %d %s %s %d", &connection_info_len, &connection_request, csPipeName ,scPipeName, &wSize);
-        pid_t pid = fork();
-        if (pid == 0) {
-            // printf("%s \n", "main hande client");
-            //         fflush(stdout);
-
-            handle_client_request(csPipeName, scPipeName, wSize);
-            exit(EXIT_SUCCESS); 
+        int r = forward_output(session, &session->cmds[i]);
+        if (r == -1) {
+            return -1;
         }
-        else if (pid < 0) {
-            perror("fork error");
-                // printf("%s \n", "err");
-                //         fflush(stdout);
-
-            continue; 
+        if (r == 0) {
+            finish_command(session, &session->cmds[i]);
+        }
+    }
+    return 0;
+}
+/*
+ * A result produced inside the server child, from the cache or a builtin.
+ * Output collects in the session's frame buffer and is sent as a
+ * COMMAND_RES frame whenever wSize bytes are there, under the same credit
+ * rules as a running command's output.
+ */
+struct result_writer {
+    struct client_session *session;
+    uint32_t seq;
+    size_t fill;
+    uint64_t total;
+};
+/**
+ * @brief Send the buffered part of the result as one frame.
+ *
+ * @param writer
+ * @return int -1 if the client went away
+ */
+int result_flush(struct result_writer *writer) {
+    struct client_session *session = writer->session;
+    if (session->credits == 0 && wait_for_credit(session) == -1) {
+        return -1;
+    }
+    char *payload = session->frame + COM_HDR_SIZE;
+    size_t len = writer->fill;
+    int flags = session->lzBuf != NULL && com_lz_pack(payload, &len, session->lzBuf) ? COM_F_LZ : 0;
+    uint64_t traceStart = TRACE_START();
+    if (com_link_send(&session->link, COMMAND_RES, flags, writer->seq, payload, len) == -1) {
+        return -1;
+    }
+    TRACE(TRACE_WRITE, session->clientPid, writer->seq, traceStart, COM_HDR_SIZE + len);
+    session->credits--;
+    writer->fill = 0;
+    return 0;
+}
+/**
+ * @brief Builtin output sink, also used for cached results.
+ *
+ * @param ctx the result_writer
+ * @param data
+ * @param len
+ * @return int -1 if the client went away
+ */
+int result_write(void *ctx, const char *data, size_t len) {
+    struct result_writer *writer = ctx;
+    size_t wSize = writer->session->wSize;
+    writer->total += len;
+    while (len > 0) {
+        size_t n = wSize - writer->fill;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(writer->session->frame + COM_HDR_SIZE + writer->fill, data, n);
+        writer->fill += n;
+        data += n;
+        len -= n;
+        if (writer->fill == wSize && result_flush(writer) == -1) {
+            return -1;
         }
     }
-        // printf("%s \n", "done");
-        // fflush(stdout);
-    mq_close(mq);
-    mq_unlink(mqName);
-
     return 0;
 }
+/**
+ * @brief Send what is left of the result and the COM_F_LAST frame.
+ *
+ * @param writer
+ * @return uint64_t bytes of output in the result
+ */
+uint64_t result_finish(struct result_writer *writer) {
+    if (writer->fill == 0 || result_flush(writer) == 0) {
+        com_link_send(&writer->session->link, COMMAND_RES, COM_F_LAST, writer->seq, NULL, 0);
+    }
+    return writer->total;
+}
+/**
+ * @brief Start a command process, in a slot already held if execution
+ * slots are in use.
+ *
+ * @param session
+ * @param seq
+ * @param cmdText
+ * @param received when the command arrived
+ * @param cacheRule
+ */
+void launch_command(struct client_session *session, uint32_t seq, const char *cmdText,
+                    uint64_t received, int cacheRule) {
+    struct running_cmd *cmd = &session->cmds[session->running];
+    cmd->cacheRule = cacheRule;
+    if (cmd->cacheRule >= 0) {
+        cache_begin(cmd->cacheRule, &cmd->cacheStamp);
+        cmd->keep = com_pool_get(&session->pool);
+    }
+    int outPipe[2];
+    pid_t pid = -1;
+    if (session->shell != NULL) {
+        uint64_t spawnStart = now_ns();
+        int started = session->shell->pid == 0;
+        if (shell_send(session->shell, cmdText) == -1) {
+            perror("Error when starting command in session shell");
+        } else {
+            pid = session->shell->pid;
+            outPipe[0] = session->shell->outFd;
+            if (started) {
+                stats_spawn(now_ns() - spawnStart);
+                TRACE(TRACE_SPAWN, session->clientPid, seq, spawnStart, 0);
+            }
+        }
+    } else if (pipe2(outPipe, O_CLOEXEC) == -1) {
+        perror("Error when creating output pipe");
+    } else {
+        uint64_t spawnStart = now_ns();
+        pid = spawn_command(cmdText, outPipe[1]);
+        close(outPipe[1]);
+        if (pid < 0) {
+            perror("spawn error");
+            close(outPipe[0]);
+        } else {
+            stats_spawn(now_ns() - spawnStart);
+            TRACE(TRACE_SPAWN, session->clientPid, seq, spawnStart, 0);
+        }
+    }
+    if (pid < 0) {
+        if (sched_enabled()) {
+            sched_release(session->schedClient);
+        }
+        com_link_send(&session->link, COMMAND_RES, COM_F_LAST, seq, NULL, 0);
+        return;
+    }
+    cmd->pid = pid;
+    cmd->outFd = outPipe[0];
+    cmd->passed = 0;
+    cmd->status = -1;
+    cmd->seq = seq;
+    cmd->received = received;
+    cmd->bytes = 0;
+    session->running++;
+}
+/**
+ * @brief Answer a SEND_COMMAND. Builtins and cache hits are sent right
+ * away; anything else is started and left for pump_commands(), once it
+ * has an execution slot. Without a free slot it is queued or, past the
+ * backlog, refused with a BUSY reply. In session mode every command goes
+ * to the shell, as its directory and variables may change what a builtin
+ * or cached result would give.
+ *
+ * @param session
+ * @param seq
+ * @param cmdText
+ */
+void start_command(struct client_session *session, uint32_t seq, const char *cmdText) {
+    uint64_t received = now_ns();
+    CAPTURE_COMMAND_IN(session->clientPid, seq, received, cmdText);
+    struct result_writer writer = { session, seq, 0, 0 };
+    struct builtin_sink sink = { result_write, &writer };
+    if (session->shell == NULL && builtin_run(cmdText, &sink) >= 0) {
+        stats_command_done(now_ns() - received, result_finish(&writer));
+        TRACE(TRACE_REQUEST, session->clientPid, seq, received, writer.total);
+        CAPTURE_RESULT_OUT(session->clientPid, seq, writer.total, 0);
+        return;
+    }
+    int cacheRule = session->shell == NULL ? cache_rule_for(cmdText) : -1;
+    if (cacheRule >= 0) {
+        if (session->cacheBuf == NULL) {
+            session->cacheBuf = com_pool_get(&session->pool);
+        }
+        ssize_t cached = cache_get(cacheRule, session->cacheBuf);
+        if (cached >= 0) {
+            printf("server child: result served from cache \n");
+            fflush(stdout);
+            result_write(&writer, session->cacheBuf, cached);
+            stats_command_done(now_ns() - received, result_finish(&writer));
+            TRACE(TRACE_REQUEST, session->clientPid, seq, received, writer.total);
+            CAPTURE_RESULT_OUT(session->clientPid, seq, writer.total, 0);
+            return;
+        }
+    }
+    // a command waiting for a slot is held in a pool buffer, so a longer
+    // one cannot be taken while slots are in use
+    if (sched_enabled() && strlen(cmdText) >= session->pool.size) {
+        com_link_send(&session->link, COMMAND_RES, COM_F_LAST | COM_F_ERROR, seq, TOO_LONG_TEXT, strlen(TOO_LONG_TEXT));
+        CAPTURE_RESULT_OUT(session->clientPid, seq, 0, COM_F_ERROR);
+        return;
+    }
+    int slot = sched_enabled() ? sched_acquire(session->schedClient, &session->queuedTicket) : SCHED_GRANTED;
+    if (slot == SCHED_BUSY) {
+        stats_command_busy();
+        com_link_send(&session->link, COMMAND_RES, COM_F_LAST | COM_F_BUSY, seq, BUSY_TEXT, strlen(BUSY_TEXT));
+        CAPTURE_RESULT_OUT(session->clientPid, seq, 0, COM_F_BUSY);
+        return;
+    }
+    if (slot == SCHED_QUEUED) {
+        stats_command_queued();
+        session->queued = strcpy(com_pool_get(&session->pool), cmdText);
+        session->queuedSeq = seq;
+        session->queuedReceived = received;
+        session->queuedRule = cacheRule;
+        return;
+    }
+    launch_command(session, seq, cmdText, received, cacheRule);
+}
+/**
+ * @brief Start the command that was waiting for a slot, once it has one.
+ *
+ * @param session
+ */
+void launch_queued(struct client_session *session) {
+    TRACE(TRACE_SLOT, session->clientPid, session->queuedSeq, session->queuedReceived, 0);
+    launch_command(session, session->queuedSeq, session->queued, session->queuedReceived, session->queuedRule);
+    com_pool_put(&session->pool, session->queued);
+    session->queued = NULL;
+}
 /**
  * @brief 
  * 
- * @param csPipeName 
- * @param scPipeName 
- * @param wSize 
- */
-void handle_client_request(char *csPipeName, char *scPipeName, int wSize) {
-    int client_count = read_value_from_file();
-    // printf("Server - cssc_pipe_name: %s\n", csPipeName);
-    // fflush(stdout);
-    int csPipe = open(csPipeName, O_RDWR);
-    // printf(" %s\n", "bef open");
-    // fflush(stdout);
-    client_count = read_value_from_file();
-    client_count = client_count + 1;
-    save_value_to_file(client_count);
-    int scPipe = open(scPipeName, O_RDWR);
-    // printf("%s\n", "after open");
-    // fflush(stdout);
-    // printf("Server - cssc_pipe_name: %s\n", csPipeName);
-    // printf("Server - sc_pipe: %s\n", scPipeName);
-    printf("Server-client count: %d\n", client_count);
-        fflush(stdout);
-    char *cmdBufferFull = (char *)malloc(MAX_MSG_SIZE * sizeof(char));
-    char responseBuffer[MAX_MSG_SIZE];
-    FILE *fp;
-    //const char *tempFileName = "comserver_temp";
-    if (csPipe == -1 || scPipe == -1) {
+ * @param request 
+ */
+void handle_client_request(struct conn_request *request) {
+    uint64_t traceStart = TRACE_START();
+    int csPipe = -1;
+    int scPipe = -1;
+    struct com_chan chan;
+    int ringsOnly = rings_only(request);
+    if (ringsOnly) {
+        if (!(request->features & COM_F_SHM) || com_chan_attach(&chan, request->shmName, request->pid) == -1) {
+            perror("Error when attaching shared memory rings");
+            return;
+        }
+    } else if (request->sockFd != -1) {
+        // the socket serves as both pipes
+        csPipe = request->sockFd;
+        scPipe = fcntl(csPipe, F_DUPFD_CLOEXEC, 0);
+    } else {
+        csPipe = open(request->csPipeName, O_RDWR | O_CLOEXEC);
+        scPipe = open(request->scPipeName, O_RDWR | O_CLOEXEC);
+    }
+    if (!ringsOnly && (csPipe == -1 || scPipe == -1)) {
         perror("Error when opening pipes");
+        if (csPipe != -1) {
+            close(csPipe);
+        }
+        if (scPipe != -1) {
+            close(scPipe);
+        }
         return;
     }
+    printf("Server-client count: %d\n", stats_client_connected());
+        fflush(stdout);
     //server main: CONREQUEST message received: pid=13153, cs=FIFO-CS-13153 sc=FIFO-SC-13153, wsize=1
-    printf("server main: CONREQUEST message recieved pid = %s, cs= %s, sc= %s, wsize= %d \n", extract_number(scPipeName), csPipeName, scPipeName, wSize);
+    printf("server main: CONREQUEST message recieved pid = %d, cs= %s, sc= %s, wsize= %d \n",
+           (int)request->pid, request->csPipeName, request->scPipeName, request->wSize);
     fflush(stdout);
-    strcpy(responseBuffer, "Connection established");
-    int data_len = strlen(responseBuffer) + 1; 
-    int message_len = 7 + data_len; 
-    char message[BUFFER_SIZE];
-    sprintf(message, "%4d%1d%3s%s", message_len, CONNECTION_REP, "", responseBuffer);
-    write(scPipe, message, wSize);
+    struct client_session session = {
+        .clientPid = request->pid,
+        .link = { .rfd = csPipe, .wfd = scPipe, .chan = NULL },
+        .wSize = request->wSize,
+        .credits = request->credits,
+        .maxRunning = request->concurrency,
+        .schedClient = sched_enabled() ? sched_join(request->weight) : -1,
+    };
+    com_pool_init(&session.pool, POOL_BUFFER_SIZE);
+    struct com_link *link = &session.link;
+    int replyFlags = 0;
+    if (ringsOnly || ((request->features & COM_F_SHM) && com_chan_attach(&chan, request->shmName, request->pid) == 0)) {
+        replyFlags |= COM_F_SHM;
+    }
+    if (request->features & COM_F_LZ) {
+        replyFlags |= COM_F_LZ;
+        session.lzBuf = com_pool_get(&session.pool);
+    }
+    if ((request->features & COM_F_FD) && request->sockFd != -1 && !(replyFlags & COM_F_SHM)) {
+        replyFlags |= COM_F_FD;
+        session.passFds = 1;
+    }
+    if (request->features & COM_F_SESSION) {
+        replyFlags |= COM_F_SESSION;
+        session.shell = calloc(1, sizeof(struct shell_session));
+        session.maxRunning = 1;
+        session.passFds = 0;
+        replyFlags &= ~COM_F_FD;
+        request->concurrency = 1;
+    }
+    // the rings only take over after the reply, unless there is nothing else
+    if (ringsOnly) {
+        link->chan = &chan;
+    }
+    send_connection_reply(link, replyFlags, request);
+    TRACE(TRACE_OPEN, session.clientPid, 0, traceStart, 0);
+    CAPTURE_SESSION_OPEN(session.clientPid, replyFlags, session.wSize, session.maxRunning);
+    if (replyFlags & COM_F_SHM) {
+        link->chan = &chan;
+    }
+    session.frame = com_pool_get(&session.pool);
+    struct com_parser *in = &session.in;
+    com_parser_init(in, BUFFER_SIZE);
+    // a quit is answered once the commands still running have finished
+    int quitting = 0;
+    uint32_t quitSeq = 0;
     while (1) {
-        int bytesRead = read(csPipe, cmdBufferFull, MAX_MSG_SIZE - 1);
-        if (bytesRead <= 0) {
+        struct com_hdr hdr;
+        const char *cmdBuffer;
+        int r = 0;
+        if (!quitting && session.running < session.maxRunning && session.queued == NULL) {
+            r = com_parser_next(in, &hdr, &cmdBuffer);
+        }
+        if (r == 0) {
+            if (session.queued != NULL && sched_granted(session.schedClient, session.queuedTicket)) {
+                launch_queued(&session);
+                continue;
+            }
+            if (session.running > 0) {
+                if (pump_commands(&session) == -1) {
+                    break;
+                }
+                continue;
+            }
+            if (session.queued != NULL) {
+                // the slot may be held by one of our own exiting commands
+                reap_exiting(&session);
+                sched_wait(session.schedClient, session.queuedTicket, session.exitingCount > 0 ? SCHED_POLL_MS : 1000);
+                continue;
+            }
+            if (quitting) {
+                const char *ack = "quit-ack";
+                com_link_send(link, QUIT_REP, 0, quitSeq, ack, strlen(ack) + 1);
+                break;
+            }
+            if (session.exitingCount > 0) {
+                if (pump_commands(&session) == -1) {
+                    break;
+                }
+                continue;
+            }
+            if (com_link_fill(link, in) <= 0) {
+                break;
+            }
+            continue;
+        }
+        if (r < 0) {
+            fprintf(stderr, "server: malformed message from client\n");
             break;
         }
-        if (bytesRead < MAX_MSG_SIZE - 1) {
-            cmdBufferFull[bytesRead] = '\0';
-        } else {
-            cmdBufferFull[MAX_MSG_SIZE - 1] = '\0';
-        }
-        int lenght, type;
-        char data[wSize];
-        sscanf(cmdBufferFull, "%d%d%s", &lenght, &type, data);
-        /*
-            #define CONNECTION_REQ 1
-            #define CONNECTION_REP 2
-            #define SEND_COMMAND 3
-            #define COMMAND_RES 4
-            #define QUIT_REQ 5
-            #define QUIT_REP 6
-            #define QUIT_ALL_REQ 7
-        */
        //server child: COMLINE message received: len=27, type=3, data=cat atextfile.txt
-        switch (type)
-        {
-        case SEND_COMMAND:
-            printf("server child: COMLINE message received: len = %d, type = %d, data = %s \n", lenght, type, data);
-            fflush(stdout);
-            break;
-        case QUIT_REQ:
-            printf("server child: QUIT_REQ message received: len = %d, type = %d, data = %s \n", lenght, type, data);
-            fflush(stdout);
-            break;
-        case QUIT_ALL_REQ:
-            printf("server child: QUIT_REQ message received: len = %d, type = %d, data = %s \n", lenght, type, data);
+        if (hdr.type == QUIT_REQ || hdr.type == QUIT_ALL_REQ) {
+            printf("server child: QUIT_REQ message received: len = %u, type = %d \n", hdr.len, hdr.type);
             fflush(stdout);
-            break;
-        default:
-            break;
+            quitting = 1;
+            quitSeq = hdr.seq;
+            continue;
         }
-        char* abc = getSubstringFromSecondSpace(cmdBufferFull);
-        //char* acb = getSubstringFromSecondSpace(abc);
-        char* cmdBuffer = getSubstringFromSecondSpace(abc);
-        if (strcmp(cmdBuffer, "quit") == 0) {
-            client_count = read_value_from_file();
-            client_count = client_count - 1;
-            save_value_to_file(client_count);
-            strcpy(responseBuffer, "quit-ack");
-            printf("Server-client count: %d\n", client_count);
-            write(scPipe, responseBuffer, strlen(responseBuffer) + 1);
-        }
-        fp = fopen("comserver_temp", "w+");
-        if (fp == NULL) {
-            perror("Error when opening temporary file");
-            break;
+        if (hdr.type == STATS_REQ) {
+            char text[BUFFER_SIZE];
+            size_t len = stats_format(text, sizeof(text));
+            com_link_send(link, STATS_REP, 0, hdr.seq, text, len + 1);
+            continue;
         }
-        pid_t pid = fork();
-        if (pid == 0) {
-            dup2(fileno(fp), STDOUT_FILENO);
-            if(strcmp(cmdBuffer, "quit") != 0){
-                execlp("sh", "sh", "-c", cmdBuffer, (char *)NULL);
-            }
-            exit(EXIT_FAILURE); 
+        if (hdr.type == CREDIT && hdr.len == sizeof(uint32_t)) {
+            uint32_t granted;
+            memcpy(&granted, cmdBuffer, sizeof(granted));
+            session.credits += granted;
+            continue;
+        }
+        if (hdr.type != SEND_COMMAND || hdr.len == 0 || cmdBuffer[hdr.len - 1] != '\0') {
+            fprintf(stderr, "server: unexpected message type %d\n", hdr.type);
+            continue;
         }
-        printf("command execution finished \n");
+        printf("server child: COMLINE message received: len = %u, type = %d, data = %s \n", hdr.len, hdr.type, cmdBuffer);
         fflush(stdout);
-        wait(NULL);
-        fseek(fp, 0, SEEK_SET);
-        while ((bytesRead = fread(responseBuffer, 1, sizeof(responseBuffer), fp)) > 0) {
-            int data_len = strlen(responseBuffer) + 1;
-            int message_len = 7 + data_len;
-            char message[BUFFER_SIZE];
-            sprintf(message, "%4d%1d%3s%s", message_len, COMMAND_RES, "", responseBuffer);
-            // printf("The message from the server: %s \n ", message);
-            // fflush(stdout);
-            write(scPipe, message, bytesRead + 6 + 1);
-        }
-        fclose(fp);
-    }
-    close(csPipe);
-    close(scPipe);
+        start_command(&session, hdr.seq, cmdBuffer);
+    }
+    // stop whatever is still running if the client went away
+    while (session.running > 0) {
+        struct running_cmd *cmd = &session.cmds[--session.running];
+        if (session.shell == NULL) {
+            close(cmd->outFd);
+            stop_command(cmd->pid);
+        }
+        if (sched_enabled()) {
+            sched_release(session.schedClient);
+        }
+    }
+    // commands whose output has ended hold their slots until they exit;
+    // the client has its replies already and is not kept waiting
+    while (session.exitingCount > 0) {
+        struct running_cmd *cmd = &session.exiting[--session.exitingCount];
+        int status = -1;
+        waitpid(cmd->pid, &status, 0);
+        if (cmd->outFd != -1) {
+            close(cmd->outFd);
+        }
+        command_exited(&session, cmd, status);
+    }
+    free(session.exiting);
+    if (session.shell != NULL) {
+        shell_stop(session.shell);
+        free(session.shell);
+    }
+    if (sched_enabled()) {
+        sched_leave(session.schedClient);
+    }
+    printf("Server-client count: %d\n", stats_client_disconnected());
+    fflush(stdout);
+    com_parser_free(in);
+    com_pool_free(&session.pool);
+    if (link->chan != NULL) {
+        com_chan_close(link->chan);
+    }
+    if (!ringsOnly) {
+        close(csPipe);
+        close(scPipe);
+    }
+    CAPTURE_SESSION_CLOSE(session.clientPid);
+    trace_flush();
+    capture_flush();
 }
-
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/random.h>
+#include <sys/wait.h>
+#include "comshell.h"
+#include "comspawn.h"
+
+#define SHELL_WRITE_CHUNK 4096
+
+/**
+ * @brief Start the shell and choose its marker.
+ *
+ * @param shell
+ * @return int 0 on success, -1 with errno set
+ */
+static int shell_start(struct shell_session *shell) {
+    int inPipe[2];
+    int outPipe[2];
+    if (pipe2(inPipe, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    if (pipe2(outPipe, O_CLOEXEC) == -1) {
+        close(inPipe[0]);
+        close(inPipe[1]);
+        return -1;
+    }
+    pid_t pid = spawn_shell(inPipe[0], outPipe[1]);
+    int error = errno;
+    close(inPipe[0]);
+    close(outPipe[1]);
+    if (pid == -1) {
+        close(inPipe[1]);
+        close(outPipe[0]);
+        errno = error;
+        return -1;
+    }
+    // a shell that has gone must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+    unsigned long long token;
+    if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+        token = ((unsigned long long)getpid() << 32) ^ (unsigned long long)time(NULL) ^ (unsigned long long)pid;
+    }
+    shell->pid = pid;
+    shell->inFd = inPipe[1];
+    shell->outFd = outPipe[0];
+    shell->markerLen = snprintf(shell->marker, sizeof(shell->marker), "\036COMEND_%016llx_", token);
+    shell->heldLen = 0;
+    return 0;
+}
+
+/**
+ * @brief Collect a shell that has gone away.
+ *
+ * @param shell
+ * @return int its exit status, 128 + signal if it was killed
+ */
+static int shell_reap(struct shell_session *shell) {
+    int status = 0;
+    close(shell->inFd);
+    close(shell->outFd);
+    waitpid(shell->pid, &status, 0);
+    shell->pid = 0;
+    shell->heldLen = 0;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/**
+ * @brief
+ *
+ * @param fd
+ * @param data
+ * @param len
+ * @return int 0 on success, -1 on error
+ */
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write a command and its marker line to the shell. Single quotes
+ * in the command are written as '\'' to keep it one word.
+ *
+ * @param shell
+ * @param cmd
+ * @return int 0 on success, -1 on error
+ */
+static int shell_write(struct shell_session *shell, const char *cmd) {
+    char chunk[SHELL_WRITE_CHUNK];
+    size_t fill = snprintf(chunk, sizeof(chunk), "command eval '");
+    for (; *cmd != '\0'; cmd++) {
+        if (fill + 4 > sizeof(chunk)) {
+            if (write_all(shell->inFd, chunk, fill) == -1) {
+                return -1;
+            }
+            fill = 0;
+        }
+        if (*cmd == '\'') {
+            memcpy(chunk + fill, "'\\''", 4);
+            fill += 4;
+        } else {
+            chunk[fill++] = *cmd;
+        }
+    }
+    if (write_all(shell->inFd, chunk, fill) == -1) {
+        return -1;
+    }
+    fill = snprintf(chunk, sizeof(chunk), "' </dev/null\nprintf '%s%%03d\\n' $?\n", shell->marker);
+    return write_all(shell->inFd, chunk, fill);
+}
+
+/**
+ * @brief Have the shell run a command, starting the shell if there is
+ * none. A shell that has died since the last command is replaced once.
+ *
+ * @param shell
+ * @param cmd
+ * @return int 0 on success, -1 with errno set if no shell could be
+ * started or written to
+ */
+int shell_send(struct shell_session *shell, const char *cmd) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int fresh = shell->pid == 0;
+        if (fresh && shell_start(shell) == -1) {
+            return -1;
+        }
+        if (shell_write(shell, cmd) == 0) {
+            return 0;
+        }
+        int error = errno;
+        kill(-shell->pid, SIGTERM);
+        shell_reap(shell);
+        errno = error;
+        if (fresh) {
+            break;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Read the next piece of the running command's output. Bytes that
+ * may be the start of the marker are held back until it is clear whether
+ * they are.
+ *
+ * @param shell
+ * @param buf
+ * @param cap size of buf, more than SHELL_MARKER_MAX + SHELL_STATUS_LEN
+ * @param status set to the command's exit status once it has finished,
+ * -1 while it runs
+ * @return ssize_t bytes of output placed in buf, possibly 0
+ */
+ssize_t shell_read(struct shell_session *shell, char *buf, size_t cap, int *status) {
+    *status = -1;
+    memcpy(buf, shell->held, shell->heldLen);
+    size_t total = shell->heldLen;
+    shell->heldLen = 0;
+    ssize_t n;
+    do {
+        n = read(shell->outFd, buf + total, cap - total);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        // the shell has gone, e.g. after an exit command
+        *status = shell_reap(shell);
+        return total;
+    }
+    total += n;
+    size_t trailer = shell->markerLen + SHELL_STATUS_LEN;
+    char *found = memmem(buf, total, shell->marker, shell->markerLen);
+    size_t keep;
+    if (found != NULL) {
+        size_t pos = found - buf;
+        if (total - pos >= trailer) {
+            const char *digits = found + shell->markerLen;
+            *status = (digits[0] - '0') * 100 + (digits[1] - '0') * 10 + (digits[2] - '0');
+            return pos;
+        }
+        keep = total - pos;
+    } else {
+        keep = total < shell->markerLen ? total : shell->markerLen - 1;
+        while (keep > 0 && memcmp(buf + total - keep, shell->marker, keep) != 0) {
+            keep--;
+        }
+    }
+    memcpy(shell->held, buf + total - keep, keep);
+    shell->heldLen = keep;
+    return total - keep;
+}
+
+/**
+ * @brief End the session: stop the shell and anything it is running.
+ *
+ * @param shell
+ */
+void shell_stop(struct shell_session *shell) {
+    if (shell->pid == 0) {
+        return;
+    }
+    kill(-shell->pid, SIGTERM);
+    shell_reap(shell);
+}
@@ -0,0 +1,43 @@
+#ifndef _COMSHELL_H_
+#define _COMSHELL_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Session mode: a client that asks for it (client -p) gets one long-lived
+// sh per connection instead of a new process per command, so the
+// per-command cost is a write to a pipe, and cd, variables and functions
+// carry over from one command to the next.
+//
+// Each command is written to the shell as
+//
+//   command eval '<command>' </dev/null
+//   printf '<marker>%03d\n' $?
+//
+// and its output is everything the shell writes before the marker, which
+// holds a random token chosen when the shell starts. The three digits
+// after it are the exit status. "command eval" keeps a syntax error from
+// ending the shell; a command that ends it anyway, such as exit, just
+// finishes with the shell's exit status, and the next command starts a
+// new shell. Output written after the marker, by something left running
+// in the background, is dropped.
+
+#define SHELL_MARKER_MAX 32
+#define SHELL_STATUS_LEN 4
+// "%03d\n" after the marker
+
+struct shell_session {
+    pid_t pid;
+    int inFd;
+    int outFd;
+    char marker[SHELL_MARKER_MAX];
+    size_t markerLen;
+    char held[SHELL_MARKER_MAX + SHELL_STATUS_LEN];
+    size_t heldLen;
+};
+
+int shell_send(struct shell_session *shell, const char *cmd);
+ssize_t shell_read(struct shell_session *shell, char *buf, size_t cap, int *status);
+void shell_stop(struct shell_session *shell);
+
+#endif
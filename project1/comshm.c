@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "comshm.h"
+
+#define FUTEX_TIMEOUT_SEC 1
+// sleepers wake up this often to check that the peer still exists
+
+/**
+ * @brief Sleep while *word still holds val, or until the timeout.
+ *
+ * @param word
+ * @param val
+ * @param timeout_ns
+ * @return int -1 with errno ETIMEDOUT on timeout
+ */
+static int futex_wait(uint32_t *word, uint32_t val, long long timeout_ns) {
+    struct timespec timeout = { .tv_sec = timeout_ns / 1000000000, .tv_nsec = timeout_ns % 1000000000 };
+    return syscall(SYS_futex, word, FUTEX_WAIT, val, &timeout, NULL, 0);
+}
+
+/**
+ * @brief
+ *
+ * @param word
+ */
+static void futex_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * @brief Wake the other side if it announced that it is sleeping on word.
+ *
+ * @param word
+ * @param waiters
+ */
+static void wake_if_waiting(uint32_t *word, uint32_t *waiters) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(waiters, 0, __ATOMIC_SEQ_CST);
+        futex_wake(word);
+    }
+}
+
+/**
+ * @brief Sleep until *word changes from val. The waiter flag is raised
+ * before the final check, so a producer that moves word afterwards is
+ * guaranteed to see it and issue the wake.
+ *
+ * @param ch
+ * @param ring
+ * @param word
+ * @param waiters
+ * @param val
+ * @return int -1 if the ring was closed or the peer has exited
+ */
+static int wait_for_change(struct com_chan *ch, struct com_ring *ring, uint32_t *word,
+                           uint32_t *waiters, uint32_t val) {
+    __atomic_store_n(waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(word, __ATOMIC_SEQ_CST) != val) {
+        return 0;
+    }
+    if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    if (futex_wait(word, val, FUTEX_TIMEOUT_SEC * 1000000000ll) == -1 && errno == ETIMEDOUT) {
+        if (ch->peer > 0 && kill(ch->peer, 0) == -1 && errno == ESRCH) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Map the control page and both rings, each ring twice in a row.
+ *
+ * @param ch
+ * @param fd
+ * @param ring_size
+ * @return int
+ */
+static int map_segment(struct com_chan *ch, int fd, uint32_t ring_size) {
+    size_t map_size = COM_SHM_CTRL_SIZE + 4 * (size_t)ring_size;
+    char *base = mmap(NULL, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    if (mmap(base, COM_SHM_CTRL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, map_size);
+        return -1;
+    }
+    for (int r = 0; r < 2; r++) {
+        off_t offset = COM_SHM_CTRL_SIZE + (off_t)r * ring_size;
+        char *view = base + COM_SHM_CTRL_SIZE + (size_t)2 * r * ring_size;
+        if (mmap(view, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED
+            || mmap(view + ring_size, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+            munmap(base, map_size);
+            return -1;
+        }
+    }
+    ch->base = base;
+    ch->map_size = map_size;
+    ch->ring_size = ring_size;
+    return 0;
+}
+
+/**
+ * @brief Create the segment (client side). The client writes requests and
+ * reads responses. The server's pid is not known yet; set peer once the
+ * connection reply has named it.
+ *
+ * @param ch
+ * @param name shared memory object name
+ * @param ring_size
+ * @return int 0 on success, -1 on error
+ */
+int com_chan_create(struct com_chan *ch, const char *name, uint32_t ring_size) {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    if (ftruncate(fd, COM_SHM_CTRL_SIZE + 2 * (off_t)ring_size) == -1 || map_segment(ch, fd, ring_size) == -1) {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    close(fd);
+    struct com_shm_ctrl *ctrl = (struct com_shm_ctrl *)ch->base;
+    memset(ctrl, 0, sizeof(*ctrl));
+    ctrl->ring_size = ring_size;
+    ch->tx = &ctrl->req;
+    ch->rx = &ctrl->res;
+    ch->tx_data = ch->base + COM_SHM_CTRL_SIZE;
+    ch->rx_data = ch->base + COM_SHM_CTRL_SIZE + 2 * (size_t)ring_size;
+    ch->peer = 0;
+    return 0;
+}
+
+/**
+ * @brief Map a segment created by the client (server side).
+ *
+ * @param ch
+ * @param name
+ * @param peer client pid, used to notice a client that went away
+ * @return int 0 on success, -1 on error
+ */
+int com_chan_attach(struct com_chan *ch, const char *name, pid_t peer) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // the client picks the ring size: map no more than the object holds,
+    // as touching a page past its end would kill the server with SIGBUS
+    struct com_shm_ctrl ctrl;
+    struct stat st;
+    if (pread(fd, &ctrl, sizeof(ctrl), 0) != sizeof(ctrl) || fstat(fd, &st) == -1 || ctrl.ring_size == 0
+        || ctrl.ring_size > COM_SHM_RING_SIZE || (ctrl.ring_size & (ctrl.ring_size - 1)) != 0
+        || ctrl.ring_size % COM_SHM_CTRL_SIZE != 0
+        || st.st_size < COM_SHM_CTRL_SIZE + 2 * (off_t)ctrl.ring_size
+        || map_segment(ch, fd, ctrl.ring_size) == -1) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    struct com_shm_ctrl *shared = (struct com_shm_ctrl *)ch->base;
+    ch->rx = &shared->req;
+    ch->tx = &shared->res;
+    ch->rx_data = ch->base + COM_SHM_CTRL_SIZE;
+    ch->tx_data = ch->base + COM_SHM_CTRL_SIZE + 2 * (size_t)ch->ring_size;
+    ch->peer = peer;
+    return 0;
+}
+
+/**
+ * @brief Mark both rings closed, wake anyone sleeping on them and unmap.
+ *
+ * @param ch
+ */
+void com_chan_close(struct com_chan *ch) {
+    if (ch->base == NULL) {
+        return;
+    }
+    struct com_ring *rings[2] = { ch->rx, ch->tx };
+    for (int i = 0; i < 2; i++) {
+        __atomic_store_n(&rings[i]->closed, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&rings[i]->head);
+        futex_wake(&rings[i]->tail);
+    }
+    munmap(ch->base, ch->map_size);
+    ch->base = NULL;
+}
+
+/**
+ * @brief
+ *
+ * @param ch
+ * @return size_t bytes that can be read without waiting
+ */
+size_t com_chan_pending(struct com_chan *ch) {
+    return __atomic_load_n(&ch->rx->head, __ATOMIC_ACQUIRE) - ch->rx->tail;
+}
+
+/**
+ * @brief Sleep until there are bytes to read, for at most timeout_ms.
+ *
+ * @param ch
+ * @param timeout_ms
+ * @return int 1 once bytes are pending, 0 on timeout, -1 if the peer has
+ * closed or exited
+ */
+int com_chan_wait(struct com_chan *ch, int timeout_ms) {
+    struct com_ring *ring = ch->rx;
+    uint32_t tail = ring->tail;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long deadline = now.tv_sec * 1000000000ll + now.tv_nsec + timeout_ms * 1000000ll;
+    while (1) {
+        __atomic_store_n(&ring->head_waiters, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != tail) {
+            return 1;
+        }
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long left = deadline - (now.tv_sec * 1000000000ll + now.tv_nsec);
+        if (left <= 0) {
+            return ch->peer > 0 && kill(ch->peer, 0) == -1 && errno == ESRCH ? -1 : 0;
+        }
+        futex_wait(&ring->head, tail, left);
+    }
+}
+
+/**
+ * @brief Copy out up to len received bytes, sleeping while the ring is empty.
+ *
+ * @param ch
+ * @param buf
+ * @param len
+ * @return ssize_t bytes copied, 0 once the peer has closed or exited
+ */
+ssize_t com_chan_read(struct com_chan *ch, void *buf, size_t len) {
+    struct com_ring *ring = ch->rx;
+    uint32_t tail = ring->tail;
+    uint32_t head;
+    while ((head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) == tail) {
+        if (wait_for_change(ch, ring, &ring->head, &ring->head_waiters, tail) == -1) {
+            return 0;
+        }
+    }
+    size_t n = head - tail;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buf, ch->rx_data + (tail & (ch->ring_size - 1)), n);
+    __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+    wake_if_waiting(&ring->tail, &ring->tail_waiters);
+    return n;
+}
+
+/**
+ * @brief Wait for len free bytes and return where they start. The space
+ * is contiguous thanks to the double mapping.
+ *
+ * @param ch
+ * @param len at most the ring size
+ * @return char* NULL if the peer has closed or exited
+ */
+char* com_chan_reserve(struct com_chan *ch, size_t len) {
+    struct com_ring *ring = ch->tx;
+    uint32_t head = ring->head;
+    uint32_t tail;
+    while (ch->ring_size - (head - (tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))) < len) {
+        if (wait_for_change(ch, ring, &ring->tail, &ring->tail_waiters, tail) == -1) {
+            return NULL;
+        }
+    }
+    return ch->tx_data + (head & (ch->ring_size - 1));
+}
+
+/**
+ * @brief Publish len bytes written at the reserved space.
+ *
+ * @param ch
+ * @param len
+ */
+void com_chan_commit(struct com_chan *ch, size_t len) {
+    struct com_ring *ring = ch->tx;
+    __atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
+    wake_if_waiting(&ring->head, &ring->head_waiters);
+}
+
+/**
+ * @brief Copy len bytes into the ring, in ring-sized pieces if needed.
+ *
+ * @param ch
+ * @param data
+ * @param len
+ * @return ssize_t len, or -1 if the peer has closed or exited
+ */
+ssize_t com_chan_write(struct com_chan *ch, const void *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        size_t n = len - done;
+        if (n > ch->ring_size) {
+            n = ch->ring_size;
+        }
+        char *space = com_chan_reserve(ch, n);
+        if (space == NULL) {
+            return -1;
+        }
+        memcpy(space, (const char *)data + done, n);
+        com_chan_commit(ch, n);
+        done += n;
+    }
+    return len;
+}
+
+/**
+ * @brief Name of the object a server listening on mq_name advertises the
+ * rings in: the queue name, with slashes made underscores, after a prefix.
+ *
+ * @param mq_name
+ * @param name
+ * @param size
+ */
+static void rings_advert_name(const char *mq_name, char *name, size_t size) {
+    snprintf(name, size, "/comshm_rings%s%s", mq_name[0] == '/' ? "" : "_", mq_name);
+    for (char *c = name + 1; *c != '\0'; c++) {
+        if (*c == '/') {
+            *c = '_';
+        }
+    }
+}
+
+/**
+ * @brief Advertise that the server on mq_name serves clients over the
+ * rings alone, or withdraw the advertisement.
+ *
+ * @param mq_name
+ * @param pid the server's pid, or 0 to withdraw
+ * @return int 0 on success, -1 on error
+ */
+int com_rings_advertise(const char *mq_name, pid_t pid) {
+    char name[NAME_MAX];
+    rings_advert_name(mq_name, name, sizeof(name));
+    if (pid == 0) {
+        return shm_unlink(name) == -1 && errno != ENOENT ? -1 : 0;
+    }
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    int32_t value = pid;
+    ssize_t n = write(fd, &value, sizeof(value));
+    close(fd);
+    return n == sizeof(value) ? 0 : -1;
+}
+
+/**
+ * @brief Look for a live server on mq_name that serves clients over the
+ * rings alone.
+ *
+ * @param mq_name
+ * @return pid_t its pid, or 0 if there is none
+ */
+pid_t com_rings_server(const char *mq_name) {
+    char name[NAME_MAX];
+    rings_advert_name(mq_name, name, sizeof(name));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        return 0;
+    }
+    int32_t pid;
+    ssize_t n = read(fd, &pid, sizeof(pid));
+    close(fd);
+    // an advertisement left behind by a server that was killed
+    if (n != sizeof(pid) || pid <= 0 || (kill(pid, 0) == -1 && errno == ESRCH)) {
+        return 0;
+    }
+    return pid;
+}
@@ -0,0 +1,76 @@
+#ifndef _COMSHM_H_
+#define _COMSHM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Shared-memory transport between a client and its server child.
+//
+// The client creates a POSIX shared memory segment holding two
+// single-producer single-consumer byte rings: requests (client to server)
+// and responses (server to client). The rings carry the same framed
+// messages as the FIFOs. Each ring's data area is mapped twice back to
+// back, so any span of up to ring size bytes is contiguous in memory and
+// can be filled by a single read() or copied with a single memcpy().
+// A side that finds its ring empty or full sleeps on a futex.
+//
+// The server picks the transport when it starts. One started with -r
+// advertises its pid in a shared memory object named after its message
+// queue. A client without -u or -r that finds a live server there offers
+// the segment alone: its CONNECTION_REQ has empty FIFO names, and the
+// server's reply comes back on the response ring. Nothing but the segment
+// is created per client, and a server waiting on the rings notices within
+// a second that its client went away. Without the advertisement clients
+// use FIFOs as before, and nothing is offered that the server would turn
+// down.
+
+#define COM_SHM_RING_SIZE (1 << 20)
+// bytes per ring, a multiple of the page size and a power of two
+
+#define COM_SHM_CTRL_SIZE 4096
+
+#define COM_SHM_CONNECT_CHECK_MS 1000
+// how often a client on the rings alone, waiting for the connection
+// reply, checks that the advertised server still exists
+
+struct com_ring {
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t head_waiters;
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t tail_waiters;
+    uint32_t closed __attribute__((aligned(64)));
+};
+
+struct com_shm_ctrl {
+    uint32_t ring_size;
+    struct com_ring req;
+    struct com_ring res;
+};
+
+struct com_chan {
+    char *base;
+    size_t map_size;
+    uint32_t ring_size;
+    struct com_ring *rx;
+    struct com_ring *tx;
+    char *rx_data;
+    char *tx_data;
+    pid_t peer;
+};
+
+int com_chan_create(struct com_chan *ch, const char *name, uint32_t ring_size);
+int com_chan_attach(struct com_chan *ch, const char *name, pid_t peer);
+void com_chan_close(struct com_chan *ch);
+
+size_t com_chan_pending(struct com_chan *ch);
+int com_chan_wait(struct com_chan *ch, int timeout_ms);
+ssize_t com_chan_read(struct com_chan *ch, void *buf, size_t len);
+char* com_chan_reserve(struct com_chan *ch, size_t len);
+void com_chan_commit(struct com_chan *ch, size_t len);
+ssize_t com_chan_write(struct com_chan *ch, const void *data, size_t len);
+
+int com_rings_advertise(const char *mq_name, pid_t pid);
+pid_t com_rings_server(const char *mq_name);
+
+#endif
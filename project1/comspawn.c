@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include "comspawn.h"
+
+extern char **environ;
+
+struct path_entry {
+    char name[NAME_MAX + 1];
+    char path[PATH_MAX];
+};
+struct path_entry pathCache[SPAWN_PATH_CACHE];
+int pathCacheCount = 0;
+int pathCacheNext = 0;
+// the PATH the cached paths were found on
+char *pathCacheKey = NULL;
+// file actions of spawn_command by output descriptor, kept because
+// setting them up allocates
+struct actions_entry {
+    int fd;
+    posix_spawn_file_actions_t actions;
+};
+struct actions_entry actionsCache[SPAWN_ACTIONS_CACHE];
+int actionsCacheCount = 0;
+int actionsCacheNext = 0;
+
+/**
+ * @brief
+ *
+ * @param cmd
+ * @return int 1 if cmd uses anything only the shell understands
+ */
+static int needs_shell(const char *cmd) {
+    return strpbrk(cmd, "|&;<>()$`\\\"'*?[]{}~#=%!\n") != NULL;
+}
+
+// words sh runs itself even when a program of the same name is on PATH,
+// which may behave differently (echo -e, printf, test, kill, ...) or, like
+// cd, is no use in a process of its own
+static const char *shellBuiltins[] = {
+    ".", ":", "alias", "bg", "break", "cd", "command", "continue", "echo", "eval", "exec", "exit",
+    "export", "false", "fc", "fg", "getopts", "hash", "jobs", "kill", "local", "printf", "pwd",
+    "read", "readonly", "return", "set", "shift", "test", "times", "trap", "true", "type",
+    "ulimit", "umask", "unalias", "unset", "wait",
+};
+
+/**
+ * @brief
+ *
+ * @param name
+ * @return int 1 if sh has a builtin called name
+ */
+static int shell_builtin(const char *name) {
+    for (size_t i = 0; i < sizeof(shellBuiltins) / sizeof(shellBuiltins[0]); i++) {
+        if (strcmp(name, shellBuiltins[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Split a plain command line into words.
+ *
+ * @param cmd
+ * @param words receives the words, NUL separated
+ * @param size size of words
+ * @param argv at least SPAWN_MAX_ARGS + 1 entries, NULL terminated
+ * @return int number of words, 0 if the command needs the shell
+ */
+int split_command(const char *cmd, char *words, size_t size, char **argv) {
+    if (needs_shell(cmd) || strlen(cmd) >= size) {
+        return 0;
+    }
+    strcpy(words, cmd);
+    int argc = 0;
+    char *save;
+    for (char *word = strtok_r(words, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save)) {
+        if (argc == SPAWN_MAX_ARGS) {
+            return 0;
+        }
+        argv[argc++] = word;
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+/**
+ * @brief Find an executable on PATH, using the cache first. The cache is
+ * emptied whenever PATH has changed since it was filled.
+ *
+ * @param name program name without a slash
+ * @return const char* full path, or NULL if it is not on PATH
+ */
+static const char* resolve_path(const char *name) {
+    if (strlen(name) > NAME_MAX) {
+        return NULL;
+    }
+    const char *dirs = getenv("PATH");
+    if (dirs == NULL) {
+        dirs = "/usr/bin:/bin";
+    }
+    if (pathCacheKey == NULL || strcmp(pathCacheKey, dirs) != 0) {
+        free(pathCacheKey);
+        pathCacheKey = strdup(dirs);
+        pathCacheCount = 0;
+        pathCacheNext = 0;
+    }
+    for (int i = 0; i < pathCacheCount; i++) {
+        if (strcmp(pathCache[i].name, name) == 0) {
+            return pathCache[i].path;
+        }
+    }
+    char candidate[PATH_MAX];
+    while (*dirs != '\0') {
+        size_t len = strcspn(dirs, ":");
+        if (len > 0 && snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)len, dirs, name) < (int)sizeof(candidate)
+            && access(candidate, X_OK) == 0) {
+            struct path_entry *entry = &pathCache[pathCacheNext];
+            pathCacheNext = (pathCacheNext + 1) % SPAWN_PATH_CACHE;
+            if (pathCacheCount < SPAWN_PATH_CACHE) {
+                pathCacheCount++;
+            }
+            strcpy(entry->name, name);
+            strcpy(entry->path, candidate);
+            return entry->path;
+        }
+        dirs += len;
+        if (*dirs == ':') {
+            dirs++;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Drop a cached path that no longer works, e.g. after the program
+ * was moved or removed.
+ *
+ * @param name
+ */
+static void forget_path(const char *name) {
+    for (int i = 0; i < pathCacheCount; i++) {
+        if (strcmp(pathCache[i].name, name) == 0) {
+            pathCache[i].name[0] = '\0';
+        }
+    }
+}
+
+/**
+ * @brief File actions that make outFd a command's stdout, from the cache
+ * if possible.
+ *
+ * @param outFd
+ * @return posix_spawn_file_actions_t*
+ */
+static posix_spawn_file_actions_t* command_actions(int outFd) {
+    for (int i = 0; i < actionsCacheCount; i++) {
+        if (actionsCache[i].fd == outFd) {
+            return &actionsCache[i].actions;
+        }
+    }
+    struct actions_entry *entry = &actionsCache[actionsCacheNext];
+    actionsCacheNext = (actionsCacheNext + 1) % SPAWN_ACTIONS_CACHE;
+    if (actionsCacheCount < SPAWN_ACTIONS_CACHE) {
+        actionsCacheCount++;
+    } else {
+        posix_spawn_file_actions_destroy(&entry->actions);
+    }
+    entry->fd = outFd;
+    posix_spawn_file_actions_init(&entry->actions);
+    posix_spawn_file_actions_adddup2(&entry->actions, outFd, STDOUT_FILENO);
+    return &entry->actions;
+}
+
+/**
+ * @brief Set up what every process the server starts gets: default
+ * SIGPIPE handling.
+ *
+ * @param attr
+ * @param flags extra POSIX_SPAWN_ flags
+ */
+static void spawn_prepare(posix_spawnattr_t *attr, short flags) {
+    sigset_t defaults;
+    // the server may ignore SIGPIPE, commands should not
+    posix_spawnattr_init(attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(attr, &defaults);
+    posix_spawnattr_setflags(attr, POSIX_SPAWN_SETSIGDEF | flags);
+}
+
+/**
+ * @brief Start cmd with its stdout on outFd.
+ *
+ * @param cmd command line
+ * @param outFd becomes the command's stdout; the caller should have every
+ * other descriptor the command must not inherit marked close-on-exec
+ * @return pid_t pid of the command, -1 with errno set on error
+ */
+pid_t spawn_command(const char *cmd, int outFd) {
+    posix_spawn_file_actions_t *actions = command_actions(outFd);
+    posix_spawnattr_t attr;
+    spawn_prepare(&attr, 0);
+
+    pid_t pid = -1;
+    int err = ENOENT;
+    char words[PATH_MAX];
+    char *argv[SPAWN_MAX_ARGS + 1];
+    int argc = split_command(cmd, words, sizeof(words), argv);
+    if (argc > 0 && !shell_builtin(argv[0])) {
+        int onPath = strchr(argv[0], '/') == NULL;
+        const char *path = onPath ? resolve_path(argv[0]) : argv[0];
+        if (path != NULL) {
+            err = posix_spawn(&pid, path, actions, &attr, argv, environ);
+        }
+        // the cached path may be stale: look the program up once more
+        if (onPath && path != NULL && (err == ENOENT || err == EACCES)) {
+            forget_path(argv[0]);
+            path = resolve_path(argv[0]);
+            if (path != NULL) {
+                err = posix_spawn(&pid, path, actions, &attr, argv, environ);
+            }
+        }
+    }
+    // not a plain program on PATH: a shell builtin, a missing program, or
+    // something that needs the shell to interpret it
+    if (err != 0) {
+        char *shArgv[] = { "sh", "-c", (char *)cmd, NULL };
+        err = posix_spawn(&pid, "/bin/sh", actions, &attr, shArgv, environ);
+    }
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * @brief Start a shell that reads commands from inFd, in a process group
+ * of its own so that it can be stopped together with whatever it runs.
+ *
+ * @param inFd becomes the shell's stdin
+ * @param outFd becomes the shell's stdout
+ * @return pid_t pid of the shell, -1 with errno set on error
+ */
+pid_t spawn_shell(int inFd, int outFd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+    spawn_prepare(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    pid_t pid;
+    char *shArgv[] = { "sh", "-s", NULL };
+    int err = posix_spawn(&pid, "/bin/sh", &actions, &attr, shArgv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
@@ -0,0 +1,27 @@
+#ifndef _COMSPAWN_H_
+#define _COMSPAWN_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Command launcher. Commands are started with posix_spawn(), which does
+// not copy the server's address space the way fork() does. A command
+// made only of plain words is run directly; anything that needs the
+// shell (quoting, redirection, pipes, variables, globbing) or starts with
+// a word sh has a builtin for is run through sh -c as before, so echo,
+// printf, test and the like keep the shell's behaviour. Program paths
+// found on PATH are cached per process for the PATH they were found on,
+// and looked up again if the cached one fails to run.
+
+#define SPAWN_MAX_ARGS 64
+// commands with more words than this go through the shell
+
+#define SPAWN_PATH_CACHE 64
+#define SPAWN_ACTIONS_CACHE 16
+// output descriptors whose spawn file actions are kept
+
+int split_command(const char *cmd, char *words, size_t size, char **argv);
+pid_t spawn_command(const char *cmd, int outFd);
+pid_t spawn_shell(int inFd, int outFd);
+
+#endif
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "comstats.h"
+
+struct com_stats *stats = NULL;
+
+/**
+ * @brief Monotonic clock in nanoseconds.
+ *
+ * @return uint64_t
+ */
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Map the counters. Must run before any server process is forked.
+ */
+void stats_init() {
+    stats = mmap(NULL, sizeof(struct com_stats), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    memset(stats, 0, sizeof(struct com_stats));
+    stats->startNs = now_ns();
+}
+
+/**
+ * @brief
+ *
+ * @return int number of clients connected now
+ */
+int stats_client_connected() {
+    __atomic_add_fetch(&stats->connections, 1, __ATOMIC_RELAXED);
+    return __atomic_add_fetch(&stats->activeClients, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief
+ *
+ * @return int number of clients connected now
+ */
+int stats_client_disconnected() {
+    return __atomic_sub_fetch(&stats->activeClients, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Record how long it took to start a command process.
+ *
+ * @param ns
+ */
+void stats_spawn(uint64_t ns) {
+    __atomic_add_fetch(&stats->spawnNs, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->spawns, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Record a finished command: its latency from receipt to the end of
+ * its result, and the result size. The per-second slot is recycled by the
+ * first process to see a new second; an increment racing with that reset
+ * may be lost, which only makes the rate approximate.
+ *
+ * @param latencyNs
+ * @param bytes
+ */
+void stats_command_done(uint64_t latencyNs, uint64_t bytes) {
+    __atomic_add_fetch(&stats->commands, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->bytesOut, bytes, __ATOMIC_RELAXED);
+    uint64_t us = latencyNs / 1000;
+    int bucket = 0;
+    while (bucket < STATS_HIST_BUCKETS - 1 && us >= (1ull << bucket)) {
+        bucket++;
+    }
+    __atomic_add_fetch(&stats->latency[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t second = now_ns() / 1000000000ull;
+    struct stats_second *slot = &stats->rate[second % (STATS_RATE_WINDOW + 1)];
+    uint64_t seen = __atomic_load_n(&slot->second, __ATOMIC_RELAXED);
+    if (seen != second && __atomic_compare_exchange_n(&slot->second, &seen, second, 0,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&slot->count, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Record how many connection requests an acceptor found waiting in
+ * its queue, and whether the queue was full so that clients had to wait.
+ *
+ * @param waiting
+ * @param full
+ */
+void stats_queue_depth(uint64_t waiting, int full) {
+    uint64_t peak = __atomic_load_n(&stats->queuePeak, __ATOMIC_RELAXED);
+    while (waiting > peak && !__atomic_compare_exchange_n(&stats->queuePeak, &peak, waiting, 0,
+                                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    if (full) {
+        __atomic_add_fetch(&stats->queueFull, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Count a command that had to wait for an execution slot.
+ */
+void stats_command_queued() {
+    __atomic_add_fetch(&stats->commandsQueued, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Count a command turned away with a BUSY reply.
+ */
+void stats_command_busy() {
+    __atomic_add_fetch(&stats->commandsBusy, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Render a snapshot as "name value" lines.
+ *
+ * @param buf
+ * @param len
+ * @return size_t length of the text, without the terminating NUL
+ */
+size_t stats_format(char *buf, size_t len) {
+    uint64_t now = now_ns();
+    uint64_t second = now / 1000000000ull;
+    uint64_t recent = 0;
+    for (int i = 0; i < STATS_RATE_WINDOW + 1; i++) {
+        uint64_t slotSecond = __atomic_load_n(&stats->rate[i].second, __ATOMIC_RELAXED);
+        if (slotSecond < second && slotSecond + STATS_RATE_WINDOW >= second) {
+            recent += __atomic_load_n(&stats->rate[i].count, __ATOMIC_RELAXED);
+        }
+    }
+    uint64_t spawns = __atomic_load_n(&stats->spawns, __ATOMIC_RELAXED);
+    uint64_t spawnNs = __atomic_load_n(&stats->spawnNs, __ATOMIC_RELAXED);
+    size_t used = snprintf(buf, len,
+        "uptime_s %llu\n"
+        "active_clients %lld\n"
+        "connections %llu\n"
+        "commands %llu\n"
+        "commands_per_sec %.1f\n"
+        "bytes_out %llu\n"
+        "spawn_avg_us %llu\n"
+        "cache_hits %llu\n"
+        "cache_misses %llu\n"
+        "queue_peak %llu\n"
+        "queue_full %llu\n"
+        "commands_queued %llu\n"
+        "commands_busy %llu\n"
+        "latency_us_hist",
+        (unsigned long long)((now - stats->startNs) / 1000000000ull),
+        (long long)__atomic_load_n(&stats->activeClients, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&stats->connections, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&stats->commands, __ATOMIC_RELAXED),
+        (double)recent / STATS_RATE_WINDOW,
+        (unsigned long long)__atomic_load_n(&stats->bytesOut, __ATOMIC_RELAXED),
+        (unsigned long long)(spawns ? spawnNs / spawns / 1000 : 0),
+        (unsigned long long)__atomic_load_n(&stats->cacheHits, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&stats->cacheMisses, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&stats->queuePeak, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&stats->queueFull, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&stats->commandsQueued, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&stats->commandsBusy, __ATOMIC_RELAXED));
+    for (int i = 0; i < STATS_HIST_BUCKETS && used < len; i++) {
+        uint64_t count = __atomic_load_n(&stats->latency[i], __ATOMIC_RELAXED);
+        if (count > 0 && i == STATS_HIST_BUCKETS - 1) {
+            used += snprintf(buf + used, len - used, " inf:%llu", (unsigned long long)count);
+        } else if (count > 0) {
+            used += snprintf(buf + used, len - used, " <%llu:%llu",
+                             (unsigned long long)(1ull << i), (unsigned long long)count);
+        }
+    }
+    if (used < len) {
+        used += snprintf(buf + used, len - used, "\n");
+    }
+    return used < len ? used : len - 1;
+}
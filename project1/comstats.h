@@ -0,0 +1,53 @@
+#ifndef _COMSTATS_H_
+#define _COMSTATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Live server counters. They sit in one shared anonymous mapping created
+// by the main process before it forks, and every server process updates
+// them with atomic operations.
+
+#define STATS_HIST_BUCKETS 24
+// command latency histogram, bucket i counts latencies below 2^i us
+
+#define STATS_RATE_WINDOW 10
+// commands/sec is averaged over this many completed seconds
+
+struct stats_second {
+    uint64_t second;
+    uint64_t count;
+};
+
+struct com_stats {
+    uint64_t startNs;
+    int64_t activeClients;
+    uint64_t connections;
+    uint64_t commands;
+    uint64_t bytesOut;
+    uint64_t spawnNs;
+    uint64_t spawns;
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+    uint64_t queuePeak;
+    uint64_t queueFull;
+    uint64_t commandsQueued;
+    uint64_t commandsBusy;
+    uint64_t latency[STATS_HIST_BUCKETS];
+    struct stats_second rate[STATS_RATE_WINDOW + 1];
+};
+
+extern struct com_stats *stats;
+
+uint64_t now_ns();
+void stats_init();
+int stats_client_connected();
+int stats_client_disconnected();
+void stats_spawn(uint64_t ns);
+void stats_command_done(uint64_t latencyNs, uint64_t bytes);
+void stats_queue_depth(uint64_t waiting, int full);
+void stats_command_queued();
+void stats_command_busy();
+size_t stats_format(char *buf, size_t len);
+
+#endif
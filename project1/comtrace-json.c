@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "comtrace.h"
+/*
+ * Converts a trace file written by comserver -t into the Chrome trace
+ * event format. Every record becomes a complete ("X") event: the process
+ * is the server process that recorded it, the thread is the client it
+ * worked for, and times are in microseconds since the first record.
+ */
+#define CONVERT_USAGE "Usage: %s TRACEFILE [JSONFILE]\n"
+
+const char *stageNames[TRACE_STAGES] = TRACE_STAGE_NAMES;
+
+/**
+ * @brief
+ *
+ * @param argc
+ * @param argv
+ * @return int
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, CONVERT_USAGE, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        perror("Error when opening trace file");
+        exit(EXIT_FAILURE);
+    }
+    struct trace_header header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRACE_VERSION || header.recordSize != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s is not a trace file of this version\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    FILE *out = stdout;
+    if (argc == 3 && (out = fopen(argv[2], "w")) == NULL) {
+        perror("Error when opening output file");
+        exit(EXIT_FAILURE);
+    }
+    // processes append whole rings, so records are only ordered per process
+    struct trace_record record;
+    uint64_t firstNs = UINT64_MAX;
+    long count = 0;
+    while (fread(&record, sizeof(record), 1, in) == 1) {
+        if (record.startNs < firstNs) {
+            firstNs = record.startNs;
+        }
+        count++;
+    }
+    fseek(in, sizeof(header), SEEK_SET);
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    const char *separator = "\n";
+    while (fread(&record, sizeof(record), 1, in) == 1) {
+        const char *name = record.stage < TRACE_STAGES ? stageNames[record.stage] : "unknown";
+        fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"seq\":%u,\"bytes\":%llu}}",
+                separator, name, record.pid, record.client,
+                (record.startNs - firstNs) / 1000.0, (record.endNs - record.startNs) / 1000.0,
+                record.seq, (unsigned long long)record.bytes);
+        separator = ",\n";
+    }
+    fprintf(out, "\n]}\n");
+    fclose(in);
+    if (out != stdout) {
+        fclose(out);
+    }
+    fprintf(stderr, "%ld events\n", count);
+    return 0;
+}
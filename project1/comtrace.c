@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "comtrace.h"
+
+int traceOn = 0;
+int traceFd = -1;
+struct trace_record traceRing[TRACE_RING];
+int traceCount = 0;
+uint64_t traceFlushedNs = 0;
+pid_t tracePid = 0;
+
+/**
+ * @brief Create TRACEFILE and turn tracing on. Must run before any server
+ * process is forked; they all append to the same file.
+ *
+ * @param path
+ */
+void trace_init(const char *path) {
+    traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (traceFd == -1) {
+        perror("Error when opening trace file");
+        exit(EXIT_FAILURE);
+    }
+    struct trace_header header = { .version = TRACE_VERSION, .recordSize = sizeof(struct trace_record) };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    if (write(traceFd, &header, sizeof(header)) != sizeof(header)) {
+        perror("Error when writing trace file");
+        exit(EXIT_FAILURE);
+    }
+    traceOn = 1;
+    tracePid = getpid();
+    traceFlushedNs = now_ns();
+    atexit(trace_flush);
+}
+
+/**
+ * @brief Drop the records a child inherited from its parent, which the
+ * parent still writes out itself.
+ */
+void trace_forked() {
+    traceCount = 0;
+    tracePid = getpid();
+    traceFlushedNs = now_ns();
+}
+
+/**
+ * @brief Record a stage that ends now.
+ *
+ * @param stage one of the TRACE_ stages
+ * @param client pid of the client, 0 if not known yet
+ * @param seq command sequence number, 0 outside a command
+ * @param startNs from TRACE_START()
+ * @param bytes data moved in the stage, if any
+ */
+void trace_record(int stage, pid_t client, uint32_t seq, uint64_t startNs, uint64_t bytes) {
+    struct trace_record *record = &traceRing[traceCount++];
+    record->startNs = startNs;
+    record->endNs = now_ns();
+    record->bytes = bytes;
+    record->pid = tracePid;
+    record->client = client;
+    record->seq = seq;
+    record->stage = stage;
+    if (traceCount == TRACE_RING || record->endNs - traceFlushedNs >= TRACE_FLUSH_INTERVAL_NS) {
+        trace_flush();
+    }
+}
+
+/**
+ * @brief Write out records that have waited for a second or more. For
+ * loops that may sit idle with records in the ring.
+ */
+void trace_tick() {
+    if (traceOn && traceCount > 0 && now_ns() - traceFlushedNs >= TRACE_FLUSH_INTERVAL_NS) {
+        trace_flush();
+    }
+}
+
+/**
+ * @brief Append the ring to the trace file. O_APPEND keeps the writes of
+ * different processes from overlapping.
+ */
+void trace_flush() {
+    if (!traceOn || traceCount == 0) {
+        return;
+    }
+    size_t len = traceCount * sizeof(struct trace_record);
+    ssize_t n;
+    do {
+        n = write(traceFd, traceRing, len);
+    } while (n == -1 && errno == EINTR);
+    if (n != (ssize_t)len) {
+        perror("Error when writing trace file");
+    }
+    traceCount = 0;
+    traceFlushedNs = now_ns();
+}
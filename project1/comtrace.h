@@ -0,0 +1,67 @@
+#ifndef _COMTRACE_H_
+#define _COMTRACE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "comstats.h"
+
+// Per-request stage tracing. Started with -t TRACEFILE the server notes,
+// for every connection and command, when each stage began and ended on
+// the monotonic clock. Each process collects its records in a ring of its
+// own and appends the ring to TRACEFILE with a single write() when it is
+// full, at least once a second while records are coming in, when a client
+// session ends and when the process exits. comtrace-json turns the file
+// into Chrome trace events, which chrome://tracing and Perfetto can show.
+//
+// With tracing off a trace point is one test of traceOn.
+
+#define TRACE_MAGIC "COMTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RING 4096
+#define TRACE_FLUSH_INTERVAL_NS 1000000000ull
+
+// stages
+#define TRACE_ACCEPT 0   // mq_receive of a connection request
+#define TRACE_DISPATCH 1 // fork, or hand-off to a pool worker
+#define TRACE_OPEN 2     // opening the client FIFOs and replying
+#define TRACE_REQUEST 3  // a command from arrival to its last frame
+#define TRACE_SLOT 4     // waiting for an execution slot
+#define TRACE_SPAWN 5    // starting the command process
+#define TRACE_READ 6     // reading command output
+#define TRACE_WRITE 7    // writing a frame to the client
+#define TRACE_CREDIT 8   // waiting for the client to grant credit
+#define TRACE_STAGES 9
+
+#define TRACE_STAGE_NAMES { "accept", "dispatch", "open", "request", "slot", \
+                            "spawn", "read", "write", "credit" }
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+};
+
+struct trace_record {
+    uint64_t startNs;
+    uint64_t endNs;
+    uint64_t bytes;
+    int32_t pid;
+    int32_t client;
+    uint32_t seq;
+    uint32_t stage;
+};
+
+extern int traceOn;
+
+// start of a stage, 0 when tracing is off
+#define TRACE_START() (traceOn ? now_ns() : 0)
+#define TRACE(stage, client, seq, startNs, bytes) \
+    do { if (traceOn) trace_record((stage), (client), (seq), (startNs), (bytes)); } while (0)
+
+void trace_init(const char *path);
+void trace_forked();
+void trace_record(int stage, pid_t client, uint32_t seq, uint64_t startNs, uint64_t bytes);
+void trace_tick();
+void trace_flush();
+
+#endif
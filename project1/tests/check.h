@@ -0,0 +1,31 @@
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <stdio.h>
+
+// Helpers for the unit tests run by make check. CHECK reports a failed
+// condition and carries on, so one run shows every failure; a test
+// program ends with return check_result(argv[0]).
+
+static int checkFailures = 0;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            checkFailures++;                                                \
+        }                                                                   \
+    } while (0)
+
+/**
+ * @brief
+ *
+ * @param name test program
+ * @return int exit status for main
+ */
+static inline int check_result(const char *name) {
+    printf("%s: %s\n", name, checkFailures == 0 ? "ok" : "FAILED");
+    return checkFailures == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,127 @@
+#!/bin/sh
+# Client/server smoke test for make check: starts the server in several
+# modes and runs a batch of commands through the client against each,
+# over the FIFOs, the Unix socket and the shared memory rings.
+
+bin=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d /tmp/comsmoke.XXXXXX)
+mq=/smoke_$$
+server_pid=
+failures=0
+
+cleanup() {
+    stop_server
+    rm -rf "$work"
+    rm -f /dev/shm/comshm_rings_smoke_$$
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# start_server ARGS...: start the server and wait until it takes clients
+start_server() {
+    "$bin/server" "$mq" "$@" > "$work/server.log" 2>&1 &
+    server_pid=$!
+    for i in $(seq 50); do
+        grep -q "waiting for connections" "$work/server.log" 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "server $* did not start:" >&2
+    cat "$work/server.log" >&2
+    return 1
+}
+
+stop_server() {
+    if [ -n "$server_pid" ]; then
+        kill "$server_pid" 2>/dev/null
+        wait "$server_pid" 2>/dev/null
+        server_pid=
+    fi
+}
+
+# expect NAME FILE LINE...: every LINE must be a line of FILE
+expect() {
+    name=$1
+    file=$2
+    shift 2
+    for line in "$@"; do
+        if ! grep -qxF -- "$line" "$file"; then
+            echo "$name: missing output line '$line'" >&2
+            sed 's/^/    /' "$file" >&2
+            failures=$((failures + 1))
+            return 1
+        fi
+    done
+}
+
+# run NAME SERVERARGS -- CLIENTARGS: run the batch through one setup
+run() {
+    name=$1
+    shift
+    server_args=
+    while [ "$1" != "--" ]; do
+        server_args="$server_args $1"
+        shift
+    done
+    shift
+    if ! start_server $server_args; then
+        failures=$((failures + 1))
+        return
+    fi
+    (cd "$work" && timeout 20 "$bin/client" "$mq" "$@" -b "$work/batch" > "$work/$name.out" 2>&1)
+    status=$?
+    if [ $status -ne 0 ]; then
+        echo "$name: client exited with status $status" >&2
+        failures=$((failures + 1))
+    fi
+    expect "$name" "$work/$name.out" hello spawned 3 one two
+    stop_server
+    echo "smoke $name: done"
+}
+
+cat > "$work/batch" <<'BATCH'
+echo hello
+/bin/echo spawned
+seq 3 | tail -n 1
+printf 'one\ntwo\n'
+BATCH
+
+cd "$work" || exit 1
+run fifo --
+run socket -u "$work/sock" -- -u "$work/sock"
+run rings -r --
+# a client on the rings alone names no FIFOs
+if ! grep -q "cs= , sc= ," "$work/server.log"; then
+    echo "rings: the client did not connect over the rings alone" >&2
+    failures=$((failures + 1))
+fi
+run client-rings -- -r
+run event-loop -e --
+run event-loop-socket -e -u "$work/sock" -- -u "$work/sock"
+run concurrent -- -k 4
+run pool -m 2 -M 4 -x 2 -- -k 4
+run compressed -- -z
+
+# -k 4 runs the four sleeps at once
+cat > "$work/batch" <<'BATCH'
+sleep 1; echo a
+sleep 1; echo b
+sleep 1; echo c
+sleep 1; echo d
+BATCH
+start_server || exit 1
+start=$(date +%s)
+timeout 20 "$bin/client" "$mq" -k 4 -b "$work/batch" > "$work/parallel.out" 2>&1
+elapsed=$(($(date +%s) - start))
+stop_server
+expect parallel "$work/parallel.out" a b c d
+if [ $elapsed -ge 4 ]; then
+    echo "parallel: -k 4 took ${elapsed}s, the commands ran one at a time" >&2
+    failures=$((failures + 1))
+fi
+echo "smoke parallel: done"
+
+if [ $failures -ne 0 ]; then
+    echo "smoke: $failures failures" >&2
+    exit 1
+fi
+echo "smoke: ok"
@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../comcache.h"
+#include "../comstats.h"
+#include "check.h"
+
+extern struct cache_entry *cacheEntries;
+
+char rulesPath[] = "/tmp/comcache_rulesXXXXXX";
+char watchedPath[] = "/tmp/comcache_fileXXXXXX";
+char buf[CACHE_MAX_RESULT];
+
+/**
+ * @brief Store a result for rule the way the server does.
+ *
+ * @param rule
+ * @param text
+ */
+static void store(int rule, const char *text) {
+    struct cache_stamp stamp;
+    cache_begin(rule, &stamp);
+    cache_store(rule, &stamp, text, strlen(text));
+}
+
+/**
+ * @brief
+ *
+ * @param rule
+ * @param text
+ * @return int 1 if the cache holds text for rule
+ */
+static int holds(int rule, const char *text) {
+    ssize_t len = cache_get(rule, buf);
+    return len == (ssize_t)strlen(text) && memcmp(buf, text, len) == 0;
+}
+
+/**
+ * @brief Only listed commands have a rule, and nothing is cached before
+ * it is stored.
+ */
+static void test_rules() {
+    CHECK(cache_rule_for("ls -l") == 0);
+    CHECK(cache_rule_for("cat notes") == 1);
+    CHECK(cache_rule_for("date") == 2);
+    CHECK(cache_rule_for("ls") == -1);
+    CHECK(cache_rule_for("ls -l ") == -1);
+    CHECK(cache_get(0, buf) == -1);
+    CHECK(stats->cacheMisses == 1);
+}
+
+/**
+ * @brief A result is served until its TTL has passed.
+ */
+static void test_ttl() {
+    store(0, "listing\n");
+    CHECK(holds(0, "listing\n"));
+    // as if it had been stored 5 seconds ago, past the 2 second TTL
+    cacheEntries[0].storedNs -= 5000000000ull;
+    CHECK(cache_get(0, buf) == -1);
+    store(2, "forever\n");
+    cacheEntries[2].storedNs -= 86400000000000ull;
+    CHECK(holds(2, "forever\n"));
+}
+
+/**
+ * @brief A result is dropped once a watched file changes, also when it
+ * changed while the command ran.
+ */
+static void test_files() {
+    store(1, "notes\n");
+    CHECK(holds(1, "notes\n"));
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { 1000, 0 } };
+    CHECK(utimensat(AT_FDCWD, watchedPath, times, 0) == 0);
+    CHECK(cache_get(1, buf) == -1);
+
+    struct cache_stamp stamp;
+    cache_begin(1, &stamp);
+    times[1].tv_sec = 2000;
+    CHECK(utimensat(AT_FDCWD, watchedPath, times, 0) == 0);
+    cache_store(1, &stamp, "stale\n", 6);
+    CHECK(cache_get(1, buf) == -1);
+    store(1, "fresh\n");
+    CHECK(holds(1, "fresh\n"));
+
+    unlink(watchedPath);
+    CHECK(cache_get(1, buf) == -1);
+}
+
+/**
+ * @brief An entry whose lock holder died is dropped, and can be stored
+ * again.
+ */
+static void test_dead_owner() {
+    store(2, "before\n");
+    pid_t pid = fork();
+    if (pid == 0) {
+        pthread_mutex_lock(&cacheEntries[2].lock);
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    alarm(5);
+    CHECK(cache_get(2, buf) == -1);
+    store(2, "after\n");
+    CHECK(holds(2, "after\n"));
+    alarm(0);
+}
+
+int main(int argc, char *argv[]) {
+    int fd = mkstemp(watchedPath);
+    close(fd);
+    FILE *rules = fdopen(mkstemp(rulesPath), "w");
+    fprintf(rules, "# test rules\n\n2 ls -l\n0 @%s cat notes\n0 date\n", watchedPath);
+    fclose(rules);
+    stats_init();
+    CHECK(cache_load(rulesPath) == 0);
+    unlink(rulesPath);
+    test_rules();
+    test_ttl();
+    test_files();
+    test_dead_owner();
+    return check_result(argv[0]);
+}
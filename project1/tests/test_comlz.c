@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include "../comlz.h"
+#include "check.h"
+
+/**
+ * @brief Compress and decompress len bytes of src and compare.
+ *
+ * @param src
+ * @param len
+ * @return size_t compressed size, 0 if it did not fit
+ */
+static size_t round_trip(const char *src, size_t len) {
+    size_t cap = COM_LZ_BOUND(len);
+    char *packed = malloc(cap);
+    char *out = malloc(len + 1);
+    size_t n = lz_compress(src, len, packed, cap);
+    CHECK(n > 0);
+    if (n > 0) {
+        CHECK(lz_decompress(packed, n, out, len) == (ssize_t)len);
+        CHECK(memcmp(out, src, len) == 0);
+        // the block does not decode into less room than it needs
+        if (len > 0) {
+            CHECK(lz_decompress(packed, n, out, len - 1) == -1);
+        }
+    }
+    free(packed);
+    free(out);
+    return n;
+}
+
+/**
+ * @brief Text, runs, overlapping matches and random bytes all come back
+ * unchanged, and repetitive input gets smaller.
+ */
+static void test_round_trips() {
+    size_t len = COM_MAX_WSIZE;
+    char *buf = malloc(len);
+
+    round_trip("a", 1);
+    round_trip("abcd", 4);
+
+    memset(buf, 'x', len);
+    CHECK(round_trip(buf, len) < len / 100);
+
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = "drwxr-xr-x 2 root root 4096 file\n"[i % 33];
+    }
+    CHECK(round_trip(buf, len) < len / 10);
+
+    // a match that starts one byte back and overlaps what it produces
+    memcpy(buf, "ab", 2);
+    memset(buf + 2, 'b', 300);
+    round_trip(buf, 302);
+
+    srand(1);
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = rand();
+    }
+    round_trip(buf, len);
+    for (size_t size = 1; size < 2000; size += 37) {
+        round_trip(buf, size);
+    }
+    free(buf);
+}
+
+/**
+ * @brief A frame payload is packed only when that pays off, and unpacks to
+ * the original output.
+ */
+static void test_frames() {
+    char payload[COM_MAX_WSIZE];
+    char scratch[COM_LZ_SCRATCH];
+    char out[COM_MAX_WSIZE];
+
+    size_t len = COM_LZ_THRESHOLD - 1;
+    memset(payload, 'y', len);
+    CHECK(com_lz_pack(payload, &len, scratch) == 0 && len == COM_LZ_THRESHOLD - 1);
+
+    len = 4096;
+    for (size_t i = 0; i < len; i++) {
+        payload[i] = "hello world\n"[i % 12];
+    }
+    CHECK(com_lz_pack(payload, &len, scratch) == 1 && len < 4096);
+    CHECK(com_lz_unpack(payload, len, out, sizeof(out)) == 4096);
+    for (size_t i = 0; i < 4096; i++) {
+        if (out[i] != "hello world\n"[i % 12]) {
+            CHECK(out[i] == "hello world\n"[i % 12]);
+            break;
+        }
+    }
+    // a declared length that does not match what the block decodes to
+    uint32_t wrong = 4095;
+    memcpy(payload, &wrong, sizeof(wrong));
+    CHECK(com_lz_unpack(payload, len, out, sizeof(out)) == -1);
+    CHECK(com_lz_unpack(payload, 2, out, sizeof(out)) == -1);
+
+    srand(2);
+    len = 4096;
+    for (size_t i = 0; i < len; i++) {
+        payload[i] = rand();
+    }
+    CHECK(com_lz_pack(payload, &len, scratch) == 0 && len == 4096);
+}
+
+/**
+ * @brief Garbage is refused instead of being decoded out of bounds.
+ */
+static void test_corrupt() {
+    char out[256];
+    // a match before the start of the output
+    const char back[] = { 0x10, 'a', 0x05, 0x00 };
+    CHECK(lz_decompress(back, sizeof(back), out, sizeof(out)) == -1);
+    // more literals announced than there are
+    const char shortLiterals[] = { 0x50, 'a', 'b' };
+    CHECK(lz_decompress(shortLiterals, sizeof(shortLiterals), out, sizeof(out)) == -1);
+    // a length continuation cut off
+    const char cut[] = { (char)0xf0 };
+    CHECK(lz_decompress(cut, sizeof(cut), out, sizeof(out)) == -1);
+    const char offsetZero[] = { 0x10, 'a', 0x00, 0x00 };
+    CHECK(lz_decompress(offsetZero, sizeof(offsetZero), out, sizeof(out)) == -1);
+}
+
+int main(int argc, char *argv[]) {
+    test_round_trips();
+    test_frames();
+    test_corrupt();
+    return check_result(argv[0]);
+}
@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../comproto.h"
+#include "check.h"
+
+/**
+ * @brief Append one message to buf.
+ *
+ * @param buf
+ * @param type
+ * @param flags
+ * @param seq
+ * @param data
+ * @param len
+ * @return size_t bytes appended
+ */
+static size_t put_msg(char *buf, int type, int flags, uint32_t seq, const void *data, size_t len) {
+    com_encode_hdr(buf, type, flags, seq, len);
+    memcpy(buf + COM_HDR_SIZE, data, len);
+    return COM_HDR_SIZE + len;
+}
+
+/**
+ * @brief A header decodes to what was encoded, and one with a wrong
+ * version or an oversized payload is refused.
+ */
+static void test_header() {
+    char raw[COM_HDR_SIZE];
+    struct com_hdr hdr;
+    com_encode_hdr(raw, COMMAND_RES, COM_F_LAST | COM_F_LZ, 0xdeadbeef, 1234);
+    CHECK(com_decode_hdr(raw, &hdr) == 0);
+    CHECK(hdr.type == COMMAND_RES);
+    CHECK(hdr.flags == (COM_F_LAST | COM_F_LZ));
+    CHECK(hdr.seq == 0xdeadbeef);
+    CHECK(hdr.len == 1234);
+    CHECK(hdr.version == COM_PROTO_VERSION);
+
+    com_encode_hdr(raw, SEND_COMMAND, 0, 1, COM_MAX_PAYLOAD + 1);
+    CHECK(com_decode_hdr(raw, &hdr) == -1);
+    com_encode_hdr(raw, SEND_COMMAND, 0, 1, 0);
+    raw[4] = COM_PROTO_VERSION + 1;
+    CHECK(com_decode_hdr(raw, &hdr) == -1);
+}
+
+/**
+ * @brief Messages fed one byte at a time come out whole and in order,
+ * including one larger than the parser's starting buffer.
+ */
+static void test_parser_bytewise() {
+    size_t bigLen = 100 * 1024;
+    char *big = malloc(bigLen);
+    for (size_t i = 0; i < bigLen; i++) {
+        big[i] = (char)(i * 7);
+    }
+    char *stream = malloc(3 * COM_HDR_SIZE + 5 + bigLen);
+    size_t total = 0;
+    total += put_msg(stream + total, QUIT_REQ, 0, 1, NULL, 0);
+    total += put_msg(stream + total, SEND_COMMAND, 0, 2, "hello", 5);
+    total += put_msg(stream + total, COMMAND_RES, COM_F_LAST, 3, big, bigLen);
+
+    struct com_parser p;
+    com_parser_init(&p, 64);
+    struct com_hdr hdr;
+    const char *payload;
+    int got = 0;
+    for (size_t i = 0; i < total; i++) {
+        size_t avail;
+        char *space = com_parser_space(&p, &avail);
+        CHECK(avail >= 1);
+        *space = stream[i];
+        com_parser_commit(&p, 1);
+        int r;
+        while ((r = com_parser_next(&p, &hdr, &payload)) == 1) {
+            got++;
+            if (got == 1) {
+                CHECK(hdr.type == QUIT_REQ && hdr.seq == 1 && hdr.len == 0);
+                CHECK(i == COM_HDR_SIZE - 1);
+            } else if (got == 2) {
+                CHECK(hdr.type == SEND_COMMAND && hdr.seq == 2 && hdr.len == 5);
+                CHECK(memcmp(payload, "hello", 5) == 0);
+            } else if (got == 3) {
+                CHECK(hdr.type == COMMAND_RES && hdr.flags == COM_F_LAST && hdr.seq == 3);
+                CHECK(hdr.len == bigLen && memcmp(payload, big, bigLen) == 0);
+                CHECK(i == total - 1);
+            }
+        }
+        CHECK(r == 0);
+    }
+    CHECK(got == 3);
+    com_parser_free(&p);
+    free(stream);
+    free(big);
+}
+
+/**
+ * @brief A corrupt header makes the parser report an error.
+ */
+static void test_parser_corrupt() {
+    struct com_parser p;
+    com_parser_init(&p, 64);
+    size_t avail;
+    char *space = com_parser_space(&p, &avail);
+    com_encode_hdr(space, SEND_COMMAND, 0, 1, 4);
+    space[4] = 0;
+    com_parser_commit(&p, COM_HDR_SIZE + 4);
+    struct com_hdr hdr;
+    const char *payload;
+    CHECK(com_parser_next(&p, &hdr, &payload) == -1);
+    com_parser_free(&p);
+}
+
+/**
+ * @brief CREDIT messages are taken out of the buffer wherever they are,
+ * and the others stay in order.
+ */
+static void test_take_credits() {
+    struct com_parser p;
+    com_parser_init(&p, 256);
+    size_t avail;
+    char *space = com_parser_space(&p, &avail);
+    uint32_t three = 3, four = 4;
+    size_t n = 0;
+    n += put_msg(space + n, SEND_COMMAND, 0, 1, "a", 1);
+    n += put_msg(space + n, CREDIT, 0, 0, &three, sizeof(three));
+    n += put_msg(space + n, SEND_COMMAND, 0, 2, "b", 1);
+    n += put_msg(space + n, CREDIT, 0, 0, &four, sizeof(four));
+    com_parser_commit(&p, n);
+    CHECK(com_parser_take_credits(&p) == 7);
+    CHECK(com_parser_take_credits(&p) == 0);
+    struct com_hdr hdr;
+    const char *payload;
+    CHECK(com_parser_next(&p, &hdr, &payload) == 1 && hdr.seq == 1 && payload[0] == 'a');
+    CHECK(com_parser_next(&p, &hdr, &payload) == 1 && hdr.seq == 2 && payload[0] == 'b');
+    CHECK(com_parser_next(&p, &hdr, &payload) == 0);
+    com_parser_free(&p);
+}
+
+/**
+ * @brief What com_write_msg sends through a pipe, com_parser_fill reads
+ * back.
+ */
+static void test_pipe() {
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    CHECK(com_write_msg(fds[1], COMMAND_RES, 0, 9, "output", 6) == COM_HDR_SIZE + 6);
+    close(fds[1]);
+    struct com_parser p;
+    com_parser_init(&p, 64);
+    struct com_hdr hdr;
+    const char *payload;
+    int r;
+    while ((r = com_parser_next(&p, &hdr, &payload)) == 0 && com_parser_fill(&p, fds[0]) > 0) {
+    }
+    CHECK(r == 1 && hdr.type == COMMAND_RES && hdr.seq == 9);
+    CHECK(hdr.len == 6 && memcmp(payload, "output", 6) == 0);
+    CHECK(com_parser_fill(&p, fds[0]) == 0);
+    close(fds[0]);
+    com_parser_free(&p);
+}
+
+int main(int argc, char *argv[]) {
+    test_header();
+    test_parser_bytewise();
+    test_parser_corrupt();
+    test_take_credits();
+    test_pipe();
+    return check_result(argv[0]);
+}
@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../comsched.h"
+#include "check.h"
+
+extern struct sched_state *sched;
+
+/**
+ * @brief Two clients that always want a slot share one in proportion to
+ * their weights.
+ */
+static void test_stride() {
+    sched_init(1, 8);
+    int clients[2] = { sched_join(1), sched_join(2) };
+    uint32_t tickets[2];
+    int grants[2] = { 0, 0 };
+    CHECK(sched_acquire(clients[0], &tickets[0]) == SCHED_GRANTED);
+    CHECK(sched_acquire(clients[1], &tickets[1]) == SCHED_QUEUED);
+    int running = 0;
+    for (int i = 0; i < 300; i++) {
+        // the client holding the slot asks again, then gives it back
+        CHECK(sched_acquire(clients[running], &tickets[running]) == SCHED_QUEUED);
+        sched_release(clients[running]);
+        int first = sched_granted(clients[0], tickets[0]);
+        int second = sched_granted(clients[1], tickets[1]);
+        CHECK(first + second == 1);
+        running = first ? 0 : 1;
+        grants[running]++;
+    }
+    CHECK(grants[1] >= 190 && grants[1] <= 210);
+    CHECK(sched->inUse == 1 && sched->waiting == 1);
+    sched_leave(clients[0]);
+    sched_leave(clients[1]);
+    CHECK(sched->inUse == 0 && sched->waiting == 0);
+}
+
+/**
+ * @brief Past the backlog commands are refused, and a client that leaves
+ * gives back its place in line.
+ */
+static void test_backlog() {
+    sched_init(1, 1);
+    int x = sched_join(1), y = sched_join(1), z = sched_join(1);
+    uint32_t tx, ty, tz;
+    CHECK(sched_acquire(x, &tx) == SCHED_GRANTED);
+    CHECK(sched_acquire(y, &ty) == SCHED_QUEUED);
+    CHECK(sched_acquire(z, &tz) == SCHED_BUSY);
+    CHECK(sched_acquire(-1, &tz) == SCHED_BUSY);
+    sched_leave(y);
+    CHECK(sched_acquire(z, &tz) == SCHED_QUEUED);
+    sched_release(x);
+    CHECK(sched_granted(z, tz));
+    sched_leave(x);
+    sched_leave(z);
+    CHECK(sched->inUse == 0 && sched->waiting == 0);
+}
+
+/**
+ * @brief A slot handed to sched_disown() outlives its client and is given
+ * back with sched_release(-1).
+ */
+static void test_disown() {
+    sched_init(1, 4);
+    int x = sched_join(1), y = sched_join(1);
+    uint32_t tx, ty;
+    CHECK(sched_acquire(x, &tx) == SCHED_GRANTED);
+    sched_disown(x);
+    sched_leave(x);
+    CHECK(sched->inUse == 1);
+    CHECK(sched_acquire(y, &ty) == SCHED_QUEUED);
+    sched_release(-1);
+    CHECK(sched_granted(y, ty));
+    sched_release(y);
+    sched_leave(y);
+    CHECK(sched->inUse == 0 && sched->waiting == 0);
+}
+
+/**
+ * @brief A process that dies holding the lock does not wedge the others,
+ * and its clients are dropped when it is reclaimed.
+ */
+static void test_dead_owner() {
+    sched_init(1, 4);
+    pid_t pid = fork();
+    if (pid == 0) {
+        uint32_t ticket;
+        sched_acquire(sched_join(1), &ticket);
+        pthread_mutex_lock(&sched->lock);
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    // would hang on a lock that is not robust
+    alarm(5);
+    int x = sched_join(1);
+    uint32_t tx;
+    CHECK(sched_acquire(x, &tx) == SCHED_QUEUED);
+    sched_reclaim(pid);
+    CHECK(sched_granted(x, tx));
+    alarm(0);
+    sched_release(x);
+    sched_leave(x);
+    CHECK(sched->inUse == 0 && sched->waiting == 0);
+}
+
+int main(int argc, char *argv[]) {
+    test_stride();
+    test_backlog();
+    test_disown();
+    test_dead_owner();
+    return check_result(argv[0]);
+}
@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "../comshm.h"
+#include "check.h"
+
+#define TEST_RING_SIZE 4096
+#define STREAM_BYTES (1 << 20)
+
+char shmName[64];
+
+/**
+ * @brief Create a segment and attach to it as the server would.
+ *
+ * @param client
+ * @param server
+ * @return int -1 on error
+ */
+static int open_pair(struct com_chan *client, struct com_chan *server) {
+    if (com_chan_create(client, shmName, TEST_RING_SIZE) == -1) {
+        return -1;
+    }
+    if (com_chan_attach(server, shmName, 0) == -1) {
+        com_chan_close(client);
+        shm_unlink(shmName);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief
+ *
+ * @param client
+ * @param server
+ */
+static void close_pair(struct com_chan *client, struct com_chan *server) {
+    com_chan_close(server);
+    com_chan_close(client);
+    shm_unlink(shmName);
+}
+
+/**
+ * @brief Space reserved across the end of the ring is contiguous, and is
+ * read back in one piece.
+ */
+static void test_wraparound() {
+    struct com_chan client, server;
+    CHECK(open_pair(&client, &server) == 0);
+    char in[TEST_RING_SIZE], out[TEST_RING_SIZE];
+    memset(in, 'a', 3000);
+    CHECK(com_chan_write(&client, in, 3000) == 3000);
+    CHECK(com_chan_pending(&server) == 3000);
+    CHECK(com_chan_read(&server, out, sizeof(out)) == 3000);
+    CHECK(com_chan_pending(&server) == 0);
+
+    char *space = com_chan_reserve(&client, 3000);
+    CHECK(space != NULL);
+    for (int i = 0; i < 3000; i++) {
+        in[i] = (char)i;
+        space[i] = (char)i;
+    }
+    com_chan_commit(&client, 3000);
+    CHECK(com_chan_read(&server, out, sizeof(out)) == 3000);
+    CHECK(memcmp(in, out, 3000) == 0);
+    close_pair(&client, &server);
+}
+
+/**
+ * @brief Head and tail are free running counters: passing 2^32 changes
+ * nothing.
+ */
+static void test_counter_wrap() {
+    struct com_chan client, server;
+    CHECK(open_pair(&client, &server) == 0);
+    struct com_shm_ctrl *ctrl = (struct com_shm_ctrl *)client.base;
+    ctrl->res.head = ctrl->res.tail = 0xffffff00u;
+    char in[1000], out[1000];
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < 1000; i++) {
+            in[i] = (char)(i + round);
+        }
+        CHECK(com_chan_write(&server, in, sizeof(in)) == sizeof(in));
+        CHECK(com_chan_pending(&client) == sizeof(in));
+        CHECK(com_chan_read(&client, out, sizeof(out)) == sizeof(out));
+        CHECK(memcmp(in, out, sizeof(in)) == 0);
+    }
+    CHECK(ctrl->res.head < 0xffffff00u);
+    close_pair(&client, &server);
+}
+
+/**
+ * @brief Far more than a ring's worth goes through intact while both
+ * sides wait on each other.
+ */
+static void test_stream() {
+    struct com_chan client, server;
+    CHECK(open_pair(&client, &server) == 0);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // the server side adds up what it gets and answers with the sum;
+        // closing the other end's mapping would close the rings as well
+        munmap(client.base, client.map_size);
+        uint64_t sum = 0;
+        size_t got = 0;
+        unsigned char buf[1000];
+        while (got < STREAM_BYTES) {
+            ssize_t n = com_chan_read(&server, buf, sizeof(buf));
+            if (n <= 0) {
+                _exit(1);
+            }
+            for (ssize_t i = 0; i < n; i++) {
+                sum = sum * 31 + buf[i];
+            }
+            got += n;
+        }
+        com_chan_write(&server, &sum, sizeof(sum));
+        _exit(0);
+    }
+    munmap(server.base, server.map_size);
+    client.peer = pid;
+    uint64_t sum = 0;
+    unsigned char chunk[1500];
+    for (size_t sent = 0; sent < STREAM_BYTES; sent += sizeof(chunk)) {
+        size_t n = STREAM_BYTES - sent < sizeof(chunk) ? STREAM_BYTES - sent : sizeof(chunk);
+        for (size_t i = 0; i < n; i++) {
+            chunk[i] = (unsigned char)((sent + i) * 13 >> 3);
+            sum = sum * 31 + chunk[i];
+        }
+        CHECK(com_chan_write(&client, chunk, n) == (ssize_t)n);
+    }
+    uint64_t answer = 0;
+    CHECK(com_chan_read(&client, &answer, sizeof(answer)) == sizeof(answer));
+    CHECK(answer == sum);
+    int status;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    com_chan_close(&client);
+    shm_unlink(shmName);
+}
+
+/**
+ * @brief Waiting times out on an empty ring, and a closed peer ends reads.
+ */
+static void test_close() {
+    struct com_chan client, server;
+    CHECK(open_pair(&client, &server) == 0);
+    CHECK(com_chan_wait(&client, 10) == 0);
+    com_chan_close(&server);
+    CHECK(com_chan_wait(&client, 10) == -1);
+    char buf[16];
+    CHECK(com_chan_read(&client, buf, sizeof(buf)) == 0);
+    com_chan_close(&client);
+    shm_unlink(shmName);
+}
+
+/**
+ * @brief The server only maps a segment whose ring size is sane and fits
+ * in the object.
+ */
+static void test_attach_checks() {
+    struct com_chan server;
+    int fd = shm_open(shmName, O_RDWR | O_CREAT | O_EXCL, 0600);
+    CHECK(fd != -1);
+    CHECK(ftruncate(fd, COM_SHM_CTRL_SIZE + 2 * TEST_RING_SIZE) == 0);
+    uint32_t sizes[] = { 0, 3 * TEST_RING_SIZE, 2 * COM_SHM_RING_SIZE, 4 * TEST_RING_SIZE, TEST_RING_SIZE };
+    int expect[] = { -1, -1, -1, -1, 0 };
+    for (int i = 0; i < 5; i++) {
+        CHECK(pwrite(fd, &sizes[i], sizeof(sizes[i]), offsetof(struct com_shm_ctrl, ring_size)) == sizeof(sizes[i]));
+        int r = com_chan_attach(&server, shmName, 0);
+        CHECK(r == expect[i]);
+        if (r == 0) {
+            com_chan_close(&server);
+        }
+    }
+    close(fd);
+    shm_unlink(shmName);
+}
+
+/**
+ * @brief A server is found through its advertisement only while it
+ * advertises and is alive.
+ */
+static void test_advertise() {
+    char mqName[64];
+    snprintf(mqName, sizeof(mqName), "/test_mq_%d", getpid());
+    CHECK(com_rings_server(mqName) == 0);
+    CHECK(com_rings_advertise(mqName, getpid()) == 0);
+    CHECK(com_rings_server(mqName) == getpid());
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    CHECK(com_rings_advertise(mqName, pid) == 0);
+    CHECK(com_rings_server(mqName) == 0);
+    CHECK(com_rings_advertise(mqName, 0) == 0);
+    CHECK(com_rings_server(mqName) == 0);
+}
+
+int main(int argc, char *argv[]) {
+    snprintf(shmName, sizeof(shmName), "/comshm_test_%d", getpid());
+    test_wraparound();
+    test_counter_wrap();
+    test_stream();
+    test_close();
+    test_attach_checks();
+    test_advertise();
+    return check_result(argv[0]);
+}